@@ -0,0 +1,167 @@
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <vector>
+#include "AllocProfiler.h"
+#include "Obj.h"
+#include "Type.h"
+#include "ByteCode.h"
+#include "Utils.h"
+
+bool                                   AllocProfiler::enabled = false;
+thread_local AllocProfiler::Site       AllocProfiler::currentSite;
+std::mutex                             AllocProfiler::mutex;
+std::vector<AllocProfiler::LocalStats*> AllocProfiler::allLocalStats;
+AllocProfiler::TypeStats               AllocProfiler::typeStats;
+AllocProfiler::SiteStats               AllocProfiler::siteStats;
+thread_local AllocProfiler::LocalStats AllocProfiler::localStats;
+
+static void Merge(AllocProfiler::TypeStats & to, const AllocProfiler::TypeStats & from) {
+    for (auto & [type, stat] : from) {
+        auto & toStat = to[type];
+        toStat.numOfAlloc    += stat.numOfAlloc;
+        toStat.numOfBytes    += stat.numOfBytes;
+        toStat.numOfSurvived += stat.numOfSurvived;
+        toStat.numOfDeleted  += stat.numOfDeleted;
+    }
+}
+
+static void Merge(AllocProfiler::SiteStats & to, const AllocProfiler::SiteStats & from) {
+    for (auto & [site, stat] : from) {
+        auto & toStat = to[site];
+        toStat.numOfAlloc += stat.numOfAlloc;
+        toStat.numOfBytes += stat.numOfBytes;
+    }
+}
+
+AllocProfiler::LocalStats::LocalStats() {
+    std::lock_guard<std::mutex> lock(AllocProfiler::mutex);
+    allLocalStats.push_back(this);
+}
+
+AllocProfiler::LocalStats::~LocalStats() {
+    std::lock_guard<std::mutex> lock(AllocProfiler::mutex);
+    allLocalStats.erase(std::find(allLocalStats.begin(), allLocalStats.end(), this));
+    Merge(AllocProfiler::typeStats, typeStats);
+    Merge(AllocProfiler::siteStats, siteStats);
+}
+
+void AllocProfiler::Enable(bool dumpAtExit) {
+    static bool isDumpRegistered = false;
+    if (dumpAtExit && !isDumpRegistered) {
+        std::atexit(Print);
+        isDumpRegistered = true;
+    }
+    enabled = true;
+}
+
+void AllocProfiler::Disable() {
+    enabled = false;
+}
+
+void AllocProfiler::Reset() {
+    std::lock_guard<std::mutex> lock(mutex);
+    typeStats.clear();
+    siteStats.clear();
+    for (auto * local : allLocalStats) {
+        std::lock_guard<std::mutex> localLock(local->mutex);
+        local->typeStats.clear();
+        local->siteStats.clear();
+    }
+}
+
+static uint LineOfPos(const ByteCode * byteCode, uint pos) {
+    // linePos[line] is the position where the line starts, lines start from 1.
+    auto & linePos = byteCode->linePos;
+    auto it = std::upper_bound(linePos.begin() + 1, linePos.end(), pos);
+    return it - (linePos.begin() + 1);
+}
+
+void AllocProfiler::OnAlloc(const Type * type, uint numOfBytes) {
+    LocalStats & local = localStats;
+    std::lock_guard<std::mutex> lock(local.mutex);
+    auto & typeStat = local.typeStats[type];
+    typeStat.numOfAlloc++;
+    typeStat.numOfBytes += numOfBytes;
+
+    // Objects created outside of bytecode (constants, builtins)
+    // are counted at line 0.
+    const ByteCode * byteCode = currentSite.byteCode;
+    uint line = byteCode == nullptr ? 0 : LineOfPos(byteCode, currentSite.pos);
+    auto & siteStat = local.siteStats[{byteCode, line}];
+    siteStat.numOfAlloc++;
+    siteStat.numOfBytes += numOfBytes;
+}
+
+void AllocProfiler::OnSweep(const Obj * obj, bool survived) {
+    // Called by gc threads, each counts into its own stats.
+    LocalStats & local = localStats;
+    std::lock_guard<std::mutex> lock(local.mutex);
+    auto & typeStat = local.typeStats[obj->type];
+    if (survived)
+        typeStat.numOfSurvived++;
+    else
+        typeStat.numOfDeleted++;
+}
+
+std::string AllocProfiler::Report() {
+    TypeStats allTypeStats;
+    SiteStats allSiteStats;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        allTypeStats = typeStats;
+        allSiteStats = siteStats;
+        for (auto * local : allLocalStats) {
+            std::lock_guard<std::mutex> localLock(local->mutex);
+            Merge(allTypeStats, local->typeStats);
+            Merge(allSiteStats, local->siteStats);
+        }
+    }
+
+    std::stringstream s;
+    std::vector<std::pair<const Type*, TypeStat>> types(allTypeStats.begin(), allTypeStats.end());
+    std::sort(types.begin(), types.end(), [](auto & a, auto & b) {
+        return a.second.numOfBytes > b.second.numOfBytes;
+    });
+
+    s << "\nAllocations by type:\n"
+      << std::setw(16) << std::left  << "type"
+      << std::setw(16) << std::right << "objects"
+      << std::setw(16) << "bytes"
+      << std::setw(12) << "survival" << '\n';
+    for (auto & [type, stat] : types) {
+        std::uint64_t numOfSeen = stat.numOfSurvived + stat.numOfDeleted;
+        s << std::setw(16) << std::left  << type->name
+          << std::setw(16) << std::right << Utils::NumSep(stat.numOfAlloc)
+          << std::setw(16) << Utils::NumSep(stat.numOfBytes);
+        if (numOfSeen == 0)
+            s << std::setw(12) << "-";
+        else
+            s << std::setw(11) << std::fixed << std::setprecision(1)
+              << 100.0 * stat.numOfSurvived / numOfSeen << '%';
+        s << '\n';
+    }
+
+    std::vector<std::pair<std::pair<const ByteCode*, uint>, SiteStat>> sites(allSiteStats.begin(), allSiteStats.end());
+    std::sort(sites.begin(), sites.end(), [](auto & a, auto & b) {
+        return a.second.numOfBytes > b.second.numOfBytes;
+    });
+
+    s << "\nAllocations by line:\n"
+      << std::setw(16) << std::left  << "line"
+      << std::setw(16) << std::right << "objects"
+      << std::setw(16) << "bytes" << '\n';
+    for (auto & [site, stat] : sites) {
+        std::string line = site.second == 0 ? "-" : std::to_string(site.second);
+        s << std::setw(16) << std::left  << line
+          << std::setw(16) << std::right << Utils::NumSep(stat.numOfAlloc)
+          << std::setw(16) << Utils::NumSep(stat.numOfBytes) << '\n';
+    }
+    return s.str();
+}
+
+void AllocProfiler::Print() {
+    std::cout << Report();
+}
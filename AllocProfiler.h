@@ -0,0 +1,81 @@
+#ifndef VIRGO_ALLOC_PROFILER_H
+#define VIRGO_ALLOC_PROFILER_H
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Common.h"
+
+struct Type;
+struct Obj;
+struct ByteCode;
+
+// Optional allocation tracking. When enabled, every object created
+// by Obj::Init is counted per type and per allocation site (bytecode
+// position, reported as a line of source), and every object seen
+// by the sweeper is counted as survived or deleted.
+// When disabled the cost is one check of a global flag.
+// Each thread counts into its own stats, they are merged by Report.
+struct AllocProfiler {
+    struct TypeStat {
+        std::uint64_t numOfAlloc{};
+        std::uint64_t numOfBytes{};
+        std::uint64_t numOfSurvived{}; // Times an object of this type survived gc.
+        std::uint64_t numOfDeleted{};
+    };
+
+    struct SiteStat {
+        std::uint64_t numOfAlloc{};
+        std::uint64_t numOfBytes{};
+    };
+
+    // Allocation site of the executing bytecode, set by VM::Execute.
+    struct Site {
+        const ByteCode * byteCode{};
+        uint             pos{};
+    };
+
+    using TypeStats = std::unordered_map<const Type*, TypeStat>;
+    using SiteStats = std::map<std::pair<const ByteCode*, uint>, SiteStat>; // Key is bytecode and line.
+
+    // Stats of one thread. Its mutex is taken by the thread on every
+    // update, other threads take it only to report or reset, so it's
+    // almost never contended.
+    struct LocalStats {
+        std::mutex mutex;
+        TypeStats  typeStats;
+        SiteStats  siteStats;
+
+        LocalStats();
+        ~LocalStats(); // Merges the stats into the stats of exited threads.
+    };
+
+    static bool enabled;
+    static thread_local Site currentSite;
+    static thread_local LocalStats localStats;
+
+    static std::mutex                mutex; // Guards allLocalStats and the stats of exited threads.
+    static std::vector<LocalStats*>  allLocalStats;
+    static TypeStats                 typeStats; // Of exited threads.
+    static SiteStats                 siteStats;
+
+    static void Enable(bool dumpAtExit);
+    static void Disable();
+    static void Reset();
+
+    static inline void SetSite(const ByteCode * byteCode, uint pos) {
+        currentSite.byteCode = byteCode;
+        currentSite.pos = pos;
+    }
+
+    static void OnAlloc(const Type * type, uint numOfBytes);
+    static void OnSweep(const Obj * obj, bool survived);
+
+    static std::string Report();
+    static void Print();
+};
+
+#endif //VIRGO_ALLOC_PROFILER_H
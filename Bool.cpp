@@ -8,15 +8,15 @@
 const char * ERROR_LOGICAL_EXPR_WRONG_TYPE =
 "Logical expressions can only be performed on objects of a boolean type.";
 
-void Bool_Equal(Obj * self, Obj * other) {
+Obj * Bool_Equal(Obj * self, Obj * other) {
     assert(self->Is(Bool::t));
 
     if (!(other->Is(Bool::t)))
-        return false;
+        return (Obj*)Bool::False;
 
     bool selfVal  = ((Bool*)self)->val;
     bool otherVal = ((Bool*)other)->val;
-    return selfVal == otherVal;
+    return (Obj*)Bool::New(selfVal == otherVal);
 }
 
 Obj * Bool::Not(Obj * self) {
@@ -60,11 +60,12 @@ Bool * Bool::True;
 
 Bool * Bool::False;
 
-Bool::Bool(bool value) : Obj{Bool::t}, value{value} {}
+Bool::Bool(bool value) : Obj{Bool::t}, val{value} {}
 
 void Bool::InitType() {
     Bool::t      = new Type("bool");
     auto mt      = t->methodTable;
+    mt->Equal    = &Bool_Equal;
     mt->DebugStr = &Bool_DebugStr;
 }
 
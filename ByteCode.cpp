@@ -24,6 +24,12 @@ void ByteCode::Enlarge() {
     maxSize = newMaxSize;
 }
 
+void ByteCode::Clear() {
+    pos        = 0;
+    numOfLines = 1;
+    linePos    = { 0, 0 };
+}
+
 uint ByteCode::Reserve_OpCode_OpArg() {
     uint savedPos = pos;
     uint numOfReservedBytes = sizeof(OpCode) + sizeof(OpArg);
@@ -67,6 +73,12 @@ void ByteCode::Write_PushInt32(int32_t val) {
     Write<int32_t>(val);
 }
 
+void ByteCode::Write_CallBuiltin(OpArg id, OpArg numOfResults) {
+    Write<OpCode>(OpCode::CallBuiltin);
+    Write<OpArg>(id);
+    Write<OpArg>(numOfResults);
+}
+
 void ByteCode::Write_Jump(OpArg toPos) {
     Write<OpCode>(OpCode::Jump);
     Write<OpArg>(toPos);
@@ -111,6 +123,7 @@ std::map<OpCode, std::string> OpCodeNames =
     { OpCode::Jump,             "Jump"             },
     { OpCode::JumpIfFalse,      "JumpIfFalse"      },
     { OpCode::Assert,           "Assert"           },
+    { OpCode::CallBuiltin,      "CallBuiltin"      },
 };
 
 void ByteCode::Print() {
@@ -170,6 +183,14 @@ void ByteCode::Print() {
                 break;
             }
 
+            case OpCode::CallBuiltin:
+            {
+                OpArg id = *((OpArg*)(bcStream + currPos));
+                currPos += 2 * sizeof(OpArg);
+                std::cout << OpCodeNames[opCode] << '\'' << VM::builtins[id].name << '\'';
+                break;
+            }
+
             default:
                 std::cout << "Unknown operation";
                 break;
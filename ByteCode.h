@@ -6,6 +6,8 @@
 #include <vector>
 #include "Common.h"
 
+struct ConstantPool;
+
 using OpCode_t = uint32_t;
 using OpArg    = uint32_t;
 
@@ -16,22 +18,22 @@ enum OpCode : OpCode_t
     CloseContext,
 
     PushConstant,
-    // Loads constant taken from the global pool of constants on the stack.
-    // Arguments : id (global identifier of a constant)
+    // Loads constant taken from the constant pool of the frame on the stack.
+    // Arguments : id (index of a constant in the pool)
     // Stack     : ---
     // Result    : Obj* (constant object on the stack)
 
 
     GetLocalVariable,
     // Loads local variable on the stack.
-    // Arguments : id (global identifier of a string constant used as a name)
+    // Arguments : id (index of a string constant used as a name)
     // Stack     : ---
     // Result    : Obj* (local variable)
 
 
     SetLocalVariable,
     // Sets value to the local variable.
-    // Arguments : id (global identifier of a string constant used as a name)
+    // Arguments : id (index of a string constant used as a name)
     // Stack     : Obj* (new value)
     // Result    : ---
 
@@ -56,6 +58,12 @@ enum OpCode : OpCode_t
     PushInt32,
     SaveByteCodePosition,
     ReadByteCodePosition,
+
+    CallBuiltin,
+    // Calls a builtin of the VM.
+    // Arguments : id (index of the builtin), numOfResults (0 for a statement, 1 for an expression)
+    // Stack     : ---
+    // Result    : Obj* (result of the builtin, if numOfResults is 1)
 };
 
 struct ByteCode {
@@ -67,11 +75,17 @@ struct ByteCode {
     uint numOfLines = 1;
     std::vector<uint> linePos { 0, 0 };
 
+    // Pool of the constant ids in the code, nullptr for the pool of the VM.
+    ConstantPool * constantPool{};
+
     explicit ByteCode();
     ~ByteCode();
 
     void Enlarge();
 
+    // Drops the code, but keeps the memory for the next one.
+    void Clear();
+
     /*
     void Write_OpCode(OpCode opCode);
     void Write_OpArg(OpArg opArg);
@@ -94,6 +108,7 @@ struct ByteCode {
     void Write_GetLocalVariable(OpArg id);
     void Write_SetLocalVariable(OpArg id);
     void Write_PushInt32(int32_t val);
+    void Write_CallBuiltin(OpArg id, OpArg numOfResults);
     void Write_Jump(OpArg toPos);
     void Write_JumpIfFalse(OpArg toPos);
     void Write_Line(uint line);
@@ -106,8 +121,8 @@ struct ByteCodeReader {
     uint pos{};
     const uint endPos;
 
-    inline ByteCodeReader(const ByteCode & byteCode) :
-    bcStream{byteCode.bcStream}, endPos{byteCode.pos} {}
+    inline ByteCodeReader(const ByteCode & byteCode, uint startPos = 0) :
+    bcStream{byteCode.bcStream}, pos{startPos}, endPos{byteCode.pos} {}
 
     inline OpCode Read_OpCode() {
         OpCode opCode = *((OpCode*)(bcStream + pos));
@@ -0,0 +1,226 @@
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include "ConstantPool.h"
+#include "Mem.h"
+#include "Obj.h"
+#include "Type.h"
+#include "None.h"
+#include "Bool.h"
+#include "Int.h"
+#include "Real.h"
+#include "Str.h"
+
+void ConstantIndex::Insert(std::size_t hash, uint id) {
+    assert(id != 0);
+    // Load factor is at most 1/2, so probe sequences stay short.
+    if ((numOfIds + 1) * 2 > slots.size()) {
+        std::vector<Slot> oldSlots(std::max<std::size_t>(slots.size() * 2, 64));
+        oldSlots.swap(slots);
+        numOfIds = 0;
+        for (auto & slot : oldSlots) {
+            if (slot.id != 0)
+                Insert(slot.hash, slot.id);
+        }
+    }
+
+    std::size_t mask = slots.size() - 1;
+    std::size_t i = hash & mask;
+    while (slots[i].id != 0)
+        i = (i + 1) & mask;
+    slots[i] = {hash, id};
+    numOfIds++;
+}
+
+void ConstantIndex::Clear() {
+    slots.clear();
+    numOfIds = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+const uint ConstantPool::NUM_OF_SHARED = 3;
+
+thread_local ConstantPool * ConstantPool::current;
+
+std::atomic<uint> ConstantPool::numOfPools;
+MemBudget         ConstantPool::budget;
+
+ConstantPool::ConstantPool(const ConstantPool * parent) : domain{NewDomain()}, parent{parent} {
+    numOfPools++;
+}
+
+ConstantPool::~ConstantPool() {
+    assert(numOfFrames == 0);
+    if (current == this)
+        current = nullptr;
+    delete domain;
+    numOfPools--;
+}
+
+void ConstantPool::Release(std::unique_ptr<ConstantPool> pool) {
+    if (pool == nullptr || pool->numOfFrames == 0)
+        return;
+    pool->isReleased = true;
+    pool.release();
+}
+
+MemDomain * ConstantPool::NewDomain() {
+    auto * newDomain = new MemDomain();
+    newDomain->SetFlag_IsConstant(true);
+    newDomain->limitNumOfPages = UINT32_MAX;
+    newDomain->budget = &budget;
+    return newDomain;
+}
+
+std::size_t ConstantPool::HashStr(std::string_view val) {
+    return std::hash<std::string_view>{}(val);
+}
+
+// Returns the id of the constant for which isEqual(obj) is true,
+// it's created by newObj() if neither the pool nor its parent has it.
+template<class IsEqual, class NewObj>
+static uint Intern(ConstantPool & pool, ConstantIndex ConstantPool::* index,
+                   std::size_t hash, IsEqual isEqual, NewObj newObj)
+{
+    auto find = [&](const ConstantPool & p) {
+        return (p.*index).Find(hash, [&](uint id) { return isEqual(p.objects[id]); });
+    };
+    uint id = find(pool);
+    if (id != 0)
+        return id;
+
+    Obj * obj = nullptr;
+    if (pool.parent != nullptr) {
+        uint parentId = find(*pool.parent);
+        if (parentId != 0)
+            obj = pool.parent->objects[parentId];
+    }
+    if (obj == nullptr)
+        obj = newObj();
+    id = pool.Add(obj);
+    (pool.*index).Insert(hash, id);
+    return id;
+}
+
+uint ConstantPool::GetId_Int(v_int val) {
+    return Intern(*this, &ConstantPool::ids_Int, std::hash<v_int>{}(val),
+        [&](Obj * obj) { return ((Int*)obj)->val == val; },
+        [&]() {
+            void * inPlace = domain->GetChunk(sizeof(Int));
+            Int::New(inPlace, val);
+            return (Obj*)inPlace;
+        });
+}
+
+uint ConstantPool::GetId_Real(v_real val) {
+    return Intern(*this, &ConstantPool::ids_Real, std::hash<v_real>{}(val),
+        [&](Obj * obj) { return ((Real*)obj)->val == val; },
+        [&]() {
+            void * inPlace = domain->GetChunk(sizeof(Real));
+            Real::New(inPlace, val);
+            return (Obj*)inPlace;
+        });
+}
+
+uint ConstantPool::GetId_Str(std::string_view val, std::size_t hash) {
+    return Intern(*this, &ConstantPool::ids_Str, hash,
+        [&](Obj * obj) { return std::string_view(((Str*)obj)->val, ((Str*)obj)->len) == val; },
+        [&]() {
+            void * inPlace = domain->GetChunk(Str::ChunkSize(val.size()));
+            Str::New(inPlace, val.data(), val.size());
+            return (Obj*)inPlace;
+        });
+}
+
+uint ConstantPool::Add(Obj * obj) {
+    objects.push_back(obj);
+    return objects.size() - 1;
+}
+
+bool ConstantPool::Index(uint id) {
+    Obj * obj = objects[id];
+    if (obj->type == Int::t)
+        ids_Int.Insert(std::hash<v_int>{}(((Int*)obj)->val), id);
+    else if (obj->type == Real::t)
+        ids_Real.Insert(std::hash<v_real>{}(((Real*)obj)->val), id);
+    else if (obj->type == Str::t)
+        ids_Str.Insert(HashStr(std::string_view(((Str*)obj)->val, ((Str*)obj)->len)), id);
+    else
+        return false;
+    return true;
+}
+
+void ConstantPool::AddShared() {
+    assert(objects.empty());
+    Add((Obj*)None::none);
+    Add((Obj*)Bool::True);
+    Add((Obj*)Bool::False);
+}
+
+std::vector<uint> ConstantPool::Compact(const std::vector<uint> & liveIds) {
+    std::vector<Obj**> slots;
+    Heap::GetSlots(slots);
+    std::unordered_set<Obj*> liveObjects;
+    for (auto ** slot : slots)
+        liveObjects.insert(*slot);
+    for (uint id : liveIds)
+        liveObjects.insert(objects[id]);
+
+    MemDomain * oldDomain = domain;
+    std::vector<Obj*> oldObjects;
+    oldObjects.swap(objects);
+    ids_Int.Clear();
+    ids_Real.Clear();
+    ids_Str.Clear();
+    domain = NewDomain();
+
+    // Constants of the parent are kept as they are, only ids change.
+    std::vector<uint> newIds(oldObjects.size());
+    std::unordered_map<Obj*, Obj*> forwarding;
+    for (uint id = 0; id < oldObjects.size(); id++) {
+        Obj * obj = oldObjects[id];
+        if (id >= NUM_OF_SHARED && liveObjects.count(obj) == 0)
+            continue;
+        if (Page::GetPage(obj)->domain == oldDomain) {
+            Obj *& moved = forwarding[obj];
+            if (moved == nullptr) {
+                uint chunkSize = Page::GetPage(obj)->chunkSize;
+                moved = (Obj*)domain->GetChunk(chunkSize);
+                memcpy((void*)moved, obj, chunkSize);
+                auto movedMethod = moved->type->methodTable->Moved;
+                if (movedMethod != nullptr)
+                    movedMethod(moved);
+                Page::FreeChunk((std::byte*)obj);
+            }
+            obj = moved;
+        }
+        newIds[id] = Add(obj);
+        if (id >= NUM_OF_SHARED)
+            Index(newIds[id]);
+    }
+
+    for (auto ** slot : slots) {
+        auto it = forwarding.find(*slot);
+        if (it != forwarding.end())
+            *slot = it->second;
+    }
+    if (Heap::RootsMoved != nullptr)
+        Heap::RootsMoved(forwarding);
+    delete oldDomain;
+    return newIds;
+}
+
+void ConstantPool::AddFrame() {
+    numOfFrames++;
+}
+
+void ConstantPool::RemoveFrame() {
+    assert(numOfFrames > 0);
+    numOfFrames--;
+    if (numOfFrames == 0 && isReleased)
+        delete this;
+}
@@ -0,0 +1,112 @@
+#ifndef VIRGO_CONSTANT_POOL_H
+#define VIRGO_CONSTANT_POOL_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <string_view>
+#include <vector>
+#include "Common.h"
+
+struct Obj;
+struct MemDomain;
+struct MemBudget;
+
+// Ids of interned constants by hashes of their values. It's an open
+// addressing table, values are not stored, they are compared with
+// the constants themselves. Id 0 (none) is never interned,
+// so it marks empty slots.
+struct ConstantIndex {
+    struct Slot {
+        std::size_t hash;
+        uint        id;
+    };
+    std::vector<Slot> slots;
+    uint              numOfIds{};
+
+    // Returns 0 if there is no constant with the hash, for which isEqual(id) is true.
+    template<class IsEqual>
+    uint Find(std::size_t hash, IsEqual isEqual) const {
+        if (slots.empty())
+            return 0;
+        std::size_t mask = slots.size() - 1;
+        for (std::size_t i = hash & mask; ; i = (i + 1) & mask) {
+            const Slot & slot = slots[i];
+            if (slot.id == 0)
+                return 0;
+            if (slot.hash == hash && isEqual(slot.id))
+                return slot.id;
+        }
+    }
+
+    void Insert(std::size_t hash, uint id);
+    void Clear();
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Constants by ids. Constants are created in the domain of the pool
+// and deduplicated by value. Each script has a pool of its own, which is
+// filled while it's tokenized and parsed (see ConstantPool::current) and
+// freed with the script, so code gets its constants by index without any
+// global state. The VM has a pool too: shared constants, constants loaded
+// from an image or frozen before fork. It's the parent of script pools,
+// its constants are found and referred to rather than copied.
+// A pool is used by one thread at a time, its parent is only read.
+struct ConstantPool {
+    // None, true and false come first in every pool with ids 0, 1, 2.
+    static const uint NUM_OF_SHARED;
+
+    // If it's set, VM::GetConstantId_* intern into it rather than into the VM.
+    static thread_local ConstantPool * current;
+
+    // Pools that are alive, and pages of their domains.
+    static std::atomic<uint> numOfPools;
+    static MemBudget         budget;
+
+    std::vector<Obj*>    objects;
+    ConstantIndex        ids_Int;
+    ConstantIndex        ids_Real;
+    ConstantIndex        ids_Str;
+    MemDomain *          domain{};
+    const ConstantPool * parent{};
+
+    // Frames of exec stacks that run code of the pool. Their variables
+    // may refer to its constants, so the pool can't be freed before them.
+    uint numOfFrames{};
+    bool isReleased{};
+
+    explicit ConstantPool(const ConstantPool * parent = nullptr);
+    ConstantPool(const ConstantPool &) = delete;
+    ConstantPool & operator=(const ConstantPool &) = delete;
+    ~ConstantPool();
+
+    // Frees the pool, or leaves it to the last frame that runs its code.
+    static void Release(std::unique_ptr<ConstantPool> pool);
+
+    static std::size_t HashStr(std::string_view val);
+    static MemDomain * NewDomain();
+
+    uint GetId_Int(v_int val);
+    uint GetId_Real(v_real val);
+    uint GetId_Str(std::string_view val, std::size_t hash);
+    uint Add(Obj * obj);
+    Obj * Get(uint id) const { return objects.at(id); }
+    uint Size() const { return objects.size(); }
+
+    // Makes an existing constant findable by value, returns false for types
+    // that are not deduplicated.
+    bool Index(uint id);
+    void AddShared();
+
+    // Moves the constants that the heap, the roots of the VM or 'liveIds'
+    // refer to into a new domain and frees the others, like Heap::Compact
+    // does with garbage. Returns new ids by old ones (0 for freed constants),
+    // code compiled with the old ids can't be run anymore.
+    std::vector<uint> Compact(const std::vector<uint> & liveIds);
+
+    void AddFrame();
+    void RemoveFrame();
+};
+
+#endif //VIRGO_CONSTANT_POOL_H
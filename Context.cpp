@@ -1,6 +1,7 @@
 #include <sstream>
 #include <iostream>
 #include "Context.h"
+#include "Type.h"
 #include "Str.h"
 #include "Error.h"
 
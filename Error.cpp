@@ -1,19 +1,40 @@
 #include <sstream>
 #include <utility>
+#include <cstring>
+#include <cstdlib>
 #include "Type.h"
 #include "Error.h"
+#include "Mem.h"
 
 Type * Error::t;
 
+void Error_Delete(Obj * self) {
+    auto * err = (Error*)self;
+    if (err->message == nullptr)
+        return; // The message couldn't be allocated.
+    Heap::RemoveExternalMemory(self, strlen(err->message) + 1);
+    free(err->message);
+    err->message = nullptr;
+}
+
 void Error::InitType() {
     t = new Type("error");
+    t->methodTable->Delete = &Error_Delete;
 }
 
 Error * Error::New(const std::string & message, uint srcLine /* = 0 */) {
     Error * err = (Error*) Heap::GetChunk_Baby(sizeof(Error));
     Obj::Init(err, Error::t);
     err->srcLine = srcLine;
-    err->message = message;
+    err->message = nullptr;
+    std::size_t size = strlen(message.c_str()) + 1;
+    Heap::AddExternalMemory((Obj*)err, size);
+    err->message = (char*)malloc(size);
+    if (err->message == nullptr) {
+        Heap::RemoveExternalMemory((Obj*)err, size);
+        throw OutOfMemoryError("Out of memory. Can't allocate error message.");
+    }
+    memcpy(err->message, message.c_str(), size);
     return err;
 }
 
@@ -4,9 +4,9 @@
 #include "Obj.h"
 
 struct Error {
-    Obj         obj;
-    uint        srcLine;
-    std::string message;
+    Obj    obj;
+    uint   srcLine;
+    char * message; // Allocated outside of the heap.
 
     static Type * t;
     static void InitType();
@@ -1,12 +1,90 @@
+#include <algorithm>
 #include <cassert>
+#include <cstdint>
+#include <cstdlib>
 #include <iostream>
 #include "Expr.h"
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
+SyntaxError::SyntaxError(const std::string & message, uint line) :
+std::runtime_error("Syntax error. Line " + std::to_string(line) + ". " + message) {}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+const std::size_t ExprArena::BLOCK_SIZE = 64 * 1024;
+
+thread_local ExprArena * ExprArena::current;
+
+ExprArena::~ExprArena() {
+    if (current == this)
+        current = nullptr;
+    for (auto * node : nodes)
+        node->~Expr();
+    for (auto * block : blocks)
+        free(block);
+}
+
+static inline std::byte * AlignUp(std::byte * ptr, std::size_t alignment) {
+    return (std::byte*)(((std::uintptr_t)ptr + alignment - 1) / alignment * alignment);
+}
+
+void * ExprArena::Allocate(std::size_t size, std::size_t alignment) {
+    numOfBytes += size;
+    std::byte * mem = AlignUp(pos, alignment);
+    if (pos != nullptr && (std::size_t)(end - mem) >= size && mem <= end) {
+        pos = mem + size;
+        return mem;
+    }
+
+    // Big lists get blocks of their own, so the rest
+    // of the current block is not wasted.
+    if (size + alignment > BLOCK_SIZE) {
+        auto * block = (std::byte*)malloc(size + alignment);
+        blocks.push_back(block);
+        return AlignUp(block, alignment);
+    }
+
+    auto * block = (std::byte*)malloc(BLOCK_SIZE);
+    blocks.push_back(block);
+    mem = AlignUp(block, alignment);
+    pos = mem + size;
+    end = block + BLOCK_SIZE;
+    return mem;
+}
+
+void ExprArena::AddNode(Expr * node) {
+    nodes.push_back(node);
+}
+
+void ExprArena::Reset() {
+    for (auto * node : nodes)
+        node->~Expr();
+    nodes.clear();
+
+    // The block of the last nodes is kept, big lists have blocks of their own.
+    std::byte * keptBlock = end == nullptr ? nullptr : end - BLOCK_SIZE;
+    for (auto * block : blocks) {
+        if (block != keptBlock)
+            free(block);
+    }
+    blocks.clear();
+    if (keptBlock != nullptr)
+        blocks.push_back(keptBlock);
+    pos        = keptBlock;
+    numOfBytes = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
 Expr::Expr(ExprType exprType, uint line):
 exprType{exprType}, line{line} {}
 
+void * Expr::operator new(std::size_t size) {
+    assert(ExprArena::current != nullptr);
+    return ExprArena::current->Allocate(size, alignof(std::max_align_t));
+}
+
 Expr * Expr::GetParentOfType(ExprType parentType) {
     auto * parent = parentExpr;
     while (parent != nullptr) {
@@ -22,20 +100,11 @@ Expr * Expr::GetParentOfType(ExprType parentType) {
 ExprUnary::ExprUnary(ExprType exprType, Expr * a, uint line):
 Expr{exprType, line}, a{a} {}
 
-ExprUnary::~ExprUnary() {
-    delete a;
-}
-
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
 ExprBinary::ExprBinary(ExprType exprType, Expr * a, Expr * b, uint line):
 Expr{exprType, line}, a{a}, b{b} {}
 
-ExprBinary::~ExprBinary() {
-    delete a;
-    delete b;
-}
-
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
 ExprPushConstant::ExprPushConstant(uint id, uint line):
@@ -302,54 +371,30 @@ void ExprPowerAssign::Compile(ByteCode & bc) {
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
 ExprLabel::ExprLabel(std::string labelName, uint line):
-Expr(ExprType::Label, line), labelName{labelName} {}
+Expr(ExprType::Label, line), labelName{labelName} {
+    ExprArena::current->AddNode(this);
+}
 
 void ExprLabel::Compile(ByteCode & bc) {
     auto * labelAggregator = GetParentOfType(ExprType::Script);
     assert(labelAggregator != nullptr);
     uint labelPos = bc.pos;
-    ((ExprScript*)labelAggregator)->AddLabel(labelName, labelPos, line);
+    ((ExprScript*)labelAggregator)->AddLabel(labelName, labelPos, line, bc);
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
 ExprJump::ExprJump(std::string labelName, uint line):
-Expr(ExprType::Jump, line), labelName{labelName} {}
-
-void ExprJump::Compile(ByteCode & bc) {
-    bc.Write_Line(line);
-    pos_Jump = bc.Reserve_OpCode_OpArg();
+Expr(ExprType::Jump, line), labelName{labelName} {
+    ExprArena::current->AddNode(this);
 }
 
-void ExprJump::Correct(ByteCode & bc) {
+void ExprJump::Compile(ByteCode & bc) {
     auto * labelAggregator = GetParentOfType(ExprType::Script);
     assert(labelAggregator != nullptr);
-    uint jumpToPos = ((ExprScript*)labelAggregator)->GetLabelPos(labelName, line);
-    bc.Write_OpCode_OpArg_AtPos(pos_Jump, OpCode::Jump, jumpToPos);
-}
-
-void CorrectJumpsRecursive(std::vector<Expr*> & expressions, ByteCode & bc) {
-    for (size_t i = 0; i < expressions.size(); i++)
-    {
-        auto * expr = expressions[i];
-        switch (expr->exprType)
-        {
-            case ExprType::Jump:
-                ((ExprJump*)expr)->Correct(bc);
-                break;
-
-            case ExprType::If:
-                ((ExprIf*)expr)->CorrectJumps(bc);
-                break;
-
-            case ExprType::For:
-                ((ExprFor*)expr)->CorrectJumps(bc);
-                break;
-
-            default:
-                break;
-        }
-    }
+    bc.Write_Line(line);
+    uint pos_Jump = bc.Reserve_OpCode_OpArg();
+    ((ExprScript*)labelAggregator)->AddJump(labelName, pos_Jump, line, bc);
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -358,42 +403,11 @@ ExprBreak::ExprBreak(uint line):
 Expr(ExprType::Break, line) {}
 
 void ExprBreak::Compile(ByteCode & bc) {
-    bc.Write_Line(line);
-    pos_Jump = bc.Reserve_OpCode_OpArg();
-}
-
-void ExprBreak::Correct(ByteCode & bc) {
     auto * exprFor = (ExprFor*)GetParentOfType(ExprType::For);
-    if (exprFor == nullptr) {
-        std::cerr << "Syntax error. Line " << line << ". "
-                  << "Can't find outer 'for' loop for a 'break' statement.";
-        abort();
-    }
-    bc.Write_OpCode_OpArg_AtPos(pos_Jump, OpCode::Jump, exprFor->pos_AfterFor);
-}
-
-void CorrectBreaksRecursive(std::vector<Expr*> & expressions, ByteCode & bc) {
-    for (size_t i = 0; i < expressions.size(); i++)
-    {
-        auto * expr = expressions[i];
-        switch (expr->exprType)
-        {
-            case ExprType::Break:
-                ((ExprBreak*)expr)->Correct(bc);
-                break;
-
-            case ExprType::If:
-                ((ExprIf*)expr)->CorrectBreaks(bc);
-                break;
-
-            case ExprType::For:
-                ((ExprFor*)expr)->CorrectBreaks(bc);
-                break;
-
-            default:
-                break;
-        }
-    }
+    if (exprFor == nullptr)
+        throw SyntaxError("Can't find outer 'for' loop for a 'break' statement.", line);
+    bc.Write_Line(line);
+    exprFor->breaks.push_back(bc.Reserve_OpCode_OpArg());
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -402,49 +416,14 @@ ExprSkip::ExprSkip(uint line):
 Expr(ExprType::Skip, line) {}
 
 void ExprSkip::Compile(ByteCode & bc) {
-    bc.Write_Line(line);
-    pos_Jump = bc.Reserve_OpCode_OpArg();
-}
-
-void ExprSkip::Correct(ByteCode & bc) {
-    // Get parent of ExprFor type
     auto * exprFor = (ExprFor*)GetParentOfType(ExprType::For);
-    if (exprFor == nullptr) {
-        std::cerr << "Syntax error. Line " << line
-                  << ". Can't find outer 'for' loop for a 'skip' statement.";
-        abort();
-    }
-
-    if (exprFor->pos_StartIteration == 0) {
-        std::cerr << "Syntax error. Line " << line
-                  << ". Can't find iteration code in outer 'for' loop for a 'skip' statement.";
-        abort();
-    }
-    bc.Write_OpCode_OpArg_AtPos(pos_Jump, OpCode::Jump, exprFor->pos_StartIteration);
-}
+    if (exprFor == nullptr)
+        throw SyntaxError("Can't find outer 'for' loop for a 'skip' statement.", line);
 
-void CorrectSkipsRecursive(std::vector<Expr*> & expressions, ByteCode & bc) {
-    for (size_t i = 0; i < expressions.size(); i++)
-    {
-        auto * expr = expressions[i];
-        switch (expr->exprType)
-        {
-            case ExprType::Skip:
-                ((ExprSkip*)expr)->Correct(bc);
-                break;
-
-            case ExprType::If:
-                ((ExprIf*)expr)->CorrectSkips(bc);
-                break;
-
-            case ExprType::For:
-                ((ExprFor*)expr)->CorrectSkips(bc);
-                break;
-
-            default:
-                break;
-        }
-    }
+    if (exprFor->forType != ForType::CStyled || exprFor->iter.empty())
+        throw SyntaxError("Can't find iteration code in outer 'for' loop for a 'skip' statement.", line);
+    bc.Write_Line(line);
+    exprFor->skips.push_back(bc.Reserve_OpCode_OpArg());
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -560,27 +539,6 @@ pos_StartFalseBranch -> --------------------------------
     bc.Write_OpCode_OpArg_AtPos(pos_AfterTrueBranch, OpCode::Jump, pos_AfterIf);
 }
 
-void ExprIf::CorrectJumps(ByteCode & bc) {
-    std::vector <Expr*> all;
-    all.insert(all.end(), trueBranch.begin(), trueBranch.end());
-    all.insert(all.end(), falseBranch.begin(), falseBranch.end());
-    CorrectJumpsRecursive(all, bc);
-}
-
-void ExprIf::CorrectBreaks(ByteCode & bc) {
-    std::vector <Expr*> all;
-    all.insert(all.end(), trueBranch.begin(), trueBranch.end());
-    all.insert(all.end(), falseBranch.begin(), falseBranch.end());
-    CorrectBreaksRecursive(all, bc);
-}
-
-void ExprIf::CorrectSkips(ByteCode & bc) {
-    std::vector <Expr*> all;
-    all.insert(all.end(), trueBranch.begin(), trueBranch.end());
-    all.insert(all.end(), falseBranch.begin(), falseBranch.end());
-    CorrectSkipsRecursive(all, bc);
-}
-
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
 ExprFor::ExprFor(uint line):
@@ -618,8 +576,7 @@ void ExprFor::Compile(ByteCode & bc) {
             break;
 
         default:
-            std::cerr << "Unknown type of 'for' loop.";
-            abort();
+            throw SyntaxError("Unknown type of 'for' loop.", line);
     }
 }
 
@@ -670,6 +627,7 @@ Diagram:
 
     pos_AfterFor = bc.pos;
     bc.Write_OpCode_OpArg_AtPos(pos_AfterCondition, OpCode::JumpIfFalse, pos_AfterFor);
+    FixBreaksAndSkips(bc);
 }
 
 void ExprFor::Compile_CStyled(ByteCode & bc) {
@@ -737,18 +695,14 @@ Diagram:
 
     pos_AfterFor = bc.pos;
     bc.Write_OpCode_OpArg_AtPos(pos_AfterCondition, OpCode::JumpIfFalse, pos_AfterFor);
+    FixBreaksAndSkips(bc);
 }
 
-void ExprFor::CorrectJumps(ByteCode & bc) {
-    CorrectJumpsRecursive(body, bc);
-}
-
-void ExprFor::CorrectBreaks(ByteCode & bc) {
-    CorrectBreaksRecursive(body, bc);
-}
-
-void ExprFor::CorrectSkips(ByteCode & bc) {
-    CorrectSkipsRecursive(body, bc);
+void ExprFor::FixBreaksAndSkips(ByteCode & bc) {
+    for (uint pos : breaks)
+        bc.Write_OpCode_OpArg_AtPos(pos, OpCode::Jump, pos_AfterFor);
+    for (uint pos : skips)
+        bc.Write_OpCode_OpArg_AtPos(pos, OpCode::Jump, pos_StartIteration);
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -823,39 +777,80 @@ void ExprAssert::Compile(ByteCode & bc) {
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
+ExprCallBuiltin::ExprCallBuiltin(uint builtinId, uint line) :
+Expr(ExprType::CallBuiltin, line), builtinId{builtinId} {}
+
+void ExprCallBuiltin::Compile(ByteCode & bc) {
+    bc.Write_Line(line);
+    bc.Write_CallBuiltin(builtinId, isStatement ? 0 : 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
 ExprScript::ExprScript() :
-Expr(ExprType::Script, 0) {}
+Expr(ExprType::Script, 0) {
+    ExprArena::current->AddNode(this);
+}
 
 void ExprScript::AddExpr(Expr * expr) {
     expressions.push_back(expr);
     expr->parentExpr = this;
 }
 
-void ExprScript::AddLabel(std::string labelName, uint labelPos, uint labelLine) {
-    if (labels.count(labelName) > 0) {
-        std::cout << "Syntax Error. Line " << labelLine
-                  << ". Redefinition of '" << labelName << "' label.";
-        abort();
-    }
-    labels[labelName] = labelPos;
+void ExprScript::AddLabel(const std::string & labelName, uint labelPos, uint labelLine, ByteCode & bc) {
+    Label & label = labels[labelName];
+    if (label.isDefined)
+        throw SyntaxError("Redefinition of '" + labelName + "' label.", labelLine);
+    label.pos       = labelPos;
+    label.isDefined = true;
+    numOfDefinedLabels++;
+    if (!label.fixups.empty())
+        numOfUndefinedLabels--;
+
+    // Jumps that were compiled before the label.
+    for (uint pos : label.fixups)
+        bc.Write_OpCode_OpArg_AtPos(pos, OpCode::Jump, labelPos);
+    label.fixups.clear();
 }
 
-uint ExprScript::GetLabelPos(std::string labelName, uint jumpLine) {
-    if (labels.count(labelName) == 0) {
-        std::cout << "Syntax Error. Line " << jumpLine
-                  << ". No such label '" << labelName << "'.";
-        abort();
+void ExprScript::AddJump(const std::string & labelName, uint jumpPos, uint jumpLine, ByteCode & bc) {
+    Label & label = labels[labelName];
+    if (label.isDefined) {
+        bc.Write_OpCode_OpArg_AtPos(jumpPos, OpCode::Jump, label.pos);
+        return;
+    }
+    if (label.fixups.empty()) {
+        label.firstJumpLine = jumpLine;
+        numOfUndefinedLabels++;
     }
-    return labels[labelName];
+    label.fixups.push_back(jumpPos);
 }
 
 void ExprScript::Compile(ByteCode & bc) {
-    bc.Write_NewContext();
+    BeginCompile(bc);
     for (size_t i = 0; i < expressions.size(); i++) {
         expressions[i]->Compile(bc);
     }
-    //bc.Write_CloseContext();
-    CorrectJumpsRecursive(expressions, bc);
-    CorrectBreaksRecursive(expressions, bc);
-    CorrectSkipsRecursive(expressions, bc);
+    EndCompile();
+}
+
+void ExprScript::BeginCompile(ByteCode & bc) {
+    bc.Write_NewContext();
+}
+
+void ExprScript::CompileExpr(Expr * expr, ByteCode & bc) {
+    expr->parentExpr = this;
+    expr->Compile(bc);
+}
+
+// The context of the script is not closed by its code. Statements
+// streamed later run in it, and the host may read its variables after
+// the script ran. The stack closes it (ExecStack::Unwind, ~ExecStack).
+void ExprScript::EndCompile() {
+    if (numOfUndefinedLabels == 0)
+        return;
+    for (auto & [labelName, label] : labels) {
+        if (!label.isDefined)
+            throw SyntaxError("No such label '" + labelName + "'.", label.firstJumpLine);
+    }
 }
@@ -1,12 +1,21 @@
 #ifndef VIRGO_EXPR_H
 #define VIRGO_EXPR_H
 
+#include <cstddef>
 #include <string>
 #include <vector>
 #include <map>
+#include <stdexcept>
+#include <unordered_map>
 #include "Common.h"
 #include "ByteCode.h"
 
+// Thrown by the parser and by the compiler of expressions, so an error
+// in one script doesn't stop the others, see Script::CompileAll.
+struct SyntaxError : std::runtime_error {
+    SyntaxError(const std::string & message, uint line);
+};
+
 enum class ExprType
 {
     Undefined,
@@ -42,31 +51,96 @@ enum class ExprType
     DivideAssign,
     PowerAssign,
     Assert,
+    CallBuiltin,
     Script,
 };
 
+struct Expr;
+
+// Memory of the expression tree of one script. Nodes and their child
+// lists are placed one after another in big blocks in the order
+// of parsing, and all of them are freed at once after compilation.
+// Nodes are allocated from the current arena of the thread,
+// so the parser creates them with plain 'new'. Destructors are not
+// called, except for the few nodes that own memory outside of the
+// arena (names of labels, the label map), they register with AddNode.
+class ExprArena {
+    static const std::size_t BLOCK_SIZE;
+
+    std::vector<std::byte*> blocks;
+    std::byte *             pos{};
+    std::byte *             end{};
+    std::vector<Expr*>      nodes; // Nodes which destructors must be called.
+    std::size_t             numOfBytes{};
+
+public:
+    static thread_local ExprArena * current;
+
+    ExprArena() = default;
+    ExprArena(const ExprArena &) = delete;
+    ExprArena & operator=(const ExprArena &) = delete;
+    ~ExprArena();
+
+    void * Allocate(std::size_t size, std::size_t alignment);
+    void AddNode(Expr * node);
+    std::size_t NumOfBytes() const { return numOfBytes; }
+
+    // Frees all nodes, but keeps a block for the next ones.
+    void Reset();
+};
+
+// Allocator of child lists of nodes. Memory of a list that grows
+// is not reused, it's freed with the arena.
+template<class T>
+struct ExprArenaAllocator {
+    using value_type = T;
+
+    ExprArena * arena;
+
+    ExprArenaAllocator() : arena{ExprArena::current} {}
+
+    template<class U>
+    ExprArenaAllocator(const ExprArenaAllocator<U> & other) : arena{other.arena} {}
+
+    T * allocate(std::size_t n) { return (T*)arena->Allocate(n * sizeof(T), alignof(T)); }
+    void deallocate(T *, std::size_t) {}
+
+    template<class U>
+    bool operator==(const ExprArenaAllocator<U> & other) const { return arena == other.arena; }
+    template<class U>
+    bool operator!=(const ExprArenaAllocator<U> & other) const { return arena != other.arena; }
+};
+
+using ExprVector = std::vector<Expr*, ExprArenaAllocator<Expr*>>;
+
+// Positions of reserved jump instructions, which are written
+// when the position they jump to becomes known.
+using FixupVector = std::vector<uint, ExprArenaAllocator<uint>>;
+
 struct Expr {
     const ExprType exprType;
     const uint line;
-    Expr * parentExpr;
+    Expr * parentExpr{};
 
     Expr(ExprType exprType, uint line);
     Expr * GetParentOfType(ExprType parentType);
     virtual void Compile(ByteCode & bc) = 0;
     virtual ~Expr() = default;
+
+    // Nodes are never deleted one by one, see ExprArena.
+    static void * operator new(std::size_t size);
+    static void operator delete(void *) {}
 };
 
 struct ExprUnary : Expr {
     Expr * a;
     ExprUnary(ExprType exprType, Expr * a, uint line);
-    ~ExprUnary() override;
 };
 
 struct ExprBinary : Expr {
     Expr * a;
     Expr * b;
     ExprBinary(ExprType exprType, Expr * a, Expr * b, uint line);
-    ~ExprBinary() override;
 };
 
 struct ExprPushConstant : Expr {
@@ -183,39 +257,30 @@ struct ExprLabel : Expr {
 
 struct ExprJump : Expr {
     std::string labelName;
-    uint pos_Jump{};
     ExprJump(std::string labelName, uint line);
     void Compile(ByteCode & bc) override;
-    void Correct(ByteCode & bc);
 };
 
 struct ExprBreak : Expr {
-    uint pos_Jump{};
     explicit ExprBreak(uint line);
     void Compile(ByteCode & bc) override;
-    void Correct(ByteCode & bc);
 };
 
 struct ExprSkip : Expr {
-    uint pos_Jump{};
     explicit ExprSkip(uint line);
     void Compile(ByteCode & bc) override;
-    void Correct(ByteCode & bc);
 };
 
 struct ExprIf : Expr {
     Expr * condition{};
-    std::vector<Expr*> trueBranch;
-    std::vector<Expr*> falseBranch;
+    ExprVector trueBranch;
+    ExprVector falseBranch;
 
     explicit ExprIf(uint line);
     void SetCondition(Expr * expr);
     void AddTrueExpr(Expr * expr);
     void AddFalseExpr(Expr * expr);
     void Compile(ByteCode & bc) override;
-    void CorrectJumps(ByteCode & bc);
-    void CorrectBreaks(ByteCode & bc);
-    void CorrectSkips(ByteCode & bc);
 };
 
 enum class ForType
@@ -228,12 +293,14 @@ enum class ForType
 
 struct ExprFor : Expr {
     ForType            forType{};
-    std::vector<Expr*> init;
+    ExprVector         init;
     Expr *             condition{};
-    std::vector<Expr*> iter;
-    std::vector<Expr*> body;
+    ExprVector         iter;
+    ExprVector         body;
     uint               pos_AfterFor{};
     uint               pos_StartIteration{};
+    FixupVector        breaks; // Jump to pos_AfterFor.
+    FixupVector        skips;  // Jump to pos_StartIteration.
 
     explicit ExprFor(uint line);
     void AddInitExpr(Expr * expr);
@@ -243,9 +310,7 @@ struct ExprFor : Expr {
     void Compile(ByteCode & bc) override;
     void Compile_Ordinary(ByteCode & bc);
     void Compile_CStyled(ByteCode & bc);
-    void CorrectJumps(ByteCode & bc);
-    void CorrectBreaks(ByteCode & bc);
-    void CorrectSkips(ByteCode & bc);
+    void FixBreaksAndSkips(ByteCode & bc);
 };
 
 struct ExprDot : Expr {
@@ -261,7 +326,7 @@ struct ExprDot : Expr {
 };
 
 struct ExprArgs : Expr {
-    std::vector<Expr*> args;
+    ExprVector args;
     ExprArgs(uint line);
     void AddArgExpr(Expr * arg);
     void Compile(ByteCode & bc) override;
@@ -276,15 +341,39 @@ struct ExprAssert : Expr {
     void Compile(ByteCode & bc) override;
 };
 
+struct ExprCallBuiltin : Expr {
+    uint builtinId;
+    bool isStatement{}; // The result is not used.
+
+    ExprCallBuiltin(uint builtinId, uint line);
+    void Compile(ByteCode & bc) override;
+};
+
 struct ExprScript : Expr {
-    std::vector<Expr*> expressions;
-    std::map<std::string, uint> labels;
+    // Jumps to a label that is not compiled yet wait in its fixups.
+    struct Label {
+        uint        pos{};
+        bool        isDefined{};
+        FixupVector fixups;
+        uint        firstJumpLine{};
+    };
+
+    ExprVector expressions;
+    std::unordered_map<std::string, Label> labels;
+    uint numOfDefinedLabels{};
+    uint numOfUndefinedLabels{}; // Labels that have jumps waiting for them.
 
     explicit ExprScript();
     void AddExpr(Expr * expr);
-    void AddLabel(std::string labelName, uint labelPos, uint labelLine);
-    uint GetLabelPos(std::string labelName, uint jumpLine);
+    void AddLabel(const std::string & labelName, uint labelPos, uint labelLine, ByteCode & bc);
+    void AddJump(const std::string & labelName, uint jumpPos, uint jumpLine, ByteCode & bc);
     void Compile(ByteCode & bc) override;
+
+    // Compiles top-level statements one by one as they are parsed,
+    // so they don't have to be kept in 'expressions'.
+    void BeginCompile(ByteCode & bc);
+    void CompileExpr(Expr * expr, ByteCode & bc);
+    void EndCompile();
 };
 
 #endif //VIRGO_EXPR_H
@@ -0,0 +1,57 @@
+#include <algorithm>
+#include <chrono>
+#include "GcPolicy.h"
+#include "Mem.h"
+
+AdaptiveGcPolicy::AdaptiveGcPolicy(const GcTuning & tuning) : tuning{tuning} {}
+
+uint AdaptiveGcPolicy::InitialLimit(MemDomain * /*domain*/) {
+    return tuning.initialDomainPages;
+}
+
+bool AdaptiveGcPolicy::ShouldCollect(MemDomain * domain) {
+    // The first gc of a domain has nothing to predict from.
+    if (domain->lastGcEnd == MemDomain::Clock::time_point{})
+        return true;
+
+    // If the heap can't grow, there is no other choice.
+    if (tuning.maxHeapPages != 0 && Heap::NumOfPages() >= tuning.maxHeapPages)
+        return true;
+    if (Heap::budget.IsExhausted())
+        return true;
+    if (domain->IsExternalGcTriggered())
+        return true;
+
+    return domain->shrinkFactor > tuning.collectThreshold;
+}
+
+void AdaptiveGcPolicy::AfterGc(MemDomain * domain) {
+    auto now = MemDomain::Clock::now();
+    auto lastGcEnd = domain->lastGcEnd;
+    domain->lastGcEnd = now;
+    if (lastGcEnd == MemDomain::Clock::time_point{})
+        return;
+
+    double interval = std::chrono::duration_cast<std::chrono::microseconds>(now - lastGcEnd).count();
+    if (interval <= 0)
+        return;
+
+    double allocRate      = domain->lastAllocatedBytes / interval; // Bytes per microsecond.
+    double survival       = 1.0 - domain->shrinkFactor;
+    double livePages      = domain->NumOfPages() * survival;
+    double targetInterval = std::max<double>(domain->cyclePause, 1) / tuning.targetGcTimeFraction;
+
+    double limit    = domain->limitNumOfPages;
+    double newLimit = livePages + allocRate * targetInterval / PAGE_SIZE;
+    newLimit = std::clamp(newLimit, limit / tuning.maxGrowFactor, limit * tuning.maxGrowFactor);
+    newLimit = std::clamp<double>(newLimit, tuning.minDomainPages, tuning.maxDomainPages);
+
+    if (tuning.maxHeapPages != 0) {
+        double otherPages = Heap::NumOfPages() - domain->NumOfPages();
+        newLimit = std::min(newLimit, tuning.maxHeapPages - otherPages);
+    }
+
+    // Pages that are in use can't be taken away.
+    newLimit = std::max<double>(newLimit, domain->NumOfPages());
+    domain->limitNumOfPages = (uint)newLimit;
+}
@@ -0,0 +1,62 @@
+#ifndef VIRGO_GC_POLICY_H
+#define VIRGO_GC_POLICY_H
+
+#include "Common.h"
+
+struct MemDomain;
+
+// Decides when domains are collected and how big they may grow.
+// Heap calls it for all domains of a thread heap except the constant one.
+// A policy is shared by all threads, per domain state is kept in MemDomain.
+struct GcPolicy {
+    virtual ~GcPolicy() = default;
+
+    // Page limit of a new domain.
+    virtual uint InitialLimit(MemDomain * domain) = 0;
+
+    // Called when the domain is full. If it returns false,
+    // the domain is left and allocation goes to another one.
+    virtual bool ShouldCollect(MemDomain * domain) = 0;
+
+    // Called when a gc cycle of the domain has finished marking.
+    virtual void AfterGc(MemDomain * domain) = 0;
+};
+
+struct GcTuning {
+    // Part of the time that may be spent in gc pauses, the smaller it is,
+    // the bigger domains grow and the less often they are collected.
+    double targetGcTimeFraction = 0.05;
+
+    // Upper bound of the thread heap, 0 means no bound.
+    uint   maxHeapPages = 0;
+
+    uint   initialDomainPages = 1024;
+    uint   minDomainPages     = 64;
+    uint   maxDomainPages     = 16 * 1024;
+
+    // Limit changes at most by this factor per gc.
+    double maxGrowFactor = 2.0;
+
+    // A full domain is collected if at least this part of its objects
+    // died in the last gc, otherwise it's not worth it.
+    double collectThreshold = 0.2;
+};
+
+// Sizes a domain so that with the observed allocation rate the next gc
+// comes when its pause makes targetGcTimeFraction of the time:
+//
+//     limit = live pages + allocation rate * (pause / targetGcTimeFraction)
+//
+// Live pages are estimated from the survival rate of the last gc.
+struct AdaptiveGcPolicy : GcPolicy {
+    GcTuning tuning;
+
+    AdaptiveGcPolicy() = default;
+    explicit AdaptiveGcPolicy(const GcTuning & tuning);
+
+    uint InitialLimit(MemDomain * domain) override;
+    bool ShouldCollect(MemDomain * domain) override;
+    void AfterGc(MemDomain * domain) override;
+};
+
+#endif //VIRGO_GC_POLICY_H
@@ -0,0 +1,142 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include "GcTelemetry.h"
+#include "Utils.h"
+
+const uint GcTelemetry::PAUSE_WINDOW  = 4096;
+const uint GcTelemetry::EVENT_HISTORY = 256;
+
+bool                       GcTelemetry::enabled = false;
+void (*GcTelemetry::OnEvent)(const GcEvent & event);
+std::mutex                 GcTelemetry::mutex;
+std::vector<std::uint64_t> GcTelemetry::pauses;
+uint                       GcTelemetry::nextPause = 0;
+std::deque<GcEvent>        GcTelemetry::lastEvents;
+GcSummary                  GcTelemetry::summary;
+std::ofstream              GcTelemetry::log;
+
+static const auto processStart = std::chrono::steady_clock::now();
+
+void GcTelemetry::Enable() {
+    enabled = true;
+}
+
+void GcTelemetry::Disable() {
+    enabled = false;
+}
+
+bool GcTelemetry::OpenLog(const std::string & path) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (log.is_open())
+        log.close();
+    log.open(path, std::ios::out | std::ios::app);
+    return log.is_open();
+}
+
+void GcTelemetry::CloseLog() {
+    std::lock_guard<std::mutex> lock(mutex);
+    log.close();
+}
+
+std::uint64_t GcTelemetry::Now() {
+    auto time = std::chrono::steady_clock::now() - processStart;
+    return std::chrono::duration_cast<std::chrono::microseconds>(time).count();
+}
+
+void GcTelemetry::RecordPause(std::uint64_t pause) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (pauses.size() < PAUSE_WINDOW)
+        pauses.push_back(pause);
+    else
+        pauses[nextPause] = pause;
+    nextPause = (nextPause + 1) % PAUSE_WINDOW;
+
+    summary.numOfPauses++;
+    summary.totalPause += pause;
+    summary.maxPause = std::max(summary.maxPause, pause);
+}
+
+void GcTelemetry::RecordEvent(const GcEvent & event) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        summary.numOfCycles++;
+        summary.allocatedBytes += event.allocatedBytes;
+
+        lastEvents.push_back(event);
+        if (lastEvents.size() > EVENT_HISTORY)
+            lastEvents.pop_front();
+
+        if (log.is_open())
+            log << ToJson(event) << '\n';
+    }
+
+    // Listener is called without the lock, so it may use the api.
+    if (OnEvent != nullptr)
+        OnEvent(event);
+}
+
+static std::uint64_t Percentile(std::vector<std::uint64_t> & values, double p) {
+    if (values.empty())
+        return 0;
+    std::size_t n = (std::size_t)(p * (values.size() - 1));
+    std::nth_element(values.begin(), values.begin() + n, values.end());
+    return values[n];
+}
+
+GcSummary GcTelemetry::GetSummary() {
+    std::vector<std::uint64_t> window;
+    GcSummary result;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        window = pauses;
+        result = summary;
+    }
+    result.p50 = Percentile(window, 0.50);
+    result.p99 = Percentile(window, 0.99);
+
+    std::uint64_t time = Now();
+    if (time > 0)
+        result.allocRate = result.allocatedBytes * 1e6 / time;
+    return result;
+}
+
+std::vector<GcEvent> GcTelemetry::GetLastEvents() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return {lastEvents.begin(), lastEvents.end()};
+}
+
+std::string GcTelemetry::ToJson(const GcEvent & event) {
+    std::stringstream s;
+    s << "{\"event\":\"gc\""
+      << ",\"domain\":"         << event.domainId
+      << ",\"kind\":\""         << event.domainKind << '"'
+      << ",\"start_us\":"       << event.startTime
+      << ",\"mark_end_us\":"    << event.markEndTime
+      << ",\"end_us\":"         << event.endTime
+      << ",\"pause_us\":"       << event.pause
+      << ",\"pauses\":"         << event.numOfPauses
+      << ",\"marked\":"         << event.numOfMarked
+      << ",\"deleted\":"        << event.numOfDeleted
+      << ",\"released_pages\":" << event.numOfReleasedPages
+      << ",\"promoted_pages\":" << event.numOfPromotedPages
+      << ",\"pages\":"          << event.numOfPages
+      << ",\"allocated\":"      << event.allocatedBytes
+      << ",\"alloc_rate\":"     << (std::uint64_t)event.allocRate
+      << '}';
+    return s.str();
+}
+
+void GcTelemetry::PrintSummary() {
+    GcSummary s = GetSummary();
+    std::cout << "\nGc summary:\n"
+              << "cycles     : " << Utils::NumSep(s.numOfCycles) << '\n'
+              << "pauses     : " << Utils::NumSep(s.numOfPauses) << '\n'
+              << "p50 pause  : " << Utils::NumSep(s.p50) << " us\n"
+              << "p99 pause  : " << Utils::NumSep(s.p99) << " us\n"
+              << "max pause  : " << Utils::NumSep(s.maxPause) << " us\n"
+              << "total pause: " << Utils::NumSep(s.totalPause) << " us\n"
+              << "allocated  : " << Utils::NumSep(s.allocatedBytes) << " bytes\n"
+              << "alloc rate : " << Utils::NumSep((std::uint64_t)s.allocRate) << " bytes/s\n";
+}
@@ -0,0 +1,76 @@
+#ifndef VIRGO_GC_TELEMETRY_H
+#define VIRGO_GC_TELEMETRY_H
+
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "Common.h"
+
+// One gc cycle of a domain: from the start of marking
+// to the end of sweeping. Times are in microseconds
+// since the start of the process.
+struct GcEvent {
+    uint          domainId{};
+    const char *  domainKind{};   // "baby", "active" or "constant".
+    std::uint64_t startTime{};
+    std::uint64_t markEndTime{};
+    std::uint64_t endTime{};
+    std::uint64_t pause{};         // Sum of all pauses of the cycle.
+    uint          numOfPauses{};   // Full gc or incremental marking steps.
+    uint          numOfMarked{};
+    uint          numOfDeleted{};
+    uint          numOfReleasedPages{};
+    uint          numOfPromotedPages{}; // From baby domain to the active one.
+    uint          numOfPages{};     // Pages of the domain after the cycle.
+    std::uint64_t allocatedBytes{}; // Allocated since the previous cycle.
+    double        allocRate{};      // Bytes per second since the previous cycle.
+};
+
+struct GcSummary {
+    std::uint64_t numOfCycles{};
+    std::uint64_t numOfPauses{};
+    std::uint64_t p50{};       // Percentiles of the last pauses,
+    std::uint64_t p99{};       // see GcTelemetry::PAUSE_WINDOW.
+    std::uint64_t maxPause{};  // Of all pauses.
+    std::uint64_t totalPause{};
+    std::uint64_t allocatedBytes{};
+    double        allocRate{}; // Bytes per second of the whole run.
+};
+
+// Collects gc events of all domains of all threads.
+// MemDomain reports pauses and finished cycles, when telemetry
+// is disabled domains don't compose events at all.
+struct GcTelemetry {
+    static const uint PAUSE_WINDOW;
+    static const uint EVENT_HISTORY;
+
+    static bool enabled;
+    static void (*OnEvent)(const GcEvent & event);
+
+    static std::mutex                 mutex;
+    static std::vector<std::uint64_t> pauses;     // Ring buffer of the last pauses.
+    static uint                       nextPause;
+    static std::deque<GcEvent>        lastEvents;
+    static GcSummary                  summary;
+    static std::ofstream              log;
+
+    static void Enable();
+    static void Disable();
+    static bool OpenLog(const std::string & path); // JSON lines, one per event.
+    static void CloseLog();
+
+    static std::uint64_t Now();
+
+    static void RecordPause(std::uint64_t pause);
+    static void RecordEvent(const GcEvent & event);
+
+    static GcSummary GetSummary();
+    static std::vector<GcEvent> GetLastEvents();
+    static std::string ToJson(const GcEvent & event);
+    static void PrintSummary();
+};
+
+#endif //VIRGO_GC_TELEMETRY_H
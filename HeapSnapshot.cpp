@@ -0,0 +1,126 @@
+#include <fstream>
+#include <iostream>
+#include <unordered_map>
+#include <unordered_set>
+#include "HeapSnapshot.h"
+#include "Mem.h"
+#include "Obj.h"
+#include "Type.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#define VIRGO_USE_SIGUSR
+#endif
+
+const char HeapSnapshot::MAGIC[4] = {'V', 'H', 'S', '1'};
+
+volatile std::sig_atomic_t HeapSnapshot::isRequested = 0;
+std::string                HeapSnapshot::requestedPath;
+
+template<class T>
+static inline void WriteValue(std::ostream & out, T val) {
+    out.write((const char*)&val, sizeof(T));
+}
+
+bool HeapSnapshot::Write(const std::string & path, const std::vector<MemDomain*> & domains) {
+    std::ofstream out(path, std::ios::binary);
+    if (!out.is_open())
+        return false;
+    Write(out, domains);
+    return out.good();
+}
+
+void HeapSnapshot::Write(std::ostream & out, const std::vector<MemDomain*> & domains) {
+    std::vector<Obj*> objects;
+    for (auto * domain : domains) {
+        if (domain != nullptr)
+            domain->GetObjects(objects);
+    }
+
+    // Roots are objects owned by the host, objects in the slots of
+    // the interpreter (variables and the stack, see Heap::GetRootSlots)
+    // and constants, which live as long as their pools.
+    std::unordered_set<Obj*> rootObjects;
+    if (Heap::GetRootSlots != nullptr) {
+        std::vector<Obj**> slots;
+        Heap::GetRootSlots(slots);
+        for (auto ** slot : slots) {
+            if (*slot != nullptr)
+                rootObjects.insert(*slot);
+        }
+    }
+    auto isRoot = [&](Obj * obj) {
+        return obj->numOfOwners > 0
+            || rootObjects.count(obj) != 0
+            || Page::GetPage(obj)->domain->GetFlag_IsConstant();
+    };
+
+    std::unordered_map<const Type*, uint> typeIndex;
+    std::vector<const Type*> types;
+    for (auto * obj : objects) {
+        if (typeIndex.count(obj->type) == 0) {
+            typeIndex[obj->type] = types.size();
+            types.push_back(obj->type);
+        }
+    }
+
+    out.write(MAGIC, sizeof(MAGIC));
+    WriteValue<std::uint32_t>(out, types.size());
+    for (auto * type : types) {
+        WriteValue<std::uint32_t>(out, type->name.size());
+        out.write(type->name.data(), type->name.size());
+    }
+
+    WriteValue<std::uint64_t>(out, objects.size());
+    std::vector<Obj**> refs;
+    for (auto * obj : objects) {
+        refs.clear();
+        auto getRefSlots = obj->type->methodTable->GetRefSlots;
+        if (getRefSlots != nullptr)
+            getRefSlots(obj, refs);
+
+        WriteValue<std::uint64_t>(out, (std::uint64_t)obj);
+        WriteValue<std::uint32_t>(out, typeIndex[obj->type]);
+        WriteValue<std::uint32_t>(out, Page::GetPage(obj)->chunkSize);
+        WriteValue<std::uint8_t> (out, isRoot(obj));
+        WriteValue<std::uint32_t>(out, refs.size());
+        for (auto * ref : refs)
+            WriteValue<std::uint64_t>(out, (std::uint64_t)*ref);
+    }
+}
+
+bool HeapSnapshot::WriteHeap(const std::string & path, const std::vector<MemDomain*> & extraDomains) {
+    std::vector<MemDomain*> domains { Heap::constantDomain, Heap::babyDomain };
+    domains.insert(domains.end(), Heap::domains.begin(), Heap::domains.end());
+    domains.insert(domains.end(), extraDomains.begin(), extraDomains.end());
+    return Write(path, domains);
+}
+
+#ifdef VIRGO_USE_SIGUSR
+static void OnSnapshotSignal(int) {
+    HeapSnapshot::isRequested = 1;
+}
+#endif
+
+void HeapSnapshot::InstallSignalHandler(const std::string & pathPrefix) {
+#ifdef VIRGO_USE_SIGUSR
+    requestedPath = pathPrefix;
+    std::signal(SIGUSR2, OnSnapshotSignal);
+#endif
+}
+
+void HeapSnapshot::WriteRequested(const std::vector<MemDomain*> & extraDomains) {
+    static uint numOfSnapshots = 0;
+    isRequested = 0;
+
+    std::string path = requestedPath;
+#ifdef VIRGO_USE_SIGUSR
+    path += "." + std::to_string(getpid());
+#endif
+    path += "." + std::to_string(numOfSnapshots++) + ".vhs";
+
+    if (WriteHeap(path, extraDomains))
+        std::cerr << "\nHeap snapshot: " << path;
+    else
+        std::cerr << "\nCan't write heap snapshot: " << path;
+}
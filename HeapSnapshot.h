@@ -0,0 +1,44 @@
+#ifndef VIRGO_HEAP_SNAPSHOT_H
+#define VIRGO_HEAP_SNAPSHOT_H
+
+#include <csignal>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "Common.h"
+
+struct MemDomain;
+
+// Writes all objects of the heap to a binary snapshot,
+// which is analyzed offline by Tools/HeapAnalyzer.
+//
+// Format (host byte order):
+//     char[4]  magic "VHS1"
+//     u32      number of types
+//     types    u32 name length, name
+//     u64      number of objects
+//     objects  u64 id (address), u32 type index, u32 size,
+//              u8 is root, u32 number of refs, u64 ref ids
+//
+// Roots are objects owned by the host, variables and values on exec
+// stacks of the current VM, and constants.
+// Only the heap of the calling thread (and the constant domain)
+// is written, other threads own their heaps.
+struct HeapSnapshot {
+    static const char MAGIC[4];
+
+    // Set by the signal handler, the snapshot is written
+    // by the interpreter at the next safe point.
+    static volatile std::sig_atomic_t isRequested;
+    static std::string requestedPath;
+
+    static bool Write(const std::string & path, const std::vector<MemDomain*> & domains);
+    static void Write(std::ostream & out, const std::vector<MemDomain*> & domains);
+    static bool WriteHeap(const std::string & path, const std::vector<MemDomain*> & extraDomains = {});
+
+    // SIGUSR2 requests a snapshot <pathPrefix>.<pid>.<n>.vhs
+    static void InstallSignalHandler(const std::string & pathPrefix);
+    static void WriteRequested(const std::vector<MemDomain*> & extraDomains = {});
+};
+
+#endif //VIRGO_HEAP_SNAPSHOT_H
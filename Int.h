@@ -2,6 +2,7 @@
 #define PROTON_INT_H
 
 #include "Obj.h"
+#include "Common.h"
 
 struct Int {
     Obj obj;
@@ -73,6 +73,7 @@ Ref List_Set(Ref a, Ref argsRef, Ref val) {
         Int * index = (Int*)indexObj;
         if (index->val < 0 || index->val >= list->elements.size())
             return NEW_REF(new Err("Index is out of range."));
+        Heap::WriteBarrier(GET_OBJ(val));
         list->elements[index->val] = val;
         return Ref::none;
     }
@@ -98,6 +99,7 @@ Ref List_Method_Add(Obj * self, Ref args) {
     auto * argsObj = (Args*)GET_OBJ(args);
     if (argsObj->NumOfArguments() == 0)
         return NEW_REF(new Err("No arguments provided for 'Add' method of the list object."));
+    Heap::WriteBarrier(GET_OBJ(argsObj->Get(0)));
     listObj->elements.push_back(argsObj->Get(0));
     return Ref::none;
 }
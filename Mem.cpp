@@ -2,9 +2,26 @@
 #include <iostream>
 #include <iomanip>
 #include <climits>
+#include <cstdlib>
+#include <chrono>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <functional>
 #include "Mem.h"
 #include "Type.h"
 #include "Utils.h"
+#include "AllocProfiler.h"
+
+#include <fstream>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define VIRGO_USE_MMAP
+#endif
 
 /* Virgo automatic memory managment system.
  *
@@ -33,7 +50,7 @@
  * In our codebase we also use the term 'page' to denote a page header.
  *
  *
- * CHUNK - a little memory block (24..64 bytes) that lies inside a page.
+ * CHUNK - a little memory block (24..2032 bytes) that lies inside a page.
  * As we mentioned before, each page contains a header and an array of chunks of the same size, that
  * starts right after a header and continues to the end. Of course at the end of the
  * page there will be some unused little area, because the available space of the page
@@ -45,11 +62,33 @@
  * Page cluster takes and returns free pages to the memory bank.
  *
  *
+ * LARGE SPAN - a sequence of pages that contains one object which is too big
+ * for a chunk. It starts with a page header as an ordinary page, and it's
+ * allocated and freed individually.
+ *
+ *
  * MEMORY DOMAIN - a set of page clusters. Memory domain performs garbage collection,
  * that is scoped to memory which belongs to this particular memory domain.
  *
  *
  * HEAP - a set of memory domains.
+ *
+ *
+ * LAZY SWEEPING - garbage collection of a domain only marks objects and
+ * sweeps active pages. Other pages are put to the list of unswept pages
+ * and are swept one by one when a page cluster needs a page with free chunks.
+ * So the pause of gc depends on the number of live objects, and the cost
+ * of sweeping is spread between allocations.
+ *
+ *
+ * COMPACTION - after a burst of allocations a domain may keep many pages
+ * with a few live objects. Compaction moves objects out of sparse pages
+ * into other pages of the cluster and returns the emptied pages to
+ * the memory bank. References are found with pointer maps of types
+ * (MethodTable::GetRefSlots) and root slots of the interpreter, and are
+ * updated through a forwarding table. Compaction is done at safe points
+ * of the interpreter only. Owned and pinned objects are never moved,
+ * pages containing them stay.
  */
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -59,21 +98,69 @@ const uint          PAGE_POWER    = 12;
 const uint          PAGE_SIZE     = (1u << PAGE_POWER); // 4096
 const std::uint64_t PAGE_MASK     = (~std::uint64_t(0) << PAGE_POWER); // 0xFF'FF'FF'FF'FF'FF'F0'00
 const uint          BLOCK_SIZE    = (1u << 24u); // 16MB
-const uint          BLOCK_SIZE_MB = 16;
 
 ///////////////////////////////////////////////////////////////////////////////
 
-std::vector<std::byte*> MemBank::blocks;
+std::vector<std::byte*>        MemBank::blocks;
+std::deque<MemBank::FreePage>  MemBank::freePages;
+std::stack<std::byte*>         MemBank::uncommittedPages;
+uint                           MemBank::minRetainedPages = 256; // 1 Mb
+std::chrono::seconds           MemBank::releaseAfter{10};
+bool                           MemBank::useHugePages = false;
+bool                           MemBank::useMadvFree = false;
+std::uint64_t                  MemBank::reservedBytes;
+std::uint64_t                  MemBank::committedBytes;
+std::uint64_t                  MemBank::releasedBytes;
+std::mutex                     MemBank::mutex;
+MemBank::Clock::time_point     MemBank::lastRelease;
+thread_local MemBank::LocalPages MemBank::localPages;
+std::vector<MemBank::LocalPages*> MemBank::allLocalPages;
+
+const uint PAGE_BATCH_SIZE = 64;
+
+// Memory is taken from the OS with mmap, so a block only reserves address space,
+// and its pages are committed when they are touched for the first time.
+// Where mmap is not available blocks and spans are allocated with calloc,
+// and free pages are never released.
+
+std::byte * ReserveMemory(std::size_t size) {
+#ifdef VIRGO_USE_MMAP
+    void * mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return nullptr;
+    return (std::byte*)mem;
+#else
+    return (std::byte*)calloc(size, 1);
+#endif
+}
 
-std::stack<std::byte*> MemBank::freePages;
+void FreeMemory(std::byte * mem, std::size_t size) {
+#ifdef VIRGO_USE_MMAP
+    munmap(mem, size);
+#else
+    free(mem);
+#endif
+}
+
+void ProtectPages(std::byte * mem, std::size_t size, bool isReadOnly) {
+#ifdef VIRGO_USE_MMAP
+    mprotect(mem, size, isReadOnly ? PROT_READ : PROT_READ | PROT_WRITE);
+#endif
+}
 
 void MemBank::AllocateBlock() {
-    auto * block = (std::byte*)calloc(BLOCK_SIZE, 1);
+    // Called with the locked mutex.
+    auto * block = ReserveMemory(BLOCK_SIZE);
     if (block == nullptr) {
-        std::cerr << "Error. Can't allocate block.";
-        abort();
+        throw OutOfMemoryError("Out of memory. Can't allocate block.");
     }
     blocks.push_back(block);
+    reservedBytes += BLOCK_SIZE;
+
+#if defined(VIRGO_USE_MMAP) && defined(MADV_HUGEPAGE)
+    if (useHugePages)
+        madvise(block, BLOCK_SIZE, MADV_HUGEPAGE);
+#endif
 
     // Find a position in the block which is aligned according to the page size.
     std::byte * nextPage = nullptr;
@@ -87,30 +174,166 @@ void MemBank::AllocateBlock() {
         numOfPages = (BLOCK_SIZE / PAGE_SIZE) - 1;
     }
 
-    // Slicing block into pieces.
-    for (int i = 0; i < numOfPages; i++) {
-        freePages.push(nextPage);
-        nextPage += PAGE_SIZE;
-    }
+    // Slicing block into pieces. Pages are pushed from the end,
+    // so they are taken in the order of addresses.
+    for (int i = numOfPages - 1; i >= 0; i--)
+        uncommittedPages.push(nextPage + i * PAGE_SIZE);
 }
 
 std::byte * MemBank::GetPage() {
-    if (freePages.empty())
-        AllocateBlock();
-    std::byte * page = freePages.top();
-    freePages.pop();
+    std::lock_guard<std::mutex> localLock(localPages.mutex);
+    auto & pages = localPages.pages;
+    localPages.lastUse = Clock::now();
+    if (pages.empty())
+        TakePages_Batch(pages, PAGE_BATCH_SIZE);
+    std::byte * page = pages.back();
+    pages.pop_back();
     return page;
 }
 
 void MemBank::AcceptPage(std::byte * page) {
-    freePages.push(page);
+    std::lock_guard<std::mutex> localLock(localPages.mutex);
+    auto & pages = localPages.pages;
+    localPages.lastUse = Clock::now();
+    pages.push_back(page);
+    if (pages.size() >= 2 * PAGE_BATCH_SIZE)
+        ReturnPages_Batch(pages, PAGE_BATCH_SIZE);
+}
+
+void MemBank::TakePages_Batch(std::vector<std::byte*> & pages, uint numOfPages) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto now = Clock::now();
+    if (now - lastRelease >= releaseAfter)
+        ReleaseIdlePages_Locked(now);
+    for (uint i = 0; i < numOfPages; i++) {
+        if (!freePages.empty()) {
+            pages.push_back(freePages.back().page);
+            freePages.pop_back();
+            continue;
+        }
+
+        if (uncommittedPages.empty())
+            AllocateBlock();
+        pages.push_back(uncommittedPages.top());
+        uncommittedPages.pop();
+        committedBytes += PAGE_SIZE;
+    }
+}
+
+// Pages from the start of the vector are returned,
+// because they were freed earlier than the others.
+void MemBank::ReturnPages_Batch(std::vector<std::byte*> & pages, uint numOfPages) {
+    numOfPages = std::min<std::size_t>(numOfPages, pages.size());
+    auto now = Clock::now();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (uint i = 0; i < numOfPages; i++)
+            freePages.push_back({pages[i], now});
+        if (now - lastRelease >= releaseAfter)
+            ReleaseIdlePages_Locked(now);
+    }
+    pages.erase(pages.begin(), pages.begin() + numOfPages);
+}
+
+MemBank::LocalPages::LocalPages() : lastUse{Clock::now()} {
+    std::lock_guard<std::mutex> lock(MemBank::mutex);
+    allLocalPages.push_back(this);
+}
+
+MemBank::LocalPages::~LocalPages() {
+    // Thread exits, its cached pages go back to the bank,
+    // and the bank releases what is idle by now.
+    std::lock_guard<std::mutex> lock(MemBank::mutex);
+    allLocalPages.erase(std::find(allLocalPages.begin(), allLocalPages.end(), this));
+    for (auto * page : pages)
+        freePages.push_back({page, lastUse});
+    pages.clear();
+    ReleaseIdlePages_Locked(Clock::now());
+}
+
+void MemBank::ReleaseIdlePages() {
+    std::lock_guard<std::mutex> lock(mutex);
+    ReleaseIdlePages_Locked(Clock::now());
+}
+
+void MemBank::ReleaseIdlePages_Locked(Clock::time_point now) {
+    lastRelease = now;
+
+    // Caches of threads that didn't take or return pages for releaseAfter
+    // are flushed. Their locks are taken in the reverse order (the bank,
+    // then the cache), so a busy cache is skipped, it's not idle anyway.
+    // The cache of this thread is in use, it may be even locked by it.
+    for (auto * local : allLocalPages) {
+        if (local == &localPages || !local->mutex.try_lock())
+            continue;
+        if (now - local->lastUse >= releaseAfter) {
+            // They are idle longer than other free pages.
+            for (auto * page : local->pages)
+                freePages.push_front({page, local->lastUse});
+            local->pages.clear();
+        }
+        local->mutex.unlock();
+    }
+
+#ifdef VIRGO_USE_MMAP
+    while (freePages.size() > minRetainedPages) {
+        auto & oldest = freePages.front();
+        if (now - oldest.freeSince < releaseAfter)
+            break;
+
+        // Page content is lost, but Page::Init doesn't rely on it.
+        int advice = MADV_DONTNEED;
+#ifdef MADV_FREE
+        if (useMadvFree)
+            advice = MADV_FREE;
+#endif
+        madvise(oldest.page, PAGE_SIZE, advice);
+        uncommittedPages.push(oldest.page);
+        committedBytes -= PAGE_SIZE;
+        releasedBytes  += PAGE_SIZE;
+        freePages.pop_front();
+    }
+#endif
+}
+
+std::byte * MemBank::GetSpan(uint numOfPages) {
+    // Spans are mapped separately, so they are page aligned,
+    // and their memory is returned to the OS right when they are freed.
+    std::size_t size = (std::size_t)numOfPages * PAGE_SIZE;
+#ifdef VIRGO_USE_MMAP
+    std::byte * span = ReserveMemory(size);
+#else
+    auto * span = (std::byte*)std::aligned_alloc(PAGE_SIZE, size);
+    if (span != nullptr)
+        memset(span, 0, size);
+#endif
+    if (span == nullptr)
+        return nullptr;
+    std::lock_guard<std::mutex> lock(mutex);
+    reservedBytes  += size;
+    committedBytes += size;
+    return span;
+}
+
+void MemBank::FreeSpan(std::byte * span, uint numOfPages) {
+    std::size_t size = (std::size_t)numOfPages * PAGE_SIZE;
+    FreeMemory(span, size);
+    std::lock_guard<std::mutex> lock(mutex);
+    reservedBytes  -= size;
+    committedBytes -= size;
+    releasedBytes  += size;
 }
 
 void MemBank::PrintStatus() {
+    std::lock_guard<std::mutex> lock(mutex);
     std::cout << "\nMemBank status:\n";
-    std::cout << "blocks    : " << blocks.size() << '\n'
-              << "allocated : " << blocks.size() * BLOCK_SIZE_MB << " Mb\n"
-              << "freePages : " << freePages.size() << '\n';
+    std::cout << "blocks      : " << blocks.size() << '\n'
+              << "reserved    : " << Utils::NumSep(reservedBytes / 1024) << " kb\n"
+              << "committed   : " << Utils::NumSep(committedBytes / 1024) << " kb\n"
+              << "released    : " << Utils::NumSep(releasedBytes / 1024) << " kb\n"
+              << "freePages   : " << freePages.size() << '\n'
+              << "uncommitted : " << uncommittedPages.size() << '\n'
+              << "localPages  : " << localPages.pages.size() << '\n';
 }
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -126,7 +349,49 @@ inline bool IsFreeChunk(void * chunkPtr) {
 
 const uint PAGE_AVAILABLE_SPACE = PAGE_SIZE - sizeof(Page);
 
-#define PAGE_CAPACITY(chunkSize) (PAGE_AVAILABLE_SPACE / chunkSize)
+// Chunk size classes. Up to 64 bytes classes go with the step of ALIGNMENT,
+// then there are four classes per each doubling of size. The last classes
+// are chosen to fit 4, 3 and 2 chunks in a page without much waste.
+// Bigger objects live in large spans (see MemDomain::GetChunk_Large).
+const std::array<uint, NUM_OF_SIZE_CLASSES> SIZE_CLASSES = {
+    24,   32,   40,   48,   56,   64,
+    80,   96,   112,  128,
+    160,  192,  224,  256,
+    320,  384,  448,  512,
+    640,  768,  896,  1016,
+    1352, 2032,
+};
+
+const uint MAX_CHUNK_SIZE = SIZE_CLASSES.back();
+
+uint SizeClassIndex(uint chunkSize) {
+    assert(chunkSize <= MAX_CHUNK_SIZE);
+
+    // Index of a size class for every (chunkSize / ALIGNMENT) value.
+    static const std::vector<std::uint8_t> indexes = []() {
+        std::vector<std::uint8_t> v(MAX_CHUNK_SIZE / ALIGNMENT + 1);
+        uint classIndex = 0;
+        for (uint i = 0; i < v.size(); i++) {
+            if (i * ALIGNMENT > SIZE_CLASSES[classIndex])
+                classIndex++;
+            v[i] = classIndex;
+        }
+        return v;
+    }();
+
+    return indexes[(chunkSize + ALIGNMENT - 1) / ALIGNMENT];
+}
+
+// Large span contains only one chunk.
+inline uint PageCapacity(uint chunkSize) {
+    if (chunkSize > MAX_CHUNK_SIZE)
+        return 1;
+    return PAGE_AVAILABLE_SPACE / chunkSize;
+}
+
+inline uint SpanNumOfPages(uint chunkSize) {
+    return (sizeof(Page) + chunkSize + PAGE_SIZE - 1) / PAGE_SIZE;
+}
 
 void Page::Init(std::byte * pagePtr,
                 MemDomain * domain,
@@ -138,7 +403,7 @@ void Page::Init(std::byte * pagePtr,
     page->domain = domain;
     page->chunkSize = chunkSize;
 
-    uint capacity = PAGE_CAPACITY(chunkSize);
+    uint capacity = PageCapacity(chunkSize);
     std::byte * chunk = pagePtr + sizeof(Page);
     page->nextFreeChunk = chunk;
     for (uint i = 0; i < (capacity - 1); i++) {
@@ -181,17 +446,17 @@ uint Page::NumOfFreeChunks() {
 }
 
 uint Page::NumOfObj() {
-    return (PAGE_CAPACITY(chunkSize) - NumOfFreeChunks());
+    return (PageCapacity(chunkSize) - NumOfFreeChunks());
 }
 
 bool Page::IsEmpty() {
-    return NumOfFreeChunks() == PAGE_CAPACITY(chunkSize);
+    return NumOfFreeChunks() == PageCapacity(chunkSize);
 }
 
 #include "Obj.h"
 
 void Page::Mark() {
-    uint capacity = PAGE_CAPACITY(chunkSize);
+    uint capacity = PageCapacity(chunkSize);
     std::byte * chunk = (std::byte*)this + sizeof(Page);
     for (uint i = 0; i < capacity; i++, chunk += chunkSize) {
         if (IsFreeChunk(chunk))
@@ -206,12 +471,14 @@ void Page::Mark() {
         if (obj->numOfOwners == 0)
             continue;
 
-        obj->Mark();
+        domain->MarkObj(obj);
     }
 }
 
-void Page::Sweep() {
-    uint capacity = PAGE_CAPACITY(chunkSize);
+// Counters are returned through arguments instead of being added
+// to the domain, so pages of one domain can be swept in parallel.
+void Page::Sweep(uint & numOfMarked, uint & numOfDeleted) {
+    uint capacity = PageCapacity(chunkSize);
     std::byte * chunk = (std::byte*)this + sizeof(Page);
     for (uint i = 0; i < capacity; i++, chunk += chunkSize) {
         if (IsFreeChunk(chunk))
@@ -219,15 +486,38 @@ void Page::Sweep() {
 
         Obj * obj = (Obj*)chunk;
 
+        if (AllocProfiler::enabled)
+            AllocProfiler::OnSweep(obj, obj->GetFlag_IsMarked());
+
         if (obj->GetFlag_IsMarked()) {
-            domain->lastMarked++;
-            obj->ResetFlag_IsMarked();
+            numOfMarked++;
+            obj->SetFlag_IsMarked(false);
             continue;
         }
 
         obj->Delete();
         FreeChunk((std::byte*)obj);
-        domain->lastDeleted++;
+        numOfDeleted++;
+    }
+}
+
+void Page::DeleteAll() {
+    uint capacity = PageCapacity(chunkSize);
+    std::byte * chunk = (std::byte*)this + sizeof(Page);
+    for (uint i = 0; i < capacity; i++, chunk += chunkSize) {
+        if (IsFreeChunk(chunk))
+            continue;
+        ((Obj*)chunk)->Delete();
+        FreeChunk(chunk);
+    }
+}
+
+void Page::GetObjects(std::vector<Obj*> & objects) {
+    uint capacity = PageCapacity(chunkSize);
+    std::byte * chunk = (std::byte*)this + sizeof(Page);
+    for (uint i = 0; i < capacity; i++, chunk += chunkSize) {
+        if (!IsFreeChunk(chunk))
+            objects.push_back((Obj*)chunk);
     }
 }
 
@@ -275,7 +565,7 @@ void Test_Page() {
     assert(p->NumOfObj() == 0);
 
     for (uint i = 0; i < nFree; i++) {
-        auto * c = p->GetChunk();
+        p->GetChunk();
     }
     assert(!p->IsEmpty());
     assert(p->NumOfObj() == nFree);
@@ -286,28 +576,34 @@ void Test_Page() {
 
 ///////////////////////////////////////////////////////////////////////////////
 
-void PageCluster::Init() {
-    QueryPage();
-    UpdateActivePage();
-}
+// External memory that may be allocated before the first gc,
+// then the trigger is twice the amount left after the last gc.
+const std::size_t EXTERNAL_GC_MIN_BYTES = 4 * 1024 * 1024;
 
 std::byte * PageCluster::GetChunk() {
-    std::byte * chunk = activePage->GetChunk();
-    if (chunk != nullptr)
-        return chunk;
+    domain->allocatedBytes += chunkSize;
+
+    // Active page is null until the first chunk of this size is requested.
+    if (activePage != nullptr) {
+        std::byte * chunk = activePage->GetChunk();
+        if (chunk != nullptr)
+            return chunk;
+    }
     UpdateActivePage();
+    if (activePage == nullptr)
+        return nullptr;
     return activePage->GetChunk();
 }
 
 uint PageCluster::NumOfPages() {
-    uint size = availablePages.size() + unavailablePages.size();
+    uint size = availablePages.size() + unavailablePages.size() + unsweptPages.size();
     if (activePage != nullptr)
         size++;
     return size;
 }
 
 uint PageCluster::Capacity() {
-    return (NumOfPages() * PAGE_CAPACITY(chunkSize));
+    return (NumOfPages() * PageCapacity(chunkSize));
 }
 
 uint PageCluster::NumOfObj() {
@@ -319,66 +615,240 @@ uint PageCluster::NumOfObj() {
     for (auto * p : unavailablePages)
         numOfObj += p->NumOfObj();
 
-    numOfObj += activePage->NumOfObj();
+    // Unswept pages still contain dead objects, they are counted too.
+    for (auto * p : unsweptPages)
+        numOfObj += p->NumOfObj();
+
+    if (activePage != nullptr)
+        numOfObj += activePage->NumOfObj();
     return numOfObj;
 }
 
-void PageCluster::QueryPage() {
+bool PageCluster::QueryPage() {
+    if (!domain->TakePages(1)) {
+        // Baby domain keeps its empty pages for reuse, but they are
+        // bound to their size classes, so they are given back when
+        // another size class runs out of pages.
+        if (!domain->GetFlag_IsBabyDomain() || domain->ReleaseEmptyPages() == 0)
+            return false;
+        if (!domain->TakePages(1))
+            return false;
+    }
     std::byte * page = MemBank::GetPage();
     Page::Init(page, domain, chunkSize);
     availablePages.push_back((Page*)page);
-    domain->totalNumOfPages++;
+    return true;
 }
 
 void PageCluster::UpdateActivePage() {
     // In this function we expect that
     // activePage has no free chunks (unavailable).
-    if (availablePages.empty()) {
-        if (domain->totalNumOfPages == domain->limitNumOfPages)
-            return;
-        QueryPage();
-    }
-    unavailablePages.push_back(activePage);
+
+    // Before taking a new page from the bank
+    // we sweep pages left from the last gc.
+    while (availablePages.empty() && SweepNextPage());
+
+    // One more page is swept ahead, so sweeping finishes before the next
+    // gc and empty pages are released on the way, not held for a cycle.
+    SweepNextPage();
+
+    if (availablePages.empty() && !QueryPage())
+        return;
+    if (activePage != nullptr)
+        unavailablePages.push_back(activePage);
     activePage = availablePages.back();
     availablePages.pop_back();
 }
 
-void PageCluster::Mark() {
-    for (auto * p : availablePages)
-        p->Mark();
-
-    for (auto * p : unavailablePages)
-        p->Mark();
+void PageCluster::AddPagesToMarkQueue(std::vector<Page*> & markQueue) {
+    markQueue.insert(markQueue.end(), availablePages.begin(), availablePages.end());
+    markQueue.insert(markQueue.end(), unavailablePages.begin(), unavailablePages.end());
+    if (activePage != nullptr)
+        markQueue.push_back(activePage);
+}
 
-    activePage->Mark();
+void PageCluster::PrepareLazySweep() {
+    // Called right after marking. Only the active page is swept here,
+    // all other pages will be swept on demand by UpdateActivePage.
+    assert(unsweptPages.empty());
+    unsweptPages.insert(unsweptPages.end(), availablePages.begin(), availablePages.end());
+    unsweptPages.insert(unsweptPages.end(), unavailablePages.begin(), unavailablePages.end());
+    availablePages.clear();
+    unavailablePages.clear();
+    if (activePage != nullptr)
+        activePage->Sweep(domain->lastMarked, domain->lastDeleted);
 }
 
-void PageCluster::Sweep() {
-    for (auto * p : availablePages)
-        p->Sweep();
+bool PageCluster::SweepNextPage() {
+    if (unsweptPages.empty())
+        return false;
+
+    Page * page = unsweptPages.back();
+    unsweptPages.pop_back();
+    page->Sweep(domain->lastMarked, domain->lastDeleted);
+    // Empty pages go back to the bank as soon as they are swept,
+    // unless the cluster has no other page to allocate from.
+    // Dense pages of the baby domain hold survivors, they are promoted.
+    if (page->IsEmpty() && !domain->GetFlag_IsBabyDomain() && !availablePages.empty())
+        ReleasePage(page);
+    else if (domain != Heap::babyDomain || !PromotePage(page))
+        (page->HasFreeChunk() ? availablePages : unavailablePages).push_back(page);
+
+    domain->UpdateShrinkFactor();
+    if (unsweptPages.empty() && domain->NumOfUnsweptPages() == 0)
+        domain->OnSweepFinished();
+    return true;
+}
 
-    for (auto * p : unavailablePages)
-        p->Sweep();
+void PageCluster::FinishSweep() {
+    while (SweepNextPage());
+}
 
-    activePage->Sweep();
+void PageCluster::ReleasePage(Page * page) {
+    domain->ReturnPages(1);
+    MemBank::AcceptPage((std::byte*)page);
+    if (domain->isCyclePending)
+        domain->cycle.numOfReleasedPages++;
 }
 
-void PageCluster::ReleaseEmptyPages_InVector(std::vector<Page*> & pages) {
+uint PageCluster::ReleaseEmptyPages_InVector(std::vector<Page*> & pages) {
+    uint numOfReleased = 0;
     for (std::size_t i = 0; i < pages.size(); ) {
         if (pages[i]->IsEmpty()) {
             Page * page = pages[i];
             pages.erase(pages.begin() + i);
-            domain->totalNumOfPages--;
-            MemBank::AcceptPage((std::byte*)page);
+            ReleasePage(page);
+            numOfReleased++;
         } else {
             i++;
         }
     }
+    return numOfReleased;
 }
 
-void PageCluster::ReleaseEmptyPages() {
-    ReleaseEmptyPages_InVector(availablePages);
-    ReleaseEmptyPages_InVector(unavailablePages);
+uint PageCluster::ReleaseEmptyPages() {
+    return ReleaseEmptyPages_InVector(availablePages) +
+           ReleaseEmptyPages_InVector(unavailablePages);
+}
+
+// Occupancy of a swept baby page from which its objects are long-living.
+const double PROMOTION_THRESHOLD = 0.5;
+
+static bool HasDeleteMethod(Page * page) {
+    std::vector<Obj*> objects;
+    page->GetObjects(objects);
+    for (auto * obj : objects) {
+        if (obj->type->methodTable->Delete != nullptr)
+            return true;
+    }
+    return false;
+}
+
+bool PageCluster::PromotePage(Page * page) {
+    // Survivors are promoted with their page, so nothing is moved.
+    // Objects with Delete method may own external memory, which is
+    // accounted to their domain, so their pages are not promoted.
+    MemDomain * to = Heap::activeDomain;
+    if (to == nullptr || to->budget != domain->budget)
+        return false;
+    if (page->NumOfObj() < PageCapacity(chunkSize) * PROMOTION_THRESHOLD)
+        return false;
+    if (HasDeleteMethod(page))
+        return false;
+
+    // For the active domain it's an allocation, which its gc policy
+    // takes into account. Like in PageCluster::GetChunk, it's counted
+    // even if the domain is full, so the policy lets it grow.
+    to->allocatedBytes += page->NumOfObj() * chunkSize;
+    if (to->totalNumOfPages >= to->limitNumOfPages || to->IsExternalGcTriggered())
+        return false;
+
+    domain->totalNumOfPages--;
+    to->totalNumOfPages++;
+    page->domain = to;
+    auto & toCluster = to->clusters[this - domain->clusters.data()];
+    if (page->HasFreeChunk())
+        toCluster.availablePages.push_back(page);
+    else
+        toCluster.unavailablePages.push_back(page);
+
+    // Objects of the page aren't marked yet, and its owned objects
+    // are found only by scanning it.
+    if (to->GetFlag_IsMarking())
+        to->markQueue.push_back(page);
+    if (domain->isCyclePending)
+        domain->cycle.numOfPromotedPages++;
+    return true;
+}
+
+// Occupancy below which a page is evacuated by compaction.
+const double EVACUATION_THRESHOLD = 0.25;
+
+static bool HasUnmovableObj(Page * page) {
+    std::vector<Obj*> objects;
+    page->GetObjects(objects);
+    for (auto * obj : objects) {
+        if (obj->numOfOwners > 0 || obj->GetFlag_IsPinned())
+            return true;
+    }
+    return false;
+}
+
+void PageCluster::Evacuate(std::unordered_map<Obj*, Obj*> & forwarding,
+                           std::vector<Page*> & evacuatedPages)
+{
+    // Expects that all pages are swept. Only available pages are checked,
+    // unavailable pages are full, and the active page is kept.
+    assert(unsweptPages.empty());
+    uint capacity = PageCapacity(chunkSize);
+
+    std::vector<Page*> sparsePages;
+    for (std::size_t i = 0; i < availablePages.size(); ) {
+        Page * page = availablePages[i];
+        if (page->NumOfObj() < capacity * EVACUATION_THRESHOLD && !HasUnmovableObj(page)) {
+            sparsePages.push_back(page);
+            availablePages.erase(availablePages.begin() + i);
+        } else {
+            i++;
+        }
+    }
+
+    // Moving objects of a single page to another page saves nothing.
+    if (sparsePages.size() < 2) {
+        availablePages.insert(availablePages.end(), sparsePages.begin(), sparsePages.end());
+        return;
+    }
+
+    // Sparse pages are out of the lists, so new chunks are taken
+    // from other pages.
+    std::vector<Obj*> objects;
+    for (Page * page : sparsePages) {
+        objects.clear();
+        page->GetObjects(objects);
+
+        bool isEvacuated = true;
+        for (auto * obj : objects) {
+            std::byte * chunk = GetChunk();
+            if (chunk == nullptr) {
+                isEvacuated = false;
+                break;
+            }
+            domain->allocatedBytes -= chunkSize;
+
+            memcpy(chunk, obj, chunkSize);
+            auto * moved = (Obj*)chunk;
+            auto movedMethod = moved->type->methodTable->Moved;
+            if (movedMethod != nullptr)
+                movedMethod(moved);
+            forwarding[obj] = moved;
+            Page::FreeChunk((std::byte*)obj);
+        }
+
+        if (isEvacuated)
+            evacuatedPages.push_back(page);
+        else
+            availablePages.push_back(page);
+    }
 }
 
 void PageCluster::AfterGc() {
@@ -397,35 +867,404 @@ void PageCluster::AfterGc() {
 
 ///////////////////////////////////////////////////////////////////////////////
 
+// Gc threads are started once, on the first parallel gc, and then
+// wait for jobs. A job runs on all of them and on the thread that
+// started it, which is the worker 0. Heaps of different threads
+// share the pool, their jobs run one after another.
+class GcThreadPool {
+    std::mutex                        runMutex;
+    std::mutex                        mutex;
+    std::condition_variable           jobReady;
+    std::condition_variable           jobDone;
+    std::vector<std::thread>          threads;
+    std::function<void(uint worker)>  job;
+    uint                              numOfJobThreads{};
+    std::uint64_t                     jobId{};
+    uint                              numOfBusy{};
+    bool                              isStopped{};
+
+    void Work(uint worker) {
+        std::uint64_t lastJobId = 0;
+        for (;;) {
+            std::unique_lock<std::mutex> lock(mutex);
+            jobReady.wait(lock, [&]() { return isStopped || jobId != lastJobId; });
+            if (isStopped)
+                return;
+            lastJobId = jobId;
+            if (worker >= numOfJobThreads)
+                continue;
+            lock.unlock();
+
+            job(worker);
+
+            lock.lock();
+            if (--numOfBusy == 0)
+                jobDone.notify_one();
+        }
+    }
+
+public:
+    ~GcThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            isStopped = true;
+        }
+        jobReady.notify_all();
+        for (auto & thread : threads)
+            thread.join();
+    }
+
+    void Run(uint numOfThreads, const std::function<void(uint worker)> & newJob) {
+        std::lock_guard<std::mutex> runLock(runMutex);
+        std::unique_lock<std::mutex> lock(mutex);
+        while (threads.size() + 1 < numOfThreads) {
+            uint worker = threads.size() + 1;
+            threads.emplace_back([this, worker]() { Work(worker); });
+        }
+        job             = newJob;
+        numOfJobThreads = numOfThreads;
+        numOfBusy       = numOfThreads - 1;
+        jobId++;
+        lock.unlock();
+        jobReady.notify_all();
+
+        job(0);
+
+        lock.lock();
+        jobDone.wait(lock, [&]() { return numOfBusy == 0; });
+        job = nullptr;
+    }
+};
+
+static GcThreadPool gcThreadPool;
+
+// Below this number of pages a domain is processed on one thread,
+// waking up the gc threads costs more than they save.
+const std::size_t PARALLEL_MIN_PAGES = 64;
+
+// Calls process(page, numOfMarked, numOfDeleted) for each page
+// on Heap::numOfGcThreads threads. Threads take pages one by one
+// from the shared cursor, so a thread that got light pages just
+// takes more of them. Counters of all threads are summed up.
+template<class F>
+void ProcessPages_Parallel(std::vector<Page*> & pages,
+                           F process,
+                           uint & numOfMarked,
+                           uint & numOfDeleted)
+{
+    if (pages.size() < PARALLEL_MIN_PAGES) {
+        for (auto * page : pages)
+            process(page, numOfMarked, numOfDeleted);
+        return;
+    }
+
+    std::atomic<std::size_t> cursor{0};
+    std::atomic<uint> totalMarked{0};
+    std::atomic<uint> totalDeleted{0};
+
+    gcThreadPool.Run(Heap::numOfGcThreads, [&](uint /*worker*/) {
+        uint marked  = 0;
+        uint deleted = 0;
+        for (;;) {
+            std::size_t i = cursor.fetch_add(1);
+            if (i >= pages.size())
+                break;
+            process(pages[i], marked, deleted);
+        }
+        totalMarked  += marked;
+        totalDeleted += deleted;
+    });
+
+    numOfMarked  += totalMarked;
+    numOfDeleted += totalDeleted;
+}
+
+// Parallel marking of one domain. Each gc thread has its own mark stack.
+// Pages of the mark queue are the first work: threads take them from
+// the shared cursor and grey their owned objects. When some thread is
+// out of work, the others share halves of their stacks, and the idle
+// thread steals them. So a big graph reachable from a single root is
+// still marked by all threads. Objects are marked by Obj::TryMark,
+// each of them is traced by the thread that marked it.
+class ParallelMarker {
+    struct Worker {
+        std::vector<Obj*> stack;
+        std::mutex        mutex;
+        std::vector<Obj*> shared; // Stolen by other threads.
+    };
+
+    MemDomain *              domain;
+    std::vector<Page*> &     pages;
+    std::atomic<std::size_t> cursor{0};
+    std::vector<Worker>      workers;
+    std::atomic<uint>        numOfIdle{0};
+    std::atomic<std::size_t> numOfShared{0};
+
+    void Grey(Worker & self, Obj * obj) {
+        if (obj == nullptr || Page::GetPage(obj)->domain != domain)
+            return;
+        if (obj->TryMark())
+            self.stack.push_back(obj);
+    }
+
+    // The bottom half of the stack is shared, objects that were greyed
+    // first usually lead to the biggest parts of the graph.
+    void Share(Worker & self) {
+        std::lock_guard<std::mutex> lock(self.mutex);
+        if (!self.shared.empty())
+            return;
+        std::size_t half = self.stack.size() / 2;
+        self.shared.assign(self.stack.begin(), self.stack.begin() + half);
+        self.stack.erase(self.stack.begin(), self.stack.begin() + half);
+        numOfShared += half;
+    }
+
+    bool Steal(uint worker) {
+        for (std::size_t i = 0; i < workers.size(); i++) {
+            Worker & victim = workers[(worker + i) % workers.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (victim.shared.empty())
+                continue;
+            Worker & self = workers[worker];
+            self.stack.insert(self.stack.end(), victim.shared.begin(), victim.shared.end());
+            numOfShared -= victim.shared.size();
+            victim.shared.clear();
+            return true;
+        }
+        return false;
+    }
+
+public:
+    ParallelMarker(MemDomain * domain, std::vector<Page*> & pages, uint numOfWorkers) :
+        domain{domain}, pages{pages}, workers(numOfWorkers) {}
+
+    // Objects that are marked already, their references are traced.
+    void AddGrey(std::vector<Obj*> & objects) {
+        workers[0].stack.insert(workers[0].stack.end(), objects.begin(), objects.end());
+    }
+
+    void Run(uint worker) {
+        Worker & self = workers[worker];
+        std::vector<Obj*> objects;
+        std::vector<Obj**> slots;
+        for (;;) {
+            while (!self.stack.empty()) {
+                Obj * obj = self.stack.back();
+                self.stack.pop_back();
+
+                auto getRefSlots = obj->type->methodTable->GetRefSlots;
+                if (getRefSlots != nullptr) {
+                    slots.clear();
+                    getRefSlots(obj, slots);
+                    for (auto ** slot : slots)
+                        Grey(self, *slot);
+                }
+                if (self.stack.size() > 1 && numOfIdle > 0 && numOfShared == 0)
+                    Share(self);
+            }
+
+            std::size_t i = cursor.fetch_add(1);
+            if (i < pages.size()) {
+                objects.clear();
+                pages[i]->GetObjects(objects);
+                for (auto * obj : objects) {
+                    if (obj->numOfOwners > 0)
+                        Grey(self, obj);
+                }
+                continue;
+            }
+
+            if (Steal(worker))
+                continue;
+
+            // Marking is over when all threads are idle and nothing is shared.
+            // A thread shares only while it's busy, so then nothing appears.
+            numOfIdle++;
+            for (;;) {
+                if (numOfShared > 0) {
+                    numOfIdle--;
+                    break;
+                }
+                if (numOfIdle == workers.size())
+                    return;
+                std::this_thread::yield();
+            }
+        }
+    }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
 MemDomain::MemDomain() {
+    static std::atomic<uint> nextId{0};
+    id = nextId++;
+    externalGcTrigger = EXTERNAL_GC_MIN_BYTES;
     for (std::size_t i = 0; i < clusters.size(); i++) {
         clusters[i].domain = this;
-        clusters[i].chunkSize = (i + 3) * ALIGNMENT;
-        clusters[i].Init();
+        clusters[i].chunkSize = SIZE_CLASSES[i];
     }
     SetFlag_IsAvailable(true);
 }
 
+// Deletes all objects of the domain, no matter if they are reachable,
+// and returns all pages to the bank.
+MemDomain::~MemDomain() {
+    // Image is one mapping, its objects are constants without Delete methods.
+    if (imageBase != nullptr) {
+        FreeMemory(imageBase, imageSize);
+        return;
+    }
+
+    if (GetFlag_IsFrozen()) {
+        std::vector<std::pair<Page*, uint>> runs;
+        GetPageRuns(runs);
+        for (auto [page, numOfPages] : runs)
+            ProtectPages((std::byte*)page, (std::size_t)numOfPages * PAGE_SIZE, false);
+    }
+
+    for (auto & cluster : clusters) {
+        if (cluster.activePage != nullptr)
+            cluster.unavailablePages.push_back(cluster.activePage);
+        for (auto * pages : {&cluster.availablePages,
+                             &cluster.unavailablePages,
+                             &cluster.unsweptPages})
+        {
+            for (Page * page : *pages) {
+                page->DeleteAll();
+                MemBank::AcceptPage((std::byte*)page);
+            }
+        }
+    }
+
+    for (Page * span : largeSpans) {
+        auto * obj = (Obj*)((std::byte*)span + sizeof(Page));
+        if (!IsFreeChunk(obj))
+            obj->Delete();
+        MemBank::FreeSpan((std::byte*)span, SpanNumOfPages(span->chunkSize));
+    }
+
+    if (budget != nullptr)
+        budget->Return(totalNumOfPages);
+}
+
 std::byte * MemDomain::GetChunk(uint chunkSize) {
     assert(chunkSize >= 24);
-    assert(chunkSize <= 64);
+    assert(!GetFlag_IsFrozen());
 
-    uint clusterIndex = 0;
-    if (chunkSize % ALIGNMENT == 0) {
-        clusterIndex = (chunkSize / ALIGNMENT) - 3;
-    } else {
-        // Actually clusterIndex = ((chunkSize / ALIGNMENT) + 1) - 3;
-        clusterIndex = (chunkSize / ALIGNMENT) - 2;
-    }
+    if (chunkSize > MAX_CHUNK_SIZE)
+        return GetChunk_Large(chunkSize);
 
-    auto & cluster = clusters[clusterIndex];
+    auto & cluster = clusters[SizeClassIndex(chunkSize)];
     return cluster.GetChunk();
 }
 
+std::byte * MemDomain::GetChunk_Large(uint chunkSize) {
+    // Large span is a sequence of pages starting with an ordinary page header,
+    // so Page::GetPage works for a large object too.
+    uint numOfPages = SpanNumOfPages(chunkSize);
+    if (!TakePages(numOfPages))
+        return nullptr;
+
+    std::byte * span = MemBank::GetSpan(numOfPages);
+    if (span == nullptr) {
+        ReturnPages(numOfPages);
+        return nullptr;
+    }
+
+    auto * page = (Page*)span;
+    page->domain        = this;
+    page->chunkSize     = chunkSize;
+    page->nextFreeChunk = nullptr;
+
+    largeSpans.push_back(page);
+    allocatedBytes += chunkSize;
+    return span + sizeof(Page);
+}
+
+void MemDomain::SweepLargeSpans() {
+    for (std::size_t i = 0; i < largeSpans.size(); ) {
+        Page * span = largeSpans[i];
+        auto * obj = (Obj*)((std::byte*)span + sizeof(Page));
+
+        if (AllocProfiler::enabled && !IsFreeChunk(obj))
+            AllocProfiler::OnSweep(obj, obj->GetFlag_IsMarked());
+
+        if (obj->GetFlag_IsMarked()) {
+            obj->SetFlag_IsMarked(false);
+            lastMarked++;
+            i++;
+            continue;
+        }
+
+        // Chunk may be not initialized yet, if it was taken just before gc.
+        if (!IsFreeChunk(obj)) {
+            obj->Delete();
+            lastDeleted++;
+        }
+        largeSpans[i] = largeSpans.back();
+        largeSpans.pop_back();
+        uint numOfPages = SpanNumOfPages(span->chunkSize);
+        ReturnPages(numOfPages);
+        MemBank::FreeSpan((std::byte*)span, numOfPages);
+    }
+}
+
+void MemDomain::GetObjects(std::vector<Obj*> & objects) {
+    for (auto & cluster : clusters) {
+        if (cluster.activePage != nullptr)
+            cluster.activePage->GetObjects(objects);
+        for (auto * pages : {&cluster.availablePages,
+                             &cluster.unavailablePages,
+                             &cluster.unsweptPages})
+        {
+            for (Page * page : *pages)
+                page->GetObjects(objects);
+        }
+    }
+
+    for (Page * span : largeSpans) {
+        auto * obj = (Obj*)((std::byte*)span + sizeof(Page));
+        if (!IsFreeChunk(obj))
+            objects.push_back(obj);
+    }
+}
+
 uint MemDomain::NumOfPages() { return totalNumOfPages; }
 
+void MemDomain::UpdateExternalGcTrigger() {
+    // Called when all pages are swept, so only live objects hold
+    // external memory now.
+    externalGcTrigger = std::max(2 * externalBytes, EXTERNAL_GC_MIN_BYTES);
+}
+
+bool MemDomain::TakePages(uint numOfPages) {
+    if (totalNumOfPages + numOfPages > limitNumOfPages)
+        return false;
+    // Domain with grown external memory looks full, so the allocation
+    // goes the usual way of a full domain and triggers gc.
+    if (IsExternalGcTriggered())
+        return false;
+    if (budget != nullptr && !budget->Take(numOfPages))
+        return false;
+    totalNumOfPages += numOfPages;
+    return true;
+}
+
+void MemDomain::ReturnPages(uint numOfPages) {
+    totalNumOfPages -= numOfPages;
+    if (budget != nullptr)
+        budget->Return(numOfPages);
+}
+
+uint MemDomain::NumOfUnsweptPages() {
+    uint numOfUnsweptPages = 0;
+    for (auto & c : clusters)
+        numOfUnsweptPages += c.unsweptPages.size();
+    return numOfUnsweptPages;
+}
+
 uint MemDomain::Capacity() {
-    uint capacity = 0;
+    uint capacity = largeSpans.size();
     for (auto & c : clusters)
         capacity += c.Capacity();
     return capacity;
@@ -433,37 +1272,565 @@ uint MemDomain::Capacity() {
 
 uint MemDomain::NumOfObj() {
     uint numOfObj = 0;
+    for (auto * span : largeSpans)
+        numOfObj += span->NumOfObj();
     for (auto & c : clusters)
         numOfObj += c.NumOfObj();
     return numOfObj;
 }
 
+void MemDomain::UpdateShrinkFactor() {
+    uint totalNumOfObj = lastMarked + lastDeleted;
+    if (totalNumOfObj == 0)
+        return;
+    shrinkFactor = (double)lastDeleted / totalNumOfObj;
+}
+
 void MemDomain::Gc() {
+    auto start = std::chrono::steady_clock::now();
+
+    // Gc may be called while incremental marking is in progress,
+    // in this case we just complete it.
+    if (!GetFlag_IsMarking())
+        StartMarking();
+
+    if (Heap::numOfGcThreads > 1) {
+        ParallelMark();
+        EndMarking();
+        // With several threads sweeping is cheap, so we don't leave it
+        // for allocations and sweep all pages right away.
+        FinishSweep();
+    } else {
+        while (!markQueue.empty()) {
+            markQueue.back()->Mark();
+            markQueue.pop_back();
+        }
+        MarkRoots();
+        DrainMarkStack();
+        EndMarking();
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    RecordPause(std::chrono::duration_cast<std::chrono::microseconds>(end - start).count());
+}
+
+const double INCREMENTAL_MARKING_START = 0.75;
+
+const uint   COMPACTION_MIN_PAGES = 64;
+const double COMPACTION_START     = 0.5;
+
+bool MemDomain::NeedsCompaction() {
+    // Checked when all pages of a cycle are swept, so the shrink factor
+    // is complete and compaction doesn't force sweeping.
+    if (GetFlag_IsMarking() || GetFlag_IsBabyDomain() || GetFlag_IsConstant())
+        return false;
+    return totalNumOfPages >= COMPACTION_MIN_PAGES && sweptShrinkFactor >= COMPACTION_START;
+}
+
+bool MemDomain::NeedsIncrementalMarking() {
+    if (GetFlag_IsMarking() || GetFlag_IsBabyDomain() || GetFlag_IsConstant())
+        return false;
+    return totalNumOfPages >= limitNumOfPages * INCREMENTAL_MARKING_START;
+}
+
+void MemDomain::StartMarking() {
+    // Pages that were not swept since the last gc still hold
+    // old marks, so they must be swept before the new marking.
+    FinishSweep();
+
     lastMarked   = 0;
     lastDeleted  = 0;
     shrinkFactor = 0;
 
+    if (GcTelemetry::enabled) {
+        std::uint64_t now = GcTelemetry::Now();
+        cycle = {};
+        cycle.domainId   = id;
+        cycle.domainKind = GetFlag_IsBabyDomain() ? "baby" : GetFlag_IsConstant() ? "constant" : "active";
+        cycle.startTime  = now;
+        cycle.allocatedBytes = allocatedBytes;
+        if (now > lastCycleStart)
+            cycle.allocRate = allocatedBytes * 1e6 / (now - lastCycleStart);
+        lastCycleStart = now;
+        isCyclePending = true;
+    }
+    lastAllocatedBytes = allocatedBytes;
+    allocatedBytes     = 0;
+    cyclePause         = 0;
+
+    // External memory of dead objects is freed when they are swept,
+    // until then it's a high estimate, see UpdateExternalGcTrigger.
+    externalGcTrigger = std::max(2 * externalBytes, EXTERNAL_GC_MIN_BYTES);
+
+    markQueue.clear();
     for (auto & cluster : clusters)
-        cluster.Mark();
+        cluster.AddPagesToMarkQueue(markQueue);
+    markQueue.insert(markQueue.end(), largeSpans.begin(), largeSpans.end());
+
+    SetFlag_IsMarking(true);
+    Heap::numOfMarkingDomains++;
+}
+
+void MemDomain::MarkStep() {
+    assert(GetFlag_IsMarking());
+    auto start = std::chrono::steady_clock::now();
+
+    for (uint i = 0; i < markStepBudget && !markQueue.empty(); i++) {
+        markQueue.back()->Mark();
+        markQueue.pop_back();
+    }
+
+    // Roots change between steps, so they are marked by the last one.
+    // Objects they got in the meantime went through the write barrier.
+    if (markQueue.empty())
+        MarkRoots();
+    DrainMarkStack();
+
+    if (markQueue.empty())
+        EndMarking();
+
+    auto end = std::chrono::steady_clock::now();
+    RecordPause(std::chrono::duration_cast<std::chrono::microseconds>(end - start).count());
+}
 
+void MemDomain::MarkRoots() {
+    std::vector<Obj**> slots;
+    if (Heap::GetRootSlots != nullptr)
+        Heap::GetRootSlots(slots);
+    for (auto ** slot : slots)
+        MarkObj(*slot);
+}
+
+// Objects of other domains are not marked, their gc finds them by itself.
+void MemDomain::MarkObj(Obj * obj) {
+    if (obj == nullptr || obj->GetFlag_IsMarked())
+        return;
+    if (Page::GetPage(obj)->domain != this)
+        return;
+    obj->SetFlag_IsMarked(true);
+    markStack.push_back(obj);
+}
+
+void MemDomain::DrainMarkStack() {
+    std::vector<Obj**> slots;
+    while (!markStack.empty()) {
+        Obj * obj = markStack.back();
+        markStack.pop_back();
+
+        auto getRefSlots = obj->type->methodTable->GetRefSlots;
+        if (getRefSlots == nullptr)
+            continue;
+        slots.clear();
+        getRefSlots(obj, slots);
+        for (auto ** slot : slots)
+            MarkObj(*slot);
+    }
+}
+
+void MemDomain::EndMarking() {
+    SetFlag_IsMarking(false);
+    Heap::numOfMarkingDomains--;
+
+    // Sweeping is lazy. Here we sweep only active pages,
+    // the rest is swept page by page during next allocations.
+    // Statistics (lastMarked, lastDeleted, shrinkFactor) become
+    // complete when all pages are swept.
     for (auto & cluster : clusters)
-        cluster.Sweep();
+        cluster.PrepareLazySweep();
+
+    // There are not many large objects, they are swept right away.
+    SweepLargeSpans();
 
-    if (!GetFlag_IsBabyDomain()) {
+    UpdateShrinkFactor();
+    SetFlag_IsAvailable(true);
+    isSweepPending = true;
+    if (NumOfUnsweptPages() == 0)
+        OnSweepFinished();
+
+    if (isCyclePending)
+        cycle.markEndTime = GcTelemetry::Now();
+}
+
+void MemDomain::OnSweepFinished() {
+    if (!isSweepPending)
+        return;
+    isSweepPending = false;
+
+    // Only live objects hold external memory now.
+    UpdateExternalGcTrigger();
+    sweptShrinkFactor = shrinkFactor;
+    if (NeedsCompaction())
+        Heap::RequestCompaction(this);
+}
+
+void MemDomain::RecordPause(std::uint64_t pause) {
+    maxPause = std::max(maxPause, pause);
+    totalPause += pause;
+    numOfPauses++;
+    cyclePause += pause;
+
+    if (isCyclePending) {
+        cycle.pause += pause;
+        cycle.numOfPauses++;
+    }
+    if (GcTelemetry::enabled)
+        GcTelemetry::RecordPause(pause);
+}
+
+void MemDomain::ParallelMark() {
+    // Roots are greyed here, then the marker traces them together
+    // with the objects of the pages.
+    MarkRoots();
+    if (markQueue.size() < PARALLEL_MIN_PAGES) {
+        for (auto * page : markQueue)
+            page->Mark();
+        markQueue.clear();
+        DrainMarkStack();
+        return;
+    }
+
+    ParallelMarker marker(this, markQueue, Heap::numOfGcThreads);
+    marker.AddGrey(markStack);
+    markStack.clear();
+    gcThreadPool.Run(Heap::numOfGcThreads, [&](uint worker) { marker.Run(worker); });
+    markQueue.clear();
+}
+
+void MemDomain::ParallelSweep() {
+    // Swept pages are put to the unavailable pages list,
+    // AfterGc moves pages that have free chunks to the available one.
+    std::vector<Page*> pages;
+    for (auto & cluster : clusters) {
+        pages.insert(pages.end(), cluster.unsweptPages.begin(), cluster.unsweptPages.end());
+        cluster.unavailablePages.insert(cluster.unavailablePages.end(),
+                                        cluster.unsweptPages.begin(),
+                                        cluster.unsweptPages.end());
+        cluster.unsweptPages.clear();
+    }
+
+    ProcessPages_Parallel(pages,
+                          [](Page * page, uint & marked, uint & deleted) { page->Sweep(marked, deleted); },
+                          lastMarked, lastDeleted);
+    UpdateShrinkFactor();
+}
+
+uint MemDomain::ReleaseEmptyPages() {
+    uint numOfReleased = 0;
+    for (auto & cluster : clusters)
+        numOfReleased += cluster.ReleaseEmptyPages();
+    return numOfReleased;
+}
+
+void MemDomain::FinishSweep() {
+    if (Heap::numOfGcThreads > 1) {
+        ParallelSweep();
+    } else {
         for (auto & cluster : clusters)
-            cluster.ReleaseEmptyPages();
+            cluster.FinishSweep();
     }
+    OnSweepFinished();
+
+    // Lazy sweeping releases empty pages as it goes,
+    // parallel sweeping leaves them for here.
+    if (!GetFlag_IsBabyDomain())
+        ReleaseEmptyPages();
 
     for (auto & cluster : clusters)
         cluster.AfterGc();
 
-    // Computing shrink factor
-    uint totalNumOfObj = lastMarked + lastDeleted;
-    shrinkFactor = (double)lastDeleted / totalNumOfObj;
+    // The cycle is finished when all its pages are swept.
+    if (isCyclePending && !GetFlag_IsMarking()) {
+        cycle.endTime            = GcTelemetry::Now();
+        cycle.numOfMarked        = lastMarked;
+        cycle.numOfDeleted       = lastDeleted;
+        cycle.numOfPages         = totalNumOfPages;
+        isCyclePending = false;
+        GcTelemetry::RecordEvent(cycle);
+    }
+}
 
-    SetFlag_IsAvailable(true);
+///////////////////////////////////////////////////////////////////////////////
+// Domain images.
+//
+// Pointers to objects of the image are stored as offsets from its start,
+// types are stored by names. Loading maps the file, turns offsets back
+// into pointers, links types (relocation) and protects the pages.
+// Relocation writes to every page, so pages of a loaded image are private
+// to the process. To share them between workers, load the image (or freeze
+// the domain) before forking.
+//
+// File layout:
+//     header page  ImageHeader
+//     data pages   pages and large spans of the domain
+//     tables       type names (u32 length, chars), roots (u64 offsets)
+
+struct ImageHeader {
+    char          magic[8];
+    std::uint32_t version;
+    std::uint32_t pageSize;
+    std::uint64_t numOfPages;
+    std::uint32_t numOfTypes;
+    std::uint32_t numOfRoots;
+};
+
+const char          IMAGE_MAGIC[8] = {'V', 'I', 'R', 'G', 'O', 'I', 'M', 'G'};
+const std::uint32_t IMAGE_VERSION  = 1;
+
+void MemDomain::GetPageRuns(std::vector<std::pair<Page*, uint>> & runs) {
+    for (auto & cluster : clusters) {
+        if (cluster.activePage != nullptr)
+            runs.emplace_back(cluster.activePage, 1);
+        for (auto * pages : {&cluster.availablePages,
+                             &cluster.unavailablePages,
+                             &cluster.unsweptPages})
+        {
+            for (Page * page : *pages)
+                runs.emplace_back(page, 1);
+        }
+    }
+    for (Page * span : largeSpans)
+        runs.emplace_back(span, SpanNumOfPages(span->chunkSize));
+}
+
+void MemDomain::Freeze() {
+    if (GetFlag_IsFrozen())
+        return;
+    SetFlag_IsFrozen(true);
+
+    if (imageBase != nullptr) {
+        ProtectPages(imageBase, imageSize, true);
+        return;
+    }
+    std::vector<std::pair<Page*, uint>> runs;
+    GetPageRuns(runs);
+    for (auto [page, numOfPages] : runs)
+        ProtectPages((std::byte*)page, (std::size_t)numOfPages * PAGE_SIZE, true);
+}
+
+bool MemDomain::WriteImage(const std::string & path, const std::vector<Obj*> & roots) {
+    std::vector<std::pair<Page*, uint>> runs;
+    GetPageRuns(runs);
+
+    std::unordered_map<Page*, std::uint64_t> pageOffsets;
+    std::uint64_t offset = PAGE_SIZE;
+    for (auto [page, numOfPages] : runs) {
+        pageOffsets[page] = offset;
+        offset += (std::uint64_t)numOfPages * PAGE_SIZE;
+    }
+
+    // Object pointer to image offset, 0 if it's null or not in the domain.
+    auto toOffset = [&](const void * ptr) -> std::uint64_t {
+        if (ptr == nullptr)
+            return 0;
+        Page * page = Page::GetPage((void*)ptr);
+        auto it = pageOffsets.find(page);
+        if (it == pageOffsets.end())
+            return 0;
+        return it->second + ((const std::byte*)ptr - (std::byte*)page);
+    };
+
+    std::ofstream out(path, std::ios::binary);
+    if (!out.is_open())
+        return false;
+
+    std::vector<std::byte> headerPage(PAGE_SIZE);
+    out.write((const char*)headerPage.data(), PAGE_SIZE);
+
+    std::unordered_map<const Type*, std::uint32_t> typeIndex;
+    std::vector<const Type*> types;
+    std::vector<std::byte> buffer;
+    std::vector<Obj**> slots;
+    for (auto [page, numOfPages] : runs) {
+        auto * src = (std::byte*)page;
+        buffer.assign(src, src + (std::size_t)numOfPages * PAGE_SIZE);
+        auto * pageCopy = (Page*)buffer.data();
+        pageCopy->domain        = nullptr;
+        pageCopy->nextFreeChunk = nullptr;
+
+        uint chunkSize = page->chunkSize;
+        uint capacity  = PageCapacity(chunkSize);
+        for (uint i = 0; i < capacity; i++) {
+            std::size_t chunkPos = sizeof(Page) + (std::size_t)i * chunkSize;
+            std::byte * chunk = src + chunkPos;
+            std::byte * chunkCopy = buffer.data() + chunkPos;
+            if (IsFreeChunk(chunk)) {
+                memset(chunkCopy, 0, chunkSize);
+                continue;
+            }
+
+            auto * obj = (Obj*)chunk;
+            if (typeIndex.count(obj->type) == 0) {
+                typeIndex[obj->type] = types.size();
+                types.push_back(obj->type);
+            }
+            // Index is stored plus one, so the chunk doesn't look free.
+            ((Obj*)chunkCopy)->type = (Type*)(std::uintptr_t)(typeIndex[obj->type] + 1);
+
+            auto getRefSlots = obj->type->methodTable->GetRefSlots;
+            if (getRefSlots == nullptr)
+                continue;
+            slots.clear();
+            getRefSlots(obj, slots);
+            for (auto ** slot : slots) {
+                std::uint64_t refOffset = toOffset(*slot);
+                if (refOffset == 0)
+                    return false; // Image can't refer to objects outside of it.
+                auto * slotCopy = chunkCopy + ((std::byte*)slot - chunk);
+                memcpy(slotCopy, &refOffset, sizeof(refOffset));
+            }
+        }
+        out.write((const char*)buffer.data(), buffer.size());
+    }
+
+    for (auto * type : types) {
+        auto len = (std::uint32_t)type->name.size();
+        out.write((const char*)&len, sizeof(len));
+        out.write(type->name.data(), len);
+    }
+    for (auto * root : roots) {
+        std::uint64_t rootOffset = toOffset(root);
+        out.write((const char*)&rootOffset, sizeof(rootOffset));
+    }
+
+    ImageHeader header{};
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+    header.version    = IMAGE_VERSION;
+    header.pageSize   = PAGE_SIZE;
+    header.numOfPages = offset / PAGE_SIZE - 1;
+    header.numOfTypes = types.size();
+    header.numOfRoots = roots.size();
+    out.seekp(0);
+    out.write((const char*)&header, sizeof(header));
+    return out.good();
+}
+
+static std::byte * MapImage(const std::string & path, std::size_t & size) {
+#ifdef VIRGO_USE_MMAP
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+    struct stat st{};
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)PAGE_SIZE) {
+        close(fd);
+        return nullptr;
+    }
+    size = st.st_size;
+    void * mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+        return nullptr;
+    return (std::byte*)mem;
+#else
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in.is_open())
+        return nullptr;
+    size = in.tellg();
+    auto * mem = (std::byte*)std::aligned_alloc(PAGE_SIZE, (size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE);
+    in.seekg(0);
+    in.read((char*)mem, size);
+    return mem;
+#endif
+}
+
+MemDomain * MemDomain::LoadImage(const std::string & path, std::vector<Obj*> & roots) {
+    std::size_t size = 0;
+    std::byte * base = MapImage(path, size);
+    if (base == nullptr)
+        return nullptr;
+
+    auto fail = [&]() -> MemDomain* {
+        FreeMemory(base, size);
+        return nullptr;
+    };
+
+    ImageHeader header;
+    memcpy(&header, base, sizeof(header));
+    std::size_t tablesPos = (header.numOfPages + 1) * PAGE_SIZE;
+    if (memcmp(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0 ||
+        header.version != IMAGE_VERSION ||
+        header.pageSize != PAGE_SIZE ||
+        ((std::uint64_t)base & ~PAGE_MASK) != 0 ||
+        tablesPos > size)
+        return fail();
+
+    std::size_t pos = tablesPos;
+    std::vector<Type*> types;
+    for (std::uint32_t i = 0; i < header.numOfTypes; i++) {
+        std::uint32_t len;
+        if (pos + sizeof(len) > size)
+            return fail();
+        memcpy(&len, base + pos, sizeof(len));
+        pos += sizeof(len);
+        if (pos + len > size)
+            return fail();
+        Type * type = Type::Find(std::string((const char*)base + pos, len));
+        if (type == nullptr)
+            return fail();
+        types.push_back(type);
+        pos += len;
+    }
+    if (pos + header.numOfRoots * sizeof(std::uint64_t) > size)
+        return fail();
+
+    auto toPtr = [&](std::uint64_t offset) -> Obj* {
+        return offset == 0 ? nullptr : (Obj*)(base + offset);
+    };
+
+    auto * domain = new MemDomain();
+    domain->SetFlag_IsConstant(true);
+    domain->imageBase       = base;
+    domain->imageSize       = size;
+    domain->totalNumOfPages = header.numOfPages;
+    domain->limitNumOfPages = header.numOfPages;
+
+    std::vector<Obj**> slots;
+    for (std::size_t pagePos = PAGE_SIZE; pagePos < tablesPos; ) {
+        auto * page = (Page*)(base + pagePos);
+        page->domain = domain;
+
+        uint chunkSize = page->chunkSize;
+        uint capacity  = PageCapacity(chunkSize);
+        auto * chunk = (std::byte*)page + sizeof(Page);
+        for (uint i = 0; i < capacity; i++, chunk += chunkSize) {
+            if (IsFreeChunk(chunk))
+                continue;
+            auto * obj = (Obj*)chunk;
+            obj->type = types.at((std::uintptr_t)obj->type - 1);
+
+            auto getRefSlots = obj->type->methodTable->GetRefSlots;
+            if (getRefSlots != nullptr) {
+                slots.clear();
+                getRefSlots(obj, slots);
+                for (auto ** slot : slots)
+                    *slot = toPtr((std::uint64_t)*slot);
+            }
+            auto movedMethod = obj->type->methodTable->Moved;
+            if (movedMethod != nullptr)
+                movedMethod(obj);
+        }
+
+        if (chunkSize > MAX_CHUNK_SIZE) {
+            domain->largeSpans.push_back(page);
+            pagePos += (std::size_t)SpanNumOfPages(chunkSize) * PAGE_SIZE;
+        } else {
+            domain->clusters[SizeClassIndex(chunkSize)].unavailablePages.push_back(page);
+            pagePos += PAGE_SIZE;
+        }
+    }
+
+    for (std::uint32_t i = 0; i < header.numOfRoots; i++) {
+        std::uint64_t offset;
+        memcpy(&offset, base + pos, sizeof(offset));
+        pos += sizeof(offset);
+        roots.push_back(toPtr(offset));
+    }
+
+    domain->Freeze();
+    return domain;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+
 void MemDomain::PrintStatus(const std::string & additionalMessage /* = "" */) {
     std::cout << '\n' << std::string(60, '-') << '\n';
     std::cout << "MemDomain status";
@@ -478,7 +1845,12 @@ void MemDomain::PrintStatus(const std::string & additionalMessage /* = "" */) {
               << "capacity : " << Capacity() << '\n'
               << "objects  : " << NumOfObj() << '\n'
               << "memory   : " << Utils::NumSep(totalNumOfPages * 4) << " kb\n"
-              << "shrink   : " << shrinkFactor << '\n';
+              << "large    : " << largeSpans.size() << '\n'
+              << "unswept  : " << NumOfUnsweptPages() << '\n'
+              << "shrink   : " << shrinkFactor << '\n'
+              << "pauses   : " << numOfPauses << '\n'
+              << "max pause: " << Utils::NumSep(maxPause) << " us\n"
+              << "avg pause: " << (numOfPauses == 0 ? 0 : totalPause / numOfPauses) << " us\n";
 
 
     std::cout << "\npage clusters:\n";
@@ -493,8 +1865,10 @@ void MemDomain::PrintStatus(const std::string & additionalMessage /* = "" */) {
 
     for (auto & c : clusters) {
         uint chunkSize    = c.chunkSize;
-        uint pageCapacity = PAGE_CAPACITY(chunkSize);
+        uint pageCapacity = PageCapacity(chunkSize);
         uint c_numOfPages = c.NumOfPages();
+        if (c_numOfPages == 0)
+            continue;
         uint fullCapacity = pageCapacity * c_numOfPages;
         uint numOfObjects = c.NumOfObj();
         uint occupancy    = ((double)numOfObjects / fullCapacity) * 100;
@@ -511,32 +1885,108 @@ void MemDomain::PrintStatus(const std::string & additionalMessage /* = "" */) {
 
 ///////////////////////////////////////////////////////////////////////////////
 
-MemDomain * Heap::constantDomain;
-MemDomain * Heap::babyDomain;
-uint        Heap::activeDomainIndex = 0;
-MemDomain * Heap::activeDomain;
-std::vector<MemDomain*> Heap::domains;
+MemDomain *              Heap::constantDomain;
+thread_local MemDomain * Heap::babyDomain;
+thread_local uint        Heap::activeDomainIndex = 0;
+thread_local MemDomain * Heap::activeDomain;
+thread_local std::vector<MemDomain*> Heap::domains;
 
 void (*Heap::PreDomainGc)(MemDomain * gcDomain);
 void (*Heap::PreGlobalGc)();
+void (*Heap::GetRootSlots)(std::vector<Obj**> & slots);
+void (*Heap::RootsMoved)(const std::unordered_map<Obj*, Obj*> & forwarding);
+thread_local std::vector<MemDomain*> Heap::pendingCompactions;
+thread_local uint        Heap::numOfMarkingDomains = 0;
+thread_local std::size_t Heap::bytesToMarkStep = 0;
+uint        Heap::numOfGcThreads = 1;
+AdaptiveGcPolicy defaultGcPolicy;
+GcPolicy *  Heap::gcPolicy = &defaultGcPolicy;
+thread_local MemBudget Heap::budget;
 
 void Heap::Init() {
     constantDomain = new MemDomain();
     constantDomain->SetFlag_IsConstant(true);
     constantDomain->limitNumOfPages = UINT32_MAX;
 
-    babyDomain = new MemDomain();
+    InitThread();
+}
+
+// Frees the heap of a thread when it exits. The page cache of the thread
+// is created first, so it's destroyed after the heap gives pages to it.
+struct ThreadHeapOwner {
+    ThreadHeapOwner() {
+        MemBank::localPages.lastUse = MemBank::Clock::now();
+    }
+    ~ThreadHeapOwner() {
+        Heap::FreeThread();
+    }
+};
+
+void Heap::InitThread() {
+    static thread_local ThreadHeapOwner owner;
+
+    babyDomain = NewDomain();
     babyDomain->SetFlag_IsBabyDomain(true);
+    babyDomain->limitNumOfPages = gcPolicy->InitialLimit(babyDomain);
 
-    domains.push_back(new MemDomain());
+    domains.push_back(NewDomain());
     activeDomain = domains[0];
 }
 
+void Heap::FreeThread() {
+    // Objects are deleted with their domains, marking and compaction
+    // requests of the thread are dropped.
+    for (auto * domain : domains) {
+        if (domain->GetFlag_IsMarking())
+            numOfMarkingDomains--;
+        delete domain;
+    }
+    domains.clear();
+    if (babyDomain != nullptr && babyDomain->GetFlag_IsMarking())
+        numOfMarkingDomains--;
+    delete babyDomain;
+    babyDomain   = nullptr;
+    activeDomain = nullptr;
+    pendingCompactions.clear();
+    assert(numOfMarkingDomains == 0);
+}
+
+MemDomain * Heap::NewDomain() {
+    auto * domain = new MemDomain();
+    domain->budget = &budget;
+    domain->limitNumOfPages = gcPolicy->InitialLimit(domain);
+    return domain;
+}
+
+uint Heap::NumOfPages() {
+    uint numOfPages = babyDomain == nullptr ? 0 : babyDomain->NumOfPages();
+    for (auto * domain : domains)
+        numOfPages += domain->NumOfPages();
+    return numOfPages;
+}
+
+std::mutex constantDomainMutex;
+
 std::byte * Heap::GetChunk_Constant(uint chunkSize) {
+    std::lock_guard<std::mutex> lock(constantDomainMutex);
     return constantDomain->GetChunk(chunkSize);
 }
 
+// Bytes allocated in the baby domain per incremental marking step
+// of the active domain. A step marks markStepBudget pages, so marking
+// outpaces promotion and ends before the active domain is full.
+const std::size_t MARK_STEP_BYTES = 4 * PAGE_SIZE;
+
 std::byte * Heap::GetChunk_Baby(uint chunkSize) {
+    if (numOfMarkingDomains > 0 && activeDomain->GetFlag_IsMarking()) {
+        if (bytesToMarkStep <= chunkSize) {
+            bytesToMarkStep = MARK_STEP_BYTES;
+            MarkIncrementally(activeDomain);
+        } else {
+            bytesToMarkStep -= chunkSize;
+        }
+    }
+
     std::byte * chunk = babyDomain->GetChunk(chunkSize);
     if (chunk != nullptr)
         return chunk;
@@ -546,19 +1996,24 @@ std::byte * Heap::GetChunk_Baby(uint chunkSize) {
     if (chunk != nullptr)
         return chunk;
 
-    std::cerr << "Error. Can't allocate chunk in baby domain.";
-    abort();
-}
+    // Baby domain may be unable to grow because of the memory limit,
+    // then the rest of the heap must give pages back.
+    GlobalGc();
+    chunk = babyDomain->GetChunk(chunkSize);
+    if (chunk != nullptr)
+        return chunk;
 
-const double SHRINK_FACTOR_THRESHOLD = 0.2;
+    throw OutOfMemoryError("Out of memory. Can't allocate chunk in baby domain.");
+}
 
 std::byte * Heap::GetChunk_Preferable(MemDomain * preferableDomain, uint chunkSize) {
     if (preferableDomain->GetFlag_IsAvailable()) {
+        MarkIncrementally(preferableDomain);
         std::byte * chunk = preferableDomain->GetChunk(chunkSize);
         if (chunk != nullptr)
             return chunk;
 
-        if (preferableDomain->shrinkFactor > SHRINK_FACTOR_THRESHOLD) {
+        if (gcPolicy->ShouldCollect(preferableDomain)) {
             DomainGc(preferableDomain);
             chunk = preferableDomain->GetChunk(chunkSize);
             if (chunk != nullptr)
@@ -571,11 +2026,12 @@ std::byte * Heap::GetChunk_Preferable(MemDomain * preferableDomain, uint chunkSi
 
 std::byte * Heap::GetChunk_Active(uint chunkSize) {
     try_get_chunk:
+    MarkIncrementally(activeDomain);
     std::byte * chunk = activeDomain->GetChunk(chunkSize);
     if (chunk != nullptr)
         return chunk;
 
-    if (activeDomain->shrinkFactor > SHRINK_FACTOR_THRESHOLD) {
+    if (gcPolicy->ShouldCollect(activeDomain)) {
         DomainGc(activeDomain);
         chunk = activeDomain->GetChunk(chunkSize);
         if (chunk != nullptr)
@@ -592,8 +2048,7 @@ std::byte * Heap::GetChunk_Active(uint chunkSize) {
     chunk = activeDomain->GetChunk(chunkSize);
     if (chunk != nullptr)
         return chunk;
-    std::cerr << "Error. Can't allocate chunk.";
-    abort();
+    throw OutOfMemoryError("Out of memory. Can't allocate chunk.");
 }
 
 bool Heap::UpdateActiveDomain() {
@@ -601,20 +2056,533 @@ bool Heap::UpdateActiveDomain() {
 }
 
 void Heap::DomainGc(MemDomain * domain) {
-    PreDomainGc(domain);
+    if (!domain->GetFlag_IsMarking() && PreDomainGc != nullptr)
+        PreDomainGc(domain);
     domain->Gc();
+    gcPolicy->AfterGc(domain);
+    MemBank::ReleaseIdlePages();
+
+    // Active domain grows by promoted baby pages, so its marking
+    // starts here, then advances with allocations (GetChunk_Baby).
+    if (domain == babyDomain && activeDomain != nullptr)
+        MarkIncrementally(activeDomain);
 }
 
 void Heap::GlobalGc() {
-    PreGlobalGc();
+    // Full gc of the thread heap: all pages are swept right away,
+    // so empty pages go back to the bank and to the memory budget.
+    if (PreGlobalGc != nullptr)
+        PreGlobalGc();
+
+    std::vector<MemDomain*> heapDomains { babyDomain };
+    heapDomains.insert(heapDomains.end(), domains.begin(), domains.end());
+    for (auto * domain : heapDomains) {
+        domain->Gc();
+        domain->FinishSweep();
+    }
+    MemBank::ReleaseIdlePages();
 }
 
 void Heap::UpdateActiveDomain_AfterGlobalGc() {
 
 }
 
+void Heap::MarkIncrementally(MemDomain * domain) {
+    if (domain->GetFlag_IsMarking()) {
+        domain->MarkStep();
+        if (!domain->GetFlag_IsMarking())
+            gcPolicy->AfterGc(domain);
+        return;
+    }
+
+    if (domain->NeedsIncrementalMarking()) {
+        if (PreDomainGc != nullptr)
+            PreDomainGc(domain);
+        domain->StartMarking();
+    }
+}
+
+void Heap::AddExternalMemory(Obj * owner, std::size_t bytes) {
+    MemDomain * domain = Page::GetPage(owner)->domain;
+    if (domain->budget != nullptr && !domain->budget->TakeBytes(bytes))
+        throw OutOfMemoryError("Out of memory. Can't allocate external memory.");
+    domain->externalBytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void Heap::RemoveExternalMemory(Obj * owner, std::size_t bytes) {
+    // Called by gc threads too, when they sweep in parallel.
+    MemDomain * domain = Page::GetPage(owner)->domain;
+    domain->externalBytes.fetch_sub(bytes, std::memory_order_relaxed);
+    if (domain->budget != nullptr)
+        domain->budget->ReturnBytes(bytes);
+}
+
+void Heap::Compact(MemDomain * domain) {
+    if (domain->GetFlag_IsMarking())
+        return;
+    domain->FinishSweep();
+    auto it = std::find(pendingCompactions.begin(), pendingCompactions.end(), domain);
+    if (it != pendingCompactions.end())
+        pendingCompactions.erase(it);
+    domain->lastMoved = 0;
+    domain->sweptShrinkFactor = 0;
+
+    std::unordered_map<Obj*, Obj*> forwarding;
+    std::vector<Page*> evacuatedPages;
+    for (auto & cluster : domain->clusters)
+        cluster.Evacuate(forwarding, evacuatedPages);
+
+    if (forwarding.empty() && evacuatedPages.empty())
+        return;
+
+    std::vector<Obj**> slots;
+    GetSlots(slots, domain);
+    for (auto ** slot : slots) {
+        auto it = forwarding.find(*slot);
+        if (it != forwarding.end())
+            *slot = it->second;
+    }
+    if (RootsMoved != nullptr)
+        RootsMoved(forwarding);
+    domain->lastMoved = forwarding.size();
+
+    for (Page * page : evacuatedPages) {
+        domain->ReturnPages(1);
+        MemBank::AcceptPage((std::byte*)page);
+    }
+}
+
+// Only domains of the thread heap are compacted,
+// other ones may be gone by the safe point.
+void Heap::RequestCompaction(MemDomain * domain) {
+    bool isHeapDomain = domain == babyDomain ||
+                        std::find(domains.begin(), domains.end(), domain) != domains.end();
+    if (!isHeapDomain)
+        return;
+    if (std::find(pendingCompactions.begin(), pendingCompactions.end(), domain) == pendingCompactions.end())
+        pendingCompactions.push_back(domain);
+}
+
+// Moved objects may be referred from any domain of this thread
+// and from the interpreter. Constants don't refer to mutable objects.
+void Heap::GetSlots(std::vector<Obj**> & slots, MemDomain * domain) {
+    std::vector<MemDomain*> heapDomains { babyDomain };
+    heapDomains.insert(heapDomains.end(), domains.begin(), domains.end());
+    if (domain != nullptr && std::find(heapDomains.begin(), heapDomains.end(), domain) == heapDomains.end())
+        heapDomains.push_back(domain);
+
+    if (GetRootSlots != nullptr)
+        GetRootSlots(slots);
+
+    std::vector<Obj*> objects;
+    for (auto * d : heapDomains) {
+        if (d != nullptr)
+            d->GetObjects(objects);
+    }
+    for (auto * obj : objects) {
+        auto getRefSlots = obj->type->methodTable->GetRefSlots;
+        if (getRefSlots != nullptr)
+            getRefSlots(obj, slots);
+    }
+}
+
+void Heap::CompactPending() {
+    // A domain that started a new cycle since the request decides
+    // again when the cycle is swept.
+    std::vector<MemDomain*> pending;
+    pending.swap(pendingCompactions);
+    for (auto * domain : pending) {
+        if (domain->GetFlag_IsMarking() || domain->NumOfUnsweptPages() > 0)
+            continue;
+        Compact(domain);
+    }
+}
+
+void Heap::WriteBarrier_Marking(Obj * value) {
+    if (value == nullptr)
+        return;
+
+    Page * page = Page::GetPage(value);
+    if (!page->domain->GetFlag_IsMarking())
+        return;
+
+    page->domain->MarkObj(value);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 
+struct Test_Node : Obj {
+    Obj *   next;
+    int64_t val;
+};
+
+static void Test_Node_GetRefSlots(Obj * self, std::vector<Obj**> & slots) {
+    auto * node = (Test_Node*)self;
+    if (node->next != nullptr)
+        slots.push_back(&node->next);
+}
+
+void Test_Compact() {
+    // Makes a list of nodes spread over many pages with a lot of garbage
+    // between them, then compacts the domain and checks that the list
+    // is intact and takes less pages.
+    auto * nodeType = new Type("node");
+    nodeType->methodTable->GetRefSlots = &Test_Node_GetRefSlots;
+
+    auto * domain = new MemDomain();
+    domain->limitNumOfPages = UINT32_MAX;
+    const int numOfNodes = 100'000;
+
+    Test_Node * head = nullptr;
+    Test_Node * tail = nullptr;
+    std::vector<Test_Node*> garbage;
+    for (int i = 0; i < numOfNodes; i++) {
+        auto * node = (Test_Node*)domain->GetChunk(sizeof(Test_Node));
+        Obj::Init(node, nodeType);
+        node->next = nullptr;
+        node->val  = i;
+        if (i % 32 != 0) {
+            garbage.push_back(node);
+            continue;
+        }
+        if (head == nullptr)
+            head = node;
+        else
+            tail->next = node;
+        tail = node;
+    }
+    head->AddOwner();
+
+    // Freed as the sweeper would do it.
+    for (auto * node : garbage)
+        Page::FreeChunk((std::byte*)node);
+    for (auto & cluster : domain->clusters)
+        cluster.AfterGc();
+
+    uint numOfPagesBefore = domain->NumOfPages();
+    Heap::Compact(domain);
+    assert(domain->NumOfPages() < numOfPagesBefore);
+
+    int i = 0;
+    for (auto * node = head; node != nullptr; node = (Test_Node*)node->next, i += 32) {
+        assert(node->type == nodeType);
+        assert(node->val == i);
+    }
+    assert(i == (numOfNodes + 31) / 32 * 32);
+    delete domain;
+}
+
+void Test_LazySweep() {
+    // Fills pages with garbage, then allocates after gc and checks that
+    // empty pages are released before sweeping is finished.
+    auto * testType = new Type("test");
+    auto * domain = new MemDomain();
+    domain->limitNumOfPages = UINT32_MAX;
+    const uint chunkSize = 32;
+    const uint numOfPages = 8;
+    const uint capacity = PageCapacity(chunkSize);
+
+    for (uint i = 0; i < numOfPages * capacity; i++)
+        Obj::Init(domain->GetChunk(chunkSize), testType);
+    assert(domain->NumOfPages() == numOfPages);
+
+    domain->Gc();
+    assert(domain->NumOfUnsweptPages() > 0);
+    for (uint i = 0; i < 2 * capacity + 1; i++)
+        Obj::Init(domain->GetChunk(chunkSize), testType);
+    assert(domain->NumOfUnsweptPages() > 0);
+    assert(domain->NumOfPages() < numOfPages);
+
+    // Only pages of the new objects are left.
+    domain->FinishSweep();
+    assert(domain->NumOfPages() == 3);
+}
+
+void Test_IncrementalMarking() {
+    // Object gets its first owner after its page was marked,
+    // the barrier must keep it alive.
+    auto * testType = new Type("test");
+    auto * domain = new MemDomain();
+    domain->limitNumOfPages = UINT32_MAX;
+    domain->markStepBudget = 1;
+    const uint chunkSize = 32;
+    const uint capacity = PageCapacity(chunkSize);
+
+    Obj * obj = nullptr;
+    for (uint i = 0; i < 2 * capacity + 1; i++) {
+        obj = (Obj*)domain->GetChunk(chunkSize);
+        Obj::Init(obj, testType);
+    }
+
+    // The active page, which holds the last object, is marked first.
+    domain->StartMarking();
+    domain->MarkStep();
+    assert(domain->GetFlag_IsMarking());
+    obj->AddOwner();
+    while (domain->GetFlag_IsMarking())
+        domain->MarkStep();
+    domain->FinishSweep();
+    assert(domain->NumOfObj() == 1);
+    assert(!IsFreeChunk((std::byte*)obj) && obj->type == testType);
+    obj->RemoveOwner();
+
+    // Survivors of the baby domain are promoted to the active domain
+    // with their pages, which makes it mark incrementally.
+    MemDomain * activeDomain = Heap::activeDomain;
+    uint numOfPauses = activeDomain->numOfPauses;
+    uint babyLimit   = Heap::babyDomain->limitNumOfPages;
+    uint activeLimit = activeDomain->limitNumOfPages;
+    std::vector<Obj*> owned;
+    for (uint i = 0; i < 1'000'000; i++) {
+        auto * baby = (Obj*)Heap::GetChunk_Baby(chunkSize);
+        Obj::Init(baby, testType);
+        if (i % 4 != 0) {
+            baby->AddOwner();
+            owned.push_back(baby);
+        }
+    }
+    assert(activeDomain->NumOfPages() > 0);
+    assert(activeDomain->numOfPauses > numOfPauses);
+    for (auto * o : owned) {
+        assert(o->type == testType);
+        o->RemoveOwner();
+    }
+
+    // Following tests expect the heap as it was.
+    Heap::GlobalGc();
+    Heap::babyDomain->limitNumOfPages = babyLimit;
+    activeDomain->limitNumOfPages = activeLimit;
+}
+
+struct Test_TreeNode : Obj {
+    Obj * left;
+    Obj * right;
+};
+
+static void Test_TreeNode_GetRefSlots(Obj * self, std::vector<Obj**> & slots) {
+    auto * node = (Test_TreeNode*)self;
+    if (node->left != nullptr)
+        slots.push_back(&node->left);
+    if (node->right != nullptr)
+        slots.push_back(&node->right);
+}
+
+void Test_ParallelMark() {
+    // The whole tree is reachable from a single root, with garbage
+    // between its nodes. Gc threads must share the work of tracing it
+    // and mark each node once.
+    auto * nodeType = new Type("tree node");
+    nodeType->methodTable->GetRefSlots = &Test_TreeNode_GetRefSlots;
+    auto * domain = new MemDomain();
+    domain->limitNumOfPages = UINT32_MAX;
+    const uint numOfNodes = 200'000;
+
+    std::vector<Test_TreeNode*> nodes;
+    for (uint i = 0; i < numOfNodes; i++) {
+        auto * node = (Test_TreeNode*)domain->GetChunk(sizeof(Test_TreeNode));
+        Obj::Init(node, nodeType);
+        node->left  = nullptr;
+        node->right = nullptr;
+        nodes.push_back(node);
+        Obj::Init(domain->GetChunk(sizeof(Test_TreeNode)), nodeType);
+        auto * garbage = (Test_TreeNode*)domain->GetChunk(sizeof(Test_TreeNode));
+        Obj::Init(garbage, nodeType);
+        garbage->left  = node;
+        garbage->right = nullptr;
+    }
+    for (uint i = 0; 2 * i + 1 < numOfNodes; i++) {
+        nodes[i]->left = nodes[2 * i + 1];
+        if (2 * i + 2 < numOfNodes)
+            nodes[i]->right = nodes[2 * i + 2];
+    }
+    nodes[0]->AddOwner();
+
+    uint savedNumOfGcThreads = Heap::numOfGcThreads;
+    Heap::numOfGcThreads = 4;
+    domain->Gc();
+    Heap::numOfGcThreads = savedNumOfGcThreads;
+
+    assert(domain->lastMarked == numOfNodes);
+    assert(domain->NumOfObj() == numOfNodes);
+    for (auto * node : nodes) {
+        assert(node->type == nodeType);
+        assert(!node->GetFlag_IsMarked());
+    }
+}
+
+void Test_ReleaseIdlePages() {
+    // A thread caches pages and goes idle, another thread releases them.
+    auto savedReleaseAfter     = MemBank::releaseAfter;
+    uint savedMinRetainedPages = MemBank::minRetainedPages;
+    MemBank::releaseAfter     = std::chrono::seconds{0};
+    MemBank::minRetainedPages = 0;
+
+    std::mutex mutex;
+    std::condition_variable stageChanged;
+    int stage = 0;
+    std::size_t numOfCached = 0;
+    std::thread worker([&]() {
+        std::vector<std::byte*> pages;
+        for (uint i = 0; i < 100; i++)
+            pages.push_back(MemBank::GetPage());
+        for (auto * page : pages)
+            MemBank::AcceptPage(page);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        numOfCached = MemBank::localPages.pages.size();
+        stage = 1;
+        stageChanged.notify_one();
+        stageChanged.wait(lock, [&]() { return stage == 2; });
+        assert(MemBank::localPages.pages.empty());
+    });
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        stageChanged.wait(lock, [&]() { return stage == 1; });
+    }
+    assert(numOfCached > 0);
+    std::uint64_t releasedBytes = MemBank::releasedBytes;
+    MemBank::ReleaseIdlePages();
+#ifdef VIRGO_USE_MMAP
+    assert(MemBank::releasedBytes - releasedBytes >= numOfCached * PAGE_SIZE);
+#endif
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stage = 2;
+    }
+    stageChanged.notify_one();
+    worker.join();
+
+    MemBank::releaseAfter     = savedReleaseAfter;
+    MemBank::minRetainedPages = savedMinRetainedPages;
+}
+
+const std::size_t TEST_EXTERNAL_BYTES = 16;
+
+static void Test_External_Delete(Obj * self) {
+    Heap::RemoveExternalMemory(self, TEST_EXTERNAL_BYTES);
+}
+
+void Test_ExternalMemory() {
+    // Dead objects return their external memory when gc threads
+    // sweep them in parallel, none of it may be lost.
+    auto * externalType = new Type("external");
+    externalType->methodTable->Delete = &Test_External_Delete;
+    MemBudget testBudget;
+    auto * domain = new MemDomain();
+    domain->limitNumOfPages = UINT32_MAX;
+    domain->budget = &testBudget;
+    const uint numOfObj = 100'000;
+
+    for (uint i = 0; i < numOfObj; i++) {
+        auto * obj = (Obj*)domain->GetChunk(32);
+        Obj::Init(obj, externalType);
+        Heap::AddExternalMemory(obj, TEST_EXTERNAL_BYTES);
+    }
+    assert(domain->externalBytes == numOfObj * TEST_EXTERNAL_BYTES);
+
+    uint savedNumOfGcThreads = Heap::numOfGcThreads;
+    Heap::numOfGcThreads = 4;
+    domain->Gc();
+    Heap::numOfGcThreads = savedNumOfGcThreads;
+    assert(domain->lastDeleted == numOfObj);
+    assert(domain->externalBytes == 0);
+    assert(testBudget.usedBytes == (std::size_t)domain->NumOfPages() * PAGE_SIZE);
+
+    // External memory is limited by the budget as pages are.
+    auto * obj = (Obj*)domain->GetChunk(32);
+    Obj::Init(obj, externalType);
+    testBudget.limitBytes = testBudget.usedBytes + TEST_EXTERNAL_BYTES - 1;
+    bool isThrown = false;
+    try {
+        Heap::AddExternalMemory(obj, TEST_EXTERNAL_BYTES);
+    } catch (OutOfMemoryError &) {
+        isThrown = true;
+    }
+    assert(isThrown);
+    assert(domain->externalBytes == 0);
+    testBudget.limitBytes = 0;
+    Heap::AddExternalMemory(obj, TEST_EXTERNAL_BYTES);
+}
+
 void Test_Mem() {
     Test_Page();
+    Test_ExternalMemory();
+    Test_ReleaseIdlePages();
+    Test_LazySweep();
+    Test_IncrementalMarking();
+    Test_ParallelMark();
+    Test_Compact();
+}
+
+void Bench_GcPause() {
+    // Fills a large domain with objects, keeps every tenth of them alive,
+    // then measures the gc pause and the time of allocations after it.
+    using Clock = std::chrono::steady_clock;
+    const uint numOfObj = 4'000'000;
+    const uint chunkSize = 32;
+
+    auto * benchType = new Type("bench");
+    auto * domain = new MemDomain();
+    domain->limitNumOfPages = UINT32_MAX;
+
+    for (uint i = 0; i < numOfObj; i++) {
+        auto * obj = new (domain->GetChunk(chunkSize)) Obj(benchType);
+        if (i % 10 == 0)
+            obj->AddOwner();
+    }
+    domain->PrintStatus("before gc");
+
+    auto t0 = Clock::now();
+    domain->Gc();
+    auto t1 = Clock::now();
+
+    for (uint i = 0; i < numOfObj / 2; i++)
+        new (domain->GetChunk(chunkSize)) Obj(benchType);
+    auto t2 = Clock::now();
+
+    domain->FinishSweep();
+    domain->PrintStatus("after gc");
+
+    auto pause = std::chrono::duration_cast<std::chrono::microseconds>(t1 - t0).count();
+    auto alloc = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count();
+    std::cout << "\nGc pause benchmark:\n"
+              << "objects     : " << Utils::NumSep(numOfObj) << '\n'
+              << "gc pause    : " << Utils::NumSep(pause) << " us\n"
+              << "allocations : " << Utils::NumSep(numOfObj / 2) << " in "
+              << Utils::NumSep(alloc) << " us\n";
+}
+
+void Bench_ParallelGc() {
+    // Measures full gc (marking and sweeping of all pages)
+    // of the same heap with different number of gc threads.
+    using Clock = std::chrono::steady_clock;
+    const uint numOfObj = 4'000'000;
+    const uint chunkSize = 32;
+    const uint savedNumOfGcThreads = Heap::numOfGcThreads;
+
+    auto * benchType = new Type("bench");
+    auto * domain = new MemDomain();
+    domain->limitNumOfPages = UINT32_MAX;
+
+    std::cout << "\nParallel gc benchmark (" << Utils::NumSep(numOfObj) << " objects):\n";
+    uint maxNumOfThreads = std::max(1u, std::thread::hardware_concurrency());
+    for (uint n = 1; n <= maxNumOfThreads; n *= 2) {
+        for (uint i = domain->NumOfObj(); i < numOfObj; i++) {
+            auto * obj = new (domain->GetChunk(chunkSize)) Obj(benchType);
+            if (i % 10 == 0)
+                obj->AddOwner();
+        }
+
+        Heap::numOfGcThreads = n;
+        auto t0 = Clock::now();
+        domain->Gc();
+        domain->FinishSweep();
+        auto t1 = Clock::now();
+
+        auto time = std::chrono::duration_cast<std::chrono::microseconds>(t1 - t0).count();
+        std::cout << "threads : " << std::setw(4) << n
+                  << ", gc : " << Utils::NumSep(time) << " us\n";
+    }
+    Heap::numOfGcThreads = savedNumOfGcThreads;
 }
@@ -4,29 +4,127 @@
 #include <cassert>
 #include <cstring>
 #include <array>
+#include <atomic>
 #include <vector>
 #include <list>
 #include <stack>
+#include <deque>
 #include <bitset>
+#include <chrono>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
 #include "Common.h"
+#include "GcTelemetry.h"
+#include "GcPolicy.h"
 
 extern const uint          PAGE_SIZE;
 extern const std::uint64_t PAGE_MASK;
 extern const uint          ALIGNMENT;
+extern const uint          MAX_CHUNK_SIZE;
+
+constexpr uint NUM_OF_SIZE_CLASSES = 24;
 
 struct MemBank {
+    using Clock = std::chrono::steady_clock;
+
+    struct FreePage {
+        std::byte *       page;
+        Clock::time_point freeSince;
+    };
+
     static std::vector<std::byte*> blocks;
-    static std::stack<std::byte*>  freePages;
+    static std::deque<FreePage>    freePages;        // Committed pages, the most recently freed are at the back.
+    static std::stack<std::byte*>  uncommittedPages; // Never used or released to the OS.
+
+    // Retention policy. Free pages that stay idle longer than releaseAfter
+    // are released to the OS, except the minRetainedPages most recent ones.
+    static uint                 minRetainedPages;
+    static std::chrono::seconds releaseAfter;
+    static bool                 useHugePages; // MADV_HUGEPAGE for blocks.
+    static bool                 useMadvFree;  // MADV_FREE instead of MADV_DONTNEED.
+
+    static std::uint64_t reservedBytes;
+    static std::uint64_t committedBytes;
+    static std::uint64_t releasedBytes;  // Total over all time.
+
+    // Bank is shared by all threads and guarded by the mutex.
+    // Each thread keeps its own cache of pages, so the mutex
+    // is locked only once per PAGE_BATCH_SIZE pages.
+    static std::mutex mutex;
+    static Clock::time_point lastRelease;
+
+    // Cache is locked by its thread and by ReleaseIdlePages of other
+    // threads, which flushes caches that are idle for releaseAfter.
+    struct LocalPages {
+        std::mutex              mutex;
+        std::vector<std::byte*> pages;
+        Clock::time_point       lastUse;
+        LocalPages();
+        ~LocalPages();
+    };
+    static thread_local LocalPages   localPages;
+    static std::vector<LocalPages*>  allLocalPages; // Guarded by the mutex.
 
     static void AllocateBlock();
     static std::byte * GetPage();
     static void AcceptPage(std::byte * page);
+    static void TakePages_Batch(std::vector<std::byte*> & pages, uint numOfPages);
+    static void ReturnPages_Batch(std::vector<std::byte*> & pages, uint numOfPages);
+    // Called after gc, and by the bank itself once in releaseAfter
+    // when pages are taken or returned, so memory of idle threads
+    // goes back to the OS while other threads work.
+    static void ReleaseIdlePages();
+    static void ReleaseIdlePages_Locked(Clock::time_point now);
+    static std::byte * GetSpan(uint numOfPages);
+    static void FreeSpan(std::byte * span, uint numOfPages);
     static void PrintStatus();
 };
 
 ///////////////////////////////////////////////////////////////////////////////
 
+// Thrown when memory can't be allocated even after a full gc,
+// VM::Execute turns it into a script error.
+struct OutOfMemoryError : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+// Memory cap shared by all domains of a thread heap (one VM).
+// Pages are counted when a domain takes or returns them, external
+// memory when objects report it. External memory is also returned
+// by gc threads that sweep in parallel, so the counter is atomic.
+struct MemBudget {
+    std::size_t              limitBytes{}; // 0 means no limit.
+    std::atomic<std::size_t> usedBytes{};
+
+    inline bool TakeBytes(std::size_t size) {
+        std::size_t used = usedBytes.load(std::memory_order_relaxed);
+        do {
+            if (limitBytes != 0 && used + size > limitBytes)
+                return false;
+        } while (!usedBytes.compare_exchange_weak(used, used + size, std::memory_order_relaxed));
+        return true;
+    }
+
+    inline void ReturnBytes(std::size_t size) {
+        usedBytes.fetch_sub(size, std::memory_order_relaxed);
+    }
+
+    inline bool Take(uint numOfPages) {
+        return TakeBytes((std::size_t)numOfPages * PAGE_SIZE);
+    }
+
+    inline void Return(uint numOfPages) {
+        ReturnBytes((std::size_t)numOfPages * PAGE_SIZE);
+    }
+
+    inline bool IsExhausted() {
+        return limitBytes != 0 && usedBytes.load(std::memory_order_relaxed) + PAGE_SIZE > limitBytes;
+    }
+};
+
 struct MemDomain;
+struct Obj;
 
 struct Page {
     MemDomain * domain;
@@ -48,7 +146,9 @@ struct Page {
     inline bool HasFreeChunk() { return nextFreeChunk != nullptr; }
     bool IsEmpty();
     void Mark();
-    void Sweep();
+    void Sweep(uint & numOfMarked, uint & numOfDeleted);
+    void DeleteAll();
+    void GetObjects(std::vector<Obj*> & objects);
 };
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -59,45 +159,101 @@ struct PageCluster {
     Page *             activePage{};
     std::vector<Page*> availablePages{};   // This pages have free chunks.
     std::vector<Page*> unavailablePages{}; // This pages don't have free chunks.
+    std::vector<Page*> unsweptPages{};     // This pages are marked, but not swept yet.
 
-    void Init();
     std::byte * GetChunk();
     uint NumOfPages();
     uint Capacity();
     uint NumOfObj();
-    void QueryPage();
+    bool QueryPage();
     void UpdateActivePage();
-    void Mark();
-    void Sweep();
-    void ReleaseEmptyPages_InVector(std::vector<Page*> & pages);
-    void ReleaseEmptyPages();
+    void AddPagesToMarkQueue(std::vector<Page*> & markQueue);
+    void PrepareLazySweep();
+    bool SweepNextPage();
+    void FinishSweep();
+    void ReleasePage(Page * page);
+    bool PromotePage(Page * page); // From baby domain to the active one.
+    uint ReleaseEmptyPages_InVector(std::vector<Page*> & pages);
+    uint ReleaseEmptyPages();
     void AfterGc();
+    void Evacuate(std::unordered_map<Obj*, Obj*> & forwarding,
+                  std::vector<Page*> & evacuatedPages);
 };
 
 ///////////////////////////////////////////////////////////////////////////////
 
 struct MemDomain {
-    uint   limitNumOfPages = 1024;
+    using Clock = std::chrono::steady_clock;
+
+    uint   limitNumOfPages = 1024; // Heap domains are sized by Heap::gcPolicy.
     uint   totalNumOfPages{};
+    MemBudget * budget{}; // Of the thread heap, null for other domains.
+
+    // Memory outside of the heap that belongs to objects of the domain
+    // (malloc'ed buffers). Its growth triggers gc the same way as pages.
+    // Atomic, because objects that are swept in parallel return it.
+    std::atomic<std::size_t> externalBytes{};
+    std::size_t externalGcTrigger{};
 
     uint   lastMarked{};
     uint   lastDeleted{};
     double shrinkFactor{}; // [0..1]
+    bool   isSweepPending{};
+
+    // Shrink factor of the last cycle which pages are all swept,
+    // lazy sweeping makes shrinkFactor partial until then.
+    double sweptShrinkFactor{};
+    uint   lastMoved{}; // By the last compaction.
+
+    // Incremental marking. Pages which roots are not marked yet.
+    // Each marking step marks at most markStepBudget pages.
+    std::vector<Page*> markQueue{};
+    uint               markStepBudget = 16;
+
+    // Marked objects which references are not scanned yet.
+    std::vector<Obj*>  markStack{};
+
+    // Pauses in microseconds (full gc or one marking step).
+    std::uint64_t maxPause{};
+    std::uint64_t totalPause{};
+    uint          numOfPauses{};
+
+    // Telemetry. The cycle is composed while telemetry is enabled
+    // and reported when its sweeping is finished.
+    uint          id{};
+    std::uint64_t allocatedBytes{}; // Since the start of the last cycle.
+    std::uint64_t lastCycleStart{};
+    GcEvent       cycle{};
+    bool          isCyclePending{};
+
+    // Gc policy input.
+    std::uint64_t     cyclePause{};         // Pauses of the last cycle.
+    std::uint64_t     lastAllocatedBytes{}; // Between the last two cycles.
+    Clock::time_point lastGcEnd{};
 
     enum
     {
         Flag_IsAvailable,
         Flag_IsConstantDomain,
         Flag_IsBabyDomain,
+        Flag_IsMarking,
+        Flag_IsFrozen,
     };
     std::bitset<32> flags{};
 
-    // Each cluster contains pages that contain chunks of the same size:
-    // chunkSize = (index + 3) * ALIGNMENT
-    // i.e. 24, 32, ..., 64
-    std::array<PageCluster, 6> clusters{};
+    // Pages of a domain loaded from an image are one mapping.
+    std::byte * imageBase{};
+    std::size_t imageSize{};
+
+    // Each cluster contains pages that contain chunks of the same size,
+    // see SIZE_CLASSES: 24, 32, ..., 64, 80, 96, ..., 2032.
+    std::array<PageCluster, NUM_OF_SIZE_CLASSES> clusters{};
+
+    // Objects bigger than MAX_CHUNK_SIZE, one per span.
+    std::vector<Page*> largeSpans{};
 
     explicit MemDomain();
+    ~MemDomain();
 
     /////////////////////////////////////////////
 
@@ -110,33 +266,103 @@ struct MemDomain {
     inline bool GetFlag_IsBabyDomain() { return flags[Flag_IsBabyDomain]; }
     inline void SetFlag_IsBabyDomain(bool value) { flags[Flag_IsBabyDomain] = value; }
 
+    inline bool GetFlag_IsMarking() { return flags[Flag_IsMarking]; }
+    inline void SetFlag_IsMarking(bool value) { flags[Flag_IsMarking] = value; }
+
+    inline bool GetFlag_IsFrozen() { return flags[Flag_IsFrozen]; }
+    inline void SetFlag_IsFrozen(bool value) { flags[Flag_IsFrozen] = value; }
+
     /////////////////////////////////////////////
 
     uint NumOfPages();
+    bool TakePages(uint numOfPages);
+    void ReturnPages(uint numOfPages);
+    inline bool IsExternalGcTriggered() { return externalBytes >= externalGcTrigger; }
+    void UpdateExternalGcTrigger();
+    uint NumOfUnsweptPages();
     uint Capacity();
     uint NumOfObj();
+    void UpdateShrinkFactor();
     void Gc();
+    void FinishSweep();
+    uint ReleaseEmptyPages(); // Returns the number of released pages.
+    void ParallelMark();
+    void ParallelSweep();
+    bool NeedsIncrementalMarking();
+    bool NeedsCompaction();
+    void StartMarking();
+    void MarkRoots();
+    void MarkObj(Obj * obj);
+    void DrainMarkStack();
+    void MarkStep();
+    void EndMarking();
+    void OnSweepFinished();
+    void RecordPause(std::uint64_t pause);
 
     /////////////////////////////////////////////
 
     [[nodiscard]]
     std::byte * GetChunk(uint chunkSize);
 
+    [[nodiscard]]
+    std::byte * GetChunk_Large(uint chunkSize);
+
+    void SweepLargeSpans();
+    void GetObjects(std::vector<Obj*> & objects);
+
     void PrintStatus(const std::string & additionalMessage = "");
+
+    /////////////////////////////////////////////
+
+    // Frozen domain is read-only, its pages are protected from writing,
+    // so processes forked after freezing share them.
+    void Freeze();
+    void GetPageRuns(std::vector<std::pair<Page*, uint>> & runs);
+
+    // Position independent image of the domain. Roots are objects
+    // the loader needs to find (constants), those outside of the domain
+    // are loaded as nulls.
+    bool WriteImage(const std::string & path, const std::vector<Obj*> & roots);
+    static MemDomain * LoadImage(const std::string & path, std::vector<Obj*> & roots);
 };
 
 ///////////////////////////////////////////////////////////////////////////////
 
+// Constant domain is shared by all threads, the rest of the heap
+// belongs to a thread, so allocation doesn't need any synchronization.
+// Each thread that allocates objects must call Heap::InitThread.
 struct Heap {
     static MemDomain * constantDomain;
-    static MemDomain * babyDomain;
-    static uint        activeDomainIndex;
-    static MemDomain * activeDomain;
-    static std::vector<MemDomain*> domains;
+    static thread_local MemDomain * babyDomain;
+    static thread_local uint        activeDomainIndex;
+    static thread_local MemDomain * activeDomain;
+    static thread_local std::vector<MemDomain*> domains;
     static void (*PreDomainGc)(MemDomain * domain);
     static void (*PreGlobalGc)();
+    static thread_local uint        numOfMarkingDomains;
+    static thread_local std::size_t bytesToMarkStep; // See GetChunk_Baby.
+    // Appends slots outside of the heap (interpreter stacks, variables)
+    // that refer to heap objects. They are roots of marking, and they are
+    // updated when compaction moves objects. Slots that can't be written
+    // in place (map keys) are fixed by RootsMoved.
+    static void (*GetRootSlots)(std::vector<Obj**> & slots);
+    static void (*RootsMoved)(const std::unordered_map<Obj*, Obj*> & forwarding);
+    static thread_local std::vector<MemDomain*> pendingCompactions;
+    static uint        numOfGcThreads; // Parallel gc is used if it's more than 1.
+    static GcPolicy *  gcPolicy;
+    static thread_local MemBudget budget;
 
     static void Init();
+    static void InitThread();
+    static void FreeThread(); // Called when the thread exits.
+    static uint NumOfPages();
+    static MemDomain * NewDomain();
+
+    // Objects that own memory outside of the heap report it here,
+    // Delete method of their type reports it back when it's freed.
+    // Throws OutOfMemoryError if the memory is over the budget of the heap.
+    static void AddExternalMemory(Obj * owner, std::size_t bytes);
+    static void RemoveExternalMemory(Obj * owner, std::size_t bytes);
 
     static std::byte * GetChunk_Constant(uint chunkSize);
     static std::byte * GetChunk_Baby(uint chunkSize);
@@ -147,10 +373,41 @@ struct Heap {
     static void DomainGc(MemDomain * domain);
     static void GlobalGc();
     static void UpdateActiveDomain_AfterGlobalGc();
+    static void MarkIncrementally(MemDomain * domain);
+    static void Compact(MemDomain * domain);
+
+    // Appends root slots and slots of the objects of the heap of this
+    // thread and of 'domain', wherever a moved object may be referred from.
+    static void GetSlots(std::vector<Obj**> & slots, MemDomain * domain = nullptr);
+
+    // Compaction moves objects, so it's only requested by gc and done
+    // at a safe point: between instructions, where all values of the
+    // interpreter are in root slots, not in locals of native code.
+    static void RequestCompaction(MemDomain * domain);
+    static void CompactPending();
+    static inline void SafePoint() {
+        if (!pendingCompactions.empty())
+            CompactPending();
+    }
+
+    // Must be called when a reference to the object is stored
+    // somewhere (variable, list element, object field).
+    // While a domain is marking, the stored object is marked,
+    // otherwise it can be lost if it was moved from an unmarked
+    // place to an already marked one.
+    static inline void WriteBarrier(Obj * value) {
+        if (numOfMarkingDomains > 0)
+            WriteBarrier_Marking(value);
+    }
+    static void WriteBarrier_Marking(Obj * value);
 };
 
 ///////////////////////////////////////////////////////////////////////////////
 
 void Test_Mem();
 
+void Bench_GcPause();
+
+void Bench_ParallelGc();
+
 #endif //VIRGO_MEM_H
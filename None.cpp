@@ -1,5 +1,6 @@
 #include "None.h"
 #include "Type.h"
+#include "Mem.h"
 
 Type * None::t;
 
@@ -1,26 +1,79 @@
+#include <atomic>
 #include "Obj.h"
 #include "Type.h"
+#include "Mem.h"
+#include "AllocProfiler.h"
 
 Obj::Obj(Type * type): type{type} {}
 
+void Obj::Init(void * inPlace, Type * type) {
+    auto * obj = new (inPlace) Obj(type);
+    Page * page = Page::GetPage(inPlace);
+
+    // Objects created while their domain is marking are born marked,
+    // otherwise marking may never reach them.
+    if (page->domain->GetFlag_IsMarking())
+        obj->SetFlag_IsMarked(true);
+
+    if (AllocProfiler::enabled)
+        AllocProfiler::OnAlloc(type, page->chunkSize);
+}
+
 bool Obj::Is(Type * ofType) {
     return type == ofType;
 }
 
 bool Obj::GetFlag_IsMarked() {
-    return flags[ObjFlags::IsMarked];
+    return (flags & (1u << ObjFlags::IsMarked)) != 0;
 }
 
 void Obj::SetFlag_IsMarked(bool value) {
-    flags[ObjFlags::IsMarked] = value;
+    if (value)
+        flags |= (1u << ObjFlags::IsMarked);
+    else
+        flags &= ~(1u << ObjFlags::IsMarked);
+}
+
+bool Obj::TryMark() {
+    const std::uint32_t mark = 1u << ObjFlags::IsMarked;
+    std::atomic_ref<std::uint32_t> atomicFlags(flags);
+    if ((atomicFlags.load(std::memory_order_relaxed) & mark) != 0)
+        return false;
+    return (atomicFlags.fetch_or(mark, std::memory_order_relaxed) & mark) == 0;
 }
 
 bool Obj::GetFlag_IsConstant() {
-    return flags[ObjFlags::IsConstant];
+    return (flags & (1u << ObjFlags::IsConstant)) != 0;
 }
 
 void Obj::SetFlag_IsConstant(bool value) {
-    flags[ObjFlags::IsConstant] = value;
+    if (value)
+        flags |= (1u << ObjFlags::IsConstant);
+    else
+        flags &= ~(1u << ObjFlags::IsConstant);
+}
+
+bool Obj::GetFlag_IsPinned() {
+    return (flags & (1u << ObjFlags::IsPinned)) != 0;
+}
+
+void Obj::SetFlag_IsPinned(bool value) {
+    if (value)
+        flags |= (1u << ObjFlags::IsPinned);
+    else
+        flags &= ~(1u << ObjFlags::IsPinned);
+}
+
+void Obj::AddOwner() {
+    // Owned objects are greyed when their page is marked, an object
+    // that gets its first owner after that is greyed by the barrier.
+    if (numOfOwners++ == 0)
+        Heap::WriteBarrier(this);
+}
+
+void Obj::RemoveOwner() {
+    assert(numOfOwners > 0);
+    numOfOwners--;
 }
 
 void Obj::Delete() {
@@ -4,7 +4,8 @@
 #include <cassert>
 #include <string>
 #include <memory>
-#include <bitset>
+#include <cstdint>
+#include "Common.h"
 
 struct Type;
 
@@ -12,24 +13,45 @@ enum ObjFlags
 {
     IsMarked,
     IsConstant,
+    IsPinned,
 };
 
 // We do inherit all types from this object.
 struct Obj {
-    std::bitset<64> flags{};
+    std::uint32_t flags{};
+
+    // Number of owners outside of the heap (host code, handles).
+    // Objects that have owners are roots of gc and are never moved.
+    uint numOfOwners{};
+
     Type * type{};
 
     explicit Obj(Type * type_);
 
+    // Constructs object header in a chunk taken from the heap.
+    static void Init(void * inPlace, Type * type);
+
     Type * GetType();
     bool Is(Type * ofType);
 
     bool GetFlag_IsMarked();
     void SetFlag_IsMarked(bool value);
+    // Sets the mark flag atomically, several gc threads may try to mark
+    // the same object. Returns false if it was already marked.
+    bool TryMark();
 
     bool GetFlag_IsConstant();
     void SetFlag_IsConstant(bool value);
 
+    // Pinned objects are never moved by compaction.
+    bool GetFlag_IsPinned();
+    void SetFlag_IsPinned(bool value);
+
+    // Host code that keeps the object outside of the heap owns it,
+    // so gc keeps the object alive and doesn't move it.
+    void AddOwner();
+    void RemoveOwner();
+
     void Delete();
 };
 
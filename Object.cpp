@@ -16,6 +16,7 @@ Ref Object_SetField(Ref selfRef, Ref fieldName, Ref val) {
     auto * selfObj = GET_OBJ(selfRef);
     assert(selfObj->Is(Object::t));
     auto * self = (Object*)selfObj;
+    Heap::WriteBarrier(GET_OBJ(val));
     self->fields[fieldName] = val;
     return Ref::none;
 }
@@ -2,25 +2,62 @@
 
 #include <utility>
 
-Script * Parser::Parse(std::vector<Token*> tokens_) {
-    tokens = std::move(tokens_);
-    auto * exprScript = new ExprScript();
-    while (CurrentToken()->type != TokenType::EndOfFile) {
-        Expr * expr = Parse_Expr();
-        assert(expr != nullptr);
-        exprScript->AddExpr(expr);
+Script * Parser::Parse(TokenStream tokens) {
+    stream = std::move(tokens);
+    currentPosition = 0;
+
+    auto * exprArena = new ExprArena();
+    ExprArena * savedArena = ExprArena::current;
+    ExprArena::current = exprArena;
+    ConstantPool * savedPool = ConstantPool::current;
+    ConstantPool::current = stream.constantPool.get();
+
+    ExprScript * exprScript = nullptr;
+    try {
+        exprScript = new ExprScript();
+        while (CurrentToken()->type != TokenType::EndOfFile) {
+            Expr * expr = Parse_Expr();
+            assert(expr != nullptr);
+            exprScript->AddExpr(expr);
+        }
+    } catch (const SyntaxError &) {
+        ExprArena::current = savedArena;
+        ConstantPool::current = savedPool;
+        delete exprArena;
+        throw;
     }
+    ExprArena::current = savedArena;
+    ConstantPool::current = savedPool;
+
     auto * script = new Script();
-    script->SetExprScript(exprScript);
+    script->SetExprScript(exprScript, exprArena);
+    script->SetConstantPool(std::move(stream.constantPool));
     return script;
 }
 
+void Parser::ParseStatements(std::vector<Token> & tokens, std::vector<Expr*> & exprs) {
+    // Tokens are borrowed, so the tokenizer keeps reusing their memory.
+    stream.tokens.swap(tokens);
+    currentPosition = 0;
+    try {
+        while (CurrentToken()->type != TokenType::EndOfFile) {
+            Expr * expr = Parse_Expr();
+            assert(expr != nullptr);
+            exprs.push_back(expr);
+        }
+    } catch (const SyntaxError &) {
+        stream.tokens.swap(tokens);
+        throw;
+    }
+    stream.tokens.swap(tokens);
+}
+
 Token * Parser::CurrentToken() {
-    return tokens.at(currentPosition);
+    return &stream.tokens.at(currentPosition);
 }
 
 int Parser::CurrentLine() {
-    return tokens.at(currentPosition)->line;
+    return stream.tokens.at(currentPosition).line;
 }
 
 bool Parser::Match(TokenType tokenType) {
@@ -142,18 +179,18 @@ bool Parser::Is_For_CStyled() {
         ^--- we are here, at possible left parenthesis
 */
     int pos = currentPosition;
-    if (tokens.at(pos)->type != TokenType::L_Parenthesis)
+    if (stream.tokens.at(pos).type != TokenType::L_Parenthesis)
         return false;
     pos++;
 
     int numOfOpened = 1;
     int numOfSemicolons = 0;
-    while (tokens.at(pos)->type != TokenType::EndOfFile && numOfOpened > 0) {
-        if (tokens.at(pos)->type == TokenType::Semicolon)
+    while (stream.tokens.at(pos).type != TokenType::EndOfFile && numOfOpened > 0) {
+        if (stream.tokens.at(pos).type == TokenType::Semicolon)
             numOfSemicolons++;
-        else if (tokens.at(pos)->type == TokenType::L_Parenthesis)
+        else if (stream.tokens.at(pos).type == TokenType::L_Parenthesis)
             numOfOpened++;
-        else if (tokens.at(pos)->type == TokenType::R_Parenthesis)
+        else if (stream.tokens.at(pos).type == TokenType::R_Parenthesis)
             numOfOpened--;
         pos++;
     }
@@ -222,8 +259,8 @@ Expr * Parser::Parse_Skip() {
 }
 
 bool Parser::IsLabel() {
-    return (tokens.at(currentPosition)->type     == TokenType::Identifier &&
-            tokens.at(currentPosition + 1)->type == TokenType::Colon);
+    return (stream.tokens.at(currentPosition).type     == TokenType::Identifier &&
+            stream.tokens.at(currentPosition + 1).type == TokenType::Colon);
 }
 
 Expr * Parser::Parse_Label() {
@@ -234,7 +271,7 @@ Expr * Parser::Parse_Label() {
     int savedLine = CurrentLine();
     auto * idToken = CurrentToken();
     assert(idToken->type == TokenType::Identifier);
-    std::string labelName = idToken->lexeme;
+    std::string labelName(idToken->lexeme);
     currentPosition++;
     assert(Match(TokenType::Colon));
     return new ExprLabel(labelName, savedLine);
@@ -257,7 +294,7 @@ Expr * Parser::Parse_Jump() {
     if (idToken->type != TokenType::Identifier)
         ReportError(errMsg, savedLine);
 
-    std::string labelName = idToken->lexeme;
+    std::string labelName(idToken->lexeme);
     currentPosition++;
 
     if (!Match(TokenType::R_Parenthesis))
@@ -350,7 +387,10 @@ Expr * Parser::Parse_Assignment() {
             return new ExprPowerAssign(a, b, savedLine);
 
         default:
-            return a; // Declaration or function call
+            // Declaration or function call
+            if (a->exprType == ExprType::CallBuiltin)
+                ((ExprCallBuiltin*)a)->isStatement = true;
+            return a;
     }
 }
 
@@ -589,9 +629,21 @@ Expr * Parser::Parse_Accessor() {
     if (tok->type != TokenType::Identifier)
         ReportError("Undefined accessor term.", CurrentLine());
 
-    Expr * a = new ExprDot(tok->constantId, CurrentLine());
+    uint line = CurrentLine();
     currentPosition++;
 
+    // Only builtins can be called so far, they have no arguments.
+    if (Match(TokenType::L_Parenthesis)) {
+        int builtinId = VM::FindBuiltin(tok->lexeme);
+        if (builtinId == -1)
+            ReportError("Unknown function '" + std::string(tok->lexeme) + "'.", line);
+        if (!Match(TokenType::R_Parenthesis))
+            ReportError("Builtins take no arguments.", line);
+        return new ExprCallBuiltin(builtinId, line);
+    }
+
+    Expr * a = new ExprDot(tok->constantId, line);
+
 //    t = CurrentToken();
 //    while (true)
 //    {
@@ -632,6 +684,5 @@ Expr * Parser::Parse_Accessor() {
 }
 
 void Parser::ReportError(const std::string & errorMessage, uint line) {
-    std::cerr << "Syntax error. Line " << line << ". " << errorMessage << std::endl;
-    exit(1);
+    throw SyntaxError(errorMessage, line);
 }
@@ -6,7 +6,7 @@
 
 class Parser {
     int                 currentPosition{};
-    std::vector<Token*> tokens;
+    TokenStream         stream;
 
     Token * CurrentToken();
     int     CurrentLine();
@@ -31,10 +31,15 @@ class Parser {
     Expr *  Parse_Power();
     Expr *  Parse_Term();
     Expr *  Parse_Accessor();
-    static void ReportError(const std::string & errorMessage, uint line);
+    static void ReportError(const std::string & errorMessage, uint line); // Throws SyntaxError.
 
 public:
-    Script * Parse(std::vector<Token*> tokens_);
+    // Throws SyntaxError, Script::Compile too.
+    Script * Parse(TokenStream tokens);
+
+    // Streaming mode, see Tokenizer::TokenizeStatement. Statements of
+    // the tokens are created in the current arena and added to 'exprs'.
+    void ParseStatements(std::vector<Token> & tokens, std::vector<Expr*> & exprs);
 };
 
 #endif //VIRGO_PARSER_H
@@ -28,7 +28,7 @@ void Parser::Interpret(const std::string & source) {
         return;
     }
 
-    tokens = tokenizer.GetTokens();
+    stream = tokenizer.TakeTokens();
     Ref scriptRef = NEW_PRESERVED_REF(new Script());
     PushDef(scriptRef);
     auto * script = (Script*)GET_OBJ(scriptRef);
@@ -63,11 +63,11 @@ void Parser::PopDef() {
 }
 
 Token* Parser::CurrentToken() {
-    return tokens.at(currentPosition);
+    return &stream.tokens.at(currentPosition);
 }
 
 int Parser::CurrentLine() {
-    return tokens.at(currentPosition)->line;
+    return stream.tokens.at(currentPosition).line;
 }
 
 bool Parser::Match(TokenType tokenType) {
@@ -243,10 +243,10 @@ bool Parser::IsForIn() {
     // for x in list
     //     ^--- we are at x (identifier)
     int pos = currentPosition;
-    if (tokens.at(pos)->type != TokenType::Identifier)
+    if (stream.tokens.at(pos).type != TokenType::Identifier)
         return false;
     pos++;
-    return tokens.at(pos)->type == TokenType::In;
+    return stream.tokens.at(pos).type == TokenType::In;
 }
 
 Expr * Parser::Parse_ForIn() {
@@ -294,21 +294,21 @@ Expr * Parser::Parse_Assert() {
 
 bool Parser::IsFunDef() {
     int pos = currentPosition;
-    if (tokens.at(pos)->type != TokenType::Identifier)
+    if (stream.tokens.at(pos).type != TokenType::Identifier)
         return false;
     pos++;
-    if (tokens.at(pos)->type != TokenType::L_Parenthesis)
+    if (stream.tokens.at(pos).type != TokenType::L_Parenthesis)
         return false;
     pos++;
     int numOfOpened = 1;
-    while (tokens.at(pos)->type != TokenType::EndOfFile && numOfOpened > 0) {
-        if (tokens.at(pos)->type == TokenType::L_Parenthesis)
+    while (stream.tokens.at(pos).type != TokenType::EndOfFile && numOfOpened > 0) {
+        if (stream.tokens.at(pos).type == TokenType::L_Parenthesis)
             numOfOpened++;
-        else if (tokens.at(pos)->type == TokenType::R_Parenthesis)
+        else if (stream.tokens.at(pos).type == TokenType::R_Parenthesis)
             numOfOpened--;
         pos++;
     }
-    return tokens.at(pos)->type == TokenType::EnterScope;
+    return stream.tokens.at(pos).type == TokenType::EnterScope;
 }
 
 Expr * Parser::Parse_FunDef() {
@@ -383,15 +383,15 @@ Expr * Parser::Parse_FunDef() {
 
 bool Parser::IsClassDef() {
     int pos = currentPosition;
-    if (tokens.at(pos)->type != TokenType::Identifier)
+    if (stream.tokens.at(pos).type != TokenType::Identifier)
         return false;
     pos++;
     /*
-    if (tokens.at(pos)->type != TokenType::Class)
+    if (stream.tokens.at(pos).type != TokenType::Class)
         return false;
     pos++;
     */
-    return tokens.at(pos)->type == TokenType::EnterScope;
+    return stream.tokens.at(pos).type == TokenType::EnterScope;
 }
 
 Expr * Parser::Parse_ClassDef() {
@@ -522,8 +522,8 @@ Expr * Parser::Parse_Args() {
 
 Expr * Parser::Parse_ArgPair() {
     // Detect possible argument-value pair
-    if (tokens.at(currentPosition)->type == TokenType::Identifier &&
-        tokens.at(currentPosition + 1)->type == TokenType::Equal) {
+    if (stream.tokens.at(currentPosition).type == TokenType::Identifier &&
+        stream.tokens.at(currentPosition + 1).type == TokenType::Equal) {
         int savedLine = CurrentLine();
         Ref name = CurrentToken()->literal;
         currentPosition += 2;
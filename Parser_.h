@@ -6,7 +6,7 @@
 
 class Parser {
     int                 currentPosition {};
-    std::vector<Token*> tokens {};
+    TokenStream stream;
     std::vector<Ref>    defStack;
 
     void    PushDef(Ref obj);
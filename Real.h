@@ -2,6 +2,7 @@
 #define PROTON_REAL_H
 
 #include "Obj.h"
+#include "Common.h"
 
 struct Real {
     Obj obj;
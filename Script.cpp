@@ -1,24 +1,636 @@
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include "Script.h"
+#include "Tokenizer.h"
+#include "Parser.h"
 #include "VM.h"
+#include "Utils.h"
+#include "Context.h"
+#include "Str.h"
+#include "Int.h"
+#include "AllocProfiler.h"
+#include "HeapSnapshot.h"
 
 Script::Script() = default;
 
 Script::~Script() {
-    delete exprScript;
+    delete exprArena;
+    ConstantPool::Release(std::move(constantPool));
 }
 
-void Script::SetExprScript(ExprScript * exprScript_) {
+void Script::SetExprScript(ExprScript * exprScript_, ExprArena * exprArena_) {
     exprScript = exprScript_;
+    exprArena  = exprArena_;
+}
+
+void Script::SetConstantPool(std::unique_ptr<ConstantPool> constantPool_) {
+    constantPool    = std::move(constantPool_);
+    bc.constantPool = constantPool.get();
 }
 
 void Script::Compile() {
-    exprScript->Compile(bc);
+    assert(exprScript != nullptr);
+    ExprArena * savedArena = ExprArena::current;
+    ExprArena::current = exprArena;
+    ConstantPool * savedPool = ConstantPool::current;
+    ConstantPool::current = constantPool.get();
+    try {
+        exprScript->Compile(bc);
+    } catch (const SyntaxError &) {
+        ExprArena::current = savedArena;
+        ConstantPool::current = savedPool;
+        throw;
+    }
+    ExprArena::current = savedArena;
+    ConstantPool::current = savedPool;
+
+    delete exprArena;
+    exprArena  = nullptr;
+    exprScript = nullptr;
+}
+
+bool Script::Execute() {
+    return VM::Execute(bc);
 }
 
-void Script::Execute() {
-    VM::Execute(bc);
+bool Script::Execute(ExecStack & execStack) {
+    return VM::Execute(bc, execStack, 0);
+}
+
+bool Script::Stream(std::unique_ptr<Source> source, bool isExecuting) {
+    Tokenizer tokenizer;
+    tokenizer.BeginStream(std::move(source));
+    Parser parser;
+    ConstantPool * pool = tokenizer.GetConstantPool();
+    bc.constantPool = pool;
+
+    // The script node and its labels live until the end,
+    // statements only until they are compiled.
+    delete exprArena;
+    exprArena = new ExprArena();
+    ExprArena statementArena;
+    ExprArena * savedArena = ExprArena::current;
+    ExprArena::current = exprArena;
+    exprScript = new ExprScript();
+    exprScript->BeginCompile(bc);
+
+    ExecStack execStack;
+    uint runPos = 0;
+    bool isOk = true;
+    const uint MIN_COMPACTION_SIZE = 16384;
+    uint compactionSize = MIN_COMPACTION_SIZE;
+    std::vector<Expr*> exprs;
+    while (tokenizer.TokenizeStatement()) {
+        ExprArena::current = &statementArena;
+        ConstantPool * savedPool = ConstantPool::current;
+        ConstantPool::current = pool;
+        exprs.clear();
+        try {
+            parser.ParseStatements(tokenizer.GetStatementTokens(), exprs);
+            ExprArena::current = exprArena;
+            for (auto * expr : exprs)
+                exprScript->CompileExpr(expr, bc);
+        } catch (const SyntaxError & error) {
+            ConstantPool::current = savedPool;
+            std::cerr << error.what() << '\n';
+            isOk = false;
+            break;
+        }
+        ConstantPool::current = savedPool;
+        statementArena.Reset();
+
+        // Jumps to labels that are not compiled yet can't be run.
+        if (!isExecuting || exprScript->numOfUndefinedLabels > 0)
+            continue;
+        if (!VM::Execute(bc, execStack, runPos)) {
+            std::cerr << VM::current->error << '\n';
+            isOk = false;
+            break;
+        }
+        runPos = bc.pos;
+
+        // Without labels nothing can jump back to the code that has been run,
+        // so its constants are only needed if objects refer to them. They are
+        // freed when the pool doubles, it takes linear time in total.
+        if (exprScript->numOfDefinedLabels == 0) {
+            bc.Clear();
+            runPos = 0;
+            if (pool->Size() >= compactionSize) {
+                tokenizer.CompactConstants();
+                compactionSize = std::max(MIN_COMPACTION_SIZE, 2 * pool->Size());
+            }
+        }
+    }
+
+    if (tokenizer.HasError()) {
+        std::cerr << tokenizer.GetErrorMessage();
+        isOk = false;
+    }
+    if (isOk) {
+        try {
+            exprScript->EndCompile();
+        } catch (const SyntaxError & error) {
+            std::cerr << error.what() << '\n';
+            isOk = false;
+        }
+    }
+
+    ExprArena::current = savedArena;
+    delete exprArena;
+    exprArena  = nullptr;
+    exprScript = nullptr;
+    SetConstantPool(tokenizer.TakeTokens().constantPool);
+    return isOk;
+}
+
+std::vector<Script*> Script::CompileAll(std::vector<std::unique_ptr<Source>> sources, uint numOfThreads) {
+    VM & vm = *VM::current;
+    if (numOfThreads == 0)
+        numOfThreads = std::max(1u, std::thread::hardware_concurrency());
+
+    struct Unit {
+        std::unique_ptr<Source> source;
+        Script *                script{};
+        std::string             error;
+    };
+    std::vector<Unit> units(sources.size());
+    for (std::size_t i = 0; i < sources.size(); i++)
+        units[i].source = std::move(sources[i]);
+
+    // Threads take units one by one, so a thread that got small units
+    // just takes more of them. The calling thread compiles too.
+    std::atomic<std::size_t> cursor{0};
+    auto compile = [&]() {
+        for (;;) {
+            std::size_t i = cursor.fetch_add(1);
+            if (i >= units.size())
+                break;
+            Unit & unit = units[i];
+
+            Tokenizer tokenizer;
+            tokenizer.SetParentPool(&vm.constantPool);
+            tokenizer.Tokenize(std::move(unit.source));
+            if (tokenizer.HasError()) {
+                unit.error = tokenizer.GetErrorMessage();
+                continue;
+            }
+            // An error stops only the unit it's found in.
+            Parser parser;
+            try {
+                unit.script = parser.Parse(tokenizer.TakeTokens());
+                unit.script->Compile();
+            } catch (const SyntaxError & error) {
+                unit.error = std::string(error.what()) + '\n';
+                delete unit.script;
+                unit.script = nullptr;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (uint t = 1; t < numOfThreads && t < units.size(); t++)
+        threads.emplace_back(compile);
+    compile();
+    for (auto & thread : threads)
+        thread.join();
+
+    std::vector<Script*> scripts;
+    for (auto & unit : units) {
+        if (unit.script == nullptr)
+            std::cerr << unit.error;
+        scripts.push_back(unit.script);
+    }
+    return scripts;
 }
 
 void Script::PrintByteCode() {
+    ConstantPool * savedPool = ConstantPool::current;
+    ConstantPool::current = constantPool.get();
     bc.Print();
+    ConstantPool::current = savedPool;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Compacts the baby domain after each of its gcs.
+struct Test_CompactingGcPolicy : AdaptiveGcPolicy {
+    uint numOfMovedObj{};
+
+    void AfterGc(MemDomain * domain) override {
+        AdaptiveGcPolicy::AfterGc(domain);
+        if (domain != Heap::babyDomain)
+            return;
+        numOfMovedObj += domain->lastMoved;
+        domain->FinishSweep();
+        Heap::RequestCompaction(domain);
+    }
+};
+
+void Test_CompactWhileRunning() {
+    // Runs a script with a baby domain that is compacted after every gc,
+    // so values on the stack and in variables are moved many times.
+    Test_CompactingGcPolicy testPolicy;
+    GcPolicy * savedPolicy = Heap::gcPolicy;
+    Heap::gcPolicy = &testPolicy;
+
+    Tokenizer tokenizer;
+    tokenizer.Tokenize(std::string(
+        "a = \"a\" + \"1\"\n"
+        "b = \"b\" + \"2\"\n"
+        "c = \"c\" + \"3\"\n"
+        "for (i = 0; i < 100000; i += 1)\n"
+        "  garbage = a + \"x\"\n"
+        "  garbage = b + c\n"
+        "assert(a = \"a1\")\n"
+        "assert(b = \"b2\")\n"
+        "assert(c = \"c3\")\n"
+        "assert(garbage = \"b2c3\")\n"));
+    assert(!tokenizer.HasError());
+    Parser parser;
+    Script * script = parser.Parse(tokenizer.TakeTokens());
+    script->Compile();
+    bool isOk = script->Execute();
+    assert(isOk);
+    delete script;
+    assert(testPolicy.numOfMovedObj > 0);
+
+    // Names of variables are keys of the context map.
+    ExecStack execStack;
+    execStack.NewContext(nullptr);
+    Context * context = execStack.GetLastContext();
+    Str * name = Str::New("name");
+    context->SetVariable((Obj*)name, (Obj*)Int::New(7));
+    // Garbage of the same size makes the page of the name sparse.
+    for (uint n = 0; n < 10 && context->variables.count((Obj*)name) != 0; n++) {
+        for (uint i = 0; i < 100'000; i++)
+            Str::New("junk");
+        Heap::DomainGc(Heap::babyDomain);
+        Heap::SafePoint();
+    }
+    auto & [movedName, value] = *context->variables.begin();
+    assert(movedName != (Obj*)name);
+    assert(std::string(((Str*)movedName)->val) == "name");
+    assert(((Int*)value)->val == 7);
+    execStack.CloseContext();
+
+    Heap::gcPolicy = savedPolicy;
+}
+
+void Test_OutOfMemory() {
+    // The script runs out of memory, then gc must free all of its objects,
+    // nothing of it may stay rooted by the stack it was running on.
+    const std::size_t limit = 64 * 1024 * 1024;
+    Tokenizer tokenizer;
+    tokenizer.Tokenize(std::string(
+        "s = \"0123456789abcdef\"\n"
+        "for (i = 0; i < 40; i += 1)\n"
+        "  s = s + s\n"));
+    assert(!tokenizer.HasError());
+    Parser parser;
+    Script * script = parser.Parse(tokenizer.TakeTokens());
+    script->Compile();
+
+    VM::SetMemoryLimit(limit);
+    bool isOk = script->Execute();
+    VM::SetMemoryLimit(0);
+    assert(!isOk);
+    assert(!VM::current->error.empty());
+    assert(Heap::budget.usedBytes < limit / 4);
+    delete script;
+}
+
+void Test_ThreadExit() {
+    // Heap of a thread goes back to the bank when the thread exits,
+    // so the bank has as many pages in use as before the thread.
+    auto numOfUsedPages = []() {
+        std::lock_guard<std::mutex> lock(MemBank::mutex);
+        return MemBank::committedBytes / PAGE_SIZE - MemBank::freePages.size();
+    };
+    std::uint64_t numOfUsedBefore = numOfUsedPages();
+    uint numOfPages = 0;
+    std::thread worker([&]() {
+        VM::New();
+        for (uint i = 0; i < 100'000; i++)
+            ((Obj*)Str::New("some string"))->AddOwner();
+        numOfPages = Heap::NumOfPages();
+    });
+    worker.join();
+    assert(numOfPages > 0);
+    assert(numOfUsedPages() == numOfUsedBefore);
+}
+
+void Test_AllocStat() {
+    // The builtin prints the report, as a statement and as a value.
+    AllocProfiler::Enable(false);
+    AllocProfiler::Reset();
+    Tokenizer tokenizer;
+    tokenizer.Tokenize(std::string(
+        "s = \"a\" + \"b\"\n"
+        "AllocStat()\n"
+        "x = AllocStat()\n"));
+    assert(!tokenizer.HasError());
+    Parser parser;
+    Script * script = parser.Parse(tokenizer.TakeTokens());
+    script->Compile();
+
+    std::stringstream out;
+    auto * savedBuf = std::cout.rdbuf(out.rdbuf());
+    bool isOk = script->Execute();
+    std::cout.rdbuf(savedBuf);
+    assert(isOk);
+    std::string report = out.str();
+    std::size_t first = report.find("Allocations by type");
+    assert(first != std::string::npos);
+    assert(report.find("Allocations by type", first + 1) != std::string::npos);
+    delete script;
+
+    // Stats of other threads are merged by the report,
+    // also after the threads exit.
+    std::thread worker([]() {
+        VM::New();
+        for (uint i = 0; i < 1'000; i++)
+            Str::New("some string");
+    });
+    worker.join();
+    {
+        std::lock_guard<std::mutex> lock(AllocProfiler::mutex);
+        assert(AllocProfiler::typeStats[Str::t].numOfAlloc >= 1'000);
+    }
+    AllocProfiler::Disable();
+    AllocProfiler::Reset();
+}
+
+void Test_CompileAll() {
+    // Errors of parsing and of compiling stop only their own units,
+    // the other units are compiled and the calling code goes on.
+    const char * modules[] = {
+        "a = 1\n",
+        "b = (2\n",
+        "c = 3\n",
+        "break\n",
+        "jump(nowhere)\n",
+        "d = 4\n",
+    };
+    std::vector<std::unique_ptr<Source>> sources;
+    for (auto * module : modules)
+        sources.push_back(Source::FromString(module));
+
+    std::stringstream errors;
+    auto * savedBuf = std::cerr.rdbuf(errors.rdbuf());
+    std::vector<Script*> scripts = Script::CompileAll(std::move(sources), 2);
+    std::cerr.rdbuf(savedBuf);
+
+    assert(scripts.size() == 6);
+    assert(scripts[0] != nullptr && scripts[2] != nullptr && scripts[5] != nullptr);
+    assert(scripts[1] == nullptr && scripts[3] == nullptr && scripts[4] == nullptr);
+    assert(errors.str().find("'break'") != std::string::npos);
+    assert(errors.str().find("No such label 'nowhere'") != std::string::npos);
+    assert(ExprArena::current == nullptr);
+    assert(ConstantPool::current == nullptr);
+    for (auto * script : scripts) {
+        if (script != nullptr)
+            assert(script->Execute());
+        delete script;
+    }
+}
+
+static Script * CompileForTest(const std::string & src) {
+    Tokenizer tokenizer;
+    tokenizer.Tokenize(src);
+    assert(!tokenizer.HasError());
+    Parser parser;
+    Script * script = parser.Parse(tokenizer.TakeTokens());
+    script->Compile();
+    return script;
+}
+
+void Test_ConstantsLifetime() {
+    uint        numOfPools = ConstantPool::numOfPools;
+    std::size_t usedBytes  = ConstantPool::budget.usedBytes;
+
+    // The variable and its name are constants of a script, they stay
+    // in the context after the script is deleted and constants
+    // of other scripts are created.
+    ExecStack execStack;
+    Script * script = CompileForTest("retained_name = \"retained value\"\n");
+    bool isOk = script->Execute(execStack);
+    assert(isOk);
+    delete script;
+    assert(ConstantPool::numOfPools == numOfPools + 1);
+    for (uint i = 0; i < 100; i++)
+        delete CompileForTest("another_name = \"another value\"\n");
+    Heap::GlobalGc();
+
+    Context * context = execStack.GetLastContext();
+    assert(context->variables.size() == 1);
+    auto & [name, value] = *context->variables.begin();
+    assert(std::string(((Str*)name)->val) == "retained_name");
+    assert(std::string(((Str*)value)->val) == "retained value");
+
+    // Closing the frame frees the pool of the deleted script.
+    execStack.CloseContext();
+    assert(ConstantPool::numOfPools == numOfPools);
+    assert(ConstantPool::budget.usedBytes == usedBytes);
+
+    // Each script has constants of its own, but pools and their pages
+    // don't pile up, whichever stack runs the scripts.
+    for (uint i = 0; i < 1000; i++) {
+        std::string n = std::to_string(i);
+        script = CompileForTest("name_" + n + " = \"value " + n + "\" + \"" + n + "\"\n");
+        if (i % 2 == 0) {
+            isOk = script->Execute();
+        } else {
+            isOk = script->Execute(execStack);
+            execStack.CloseContext();
+        }
+        assert(isOk);
+        delete script;
+        assert(ConstantPool::numOfPools == numOfPools);
+        assert(ConstantPool::budget.usedBytes == usedBytes);
+    }
+}
+
+void Test_ConstantImage() {
+    // Constants of a script are interned into the VM and saved,
+    // another VM loads them, adds constants of its own and freezes them.
+    // A script compiled there refers to them rather than creating its own.
+    std::string path = (std::filesystem::temp_directory_path() / "virgo_test_constants.img").string();
+    std::string src =
+        "x = 12345\n"
+        "y = 2.5\n"
+        "z = \"image string\"\n";
+    std::thread writer([&]() {
+        VM::New();
+        Script * script = CompileForTest(src);
+        VM::InternConstants(script->GetConstantPool());
+        delete script;
+        bool isSaved = VM::SaveConstantImage(path);
+        assert(isSaved);
+    });
+    writer.join();
+
+    std::thread reader([&]() {
+        VM::New();
+        bool isLoaded = VM::LoadConstantImage(path);
+        assert(isLoaded);
+        Script * script = CompileForTest("w = \"after image\"\n");
+        VM::InternConstants(script->GetConstantPool());
+        delete script;
+        VM::FreezeConstants();
+
+        script = CompileForTest(src +
+            "w = \"after image\"\n"
+            "assert(x = 12345)\n"
+            "assert(y = 2.5)\n"
+            "assert(z = \"image string\")\n"
+            "assert(w = \"after image\")\n");
+        // Only line numbers past the end of the first script are new.
+        const ConstantPool & pool = script->GetConstantPool();
+        for (uint id = ConstantPool::NUM_OF_SHARED; id < pool.Size(); id++) {
+            Obj * obj = pool.Get(id);
+            bool isLine = obj->type == Int::t && ((Int*)obj)->val < 10;
+            assert(isLine || Page::GetPage(obj)->domain->GetFlag_IsFrozen());
+        }
+        bool isOk = script->Execute();
+        assert(isOk);
+        delete script;
+    });
+    reader.join();
+    std::remove(path.c_str());
+}
+
+void Test_HeapSnapshot() {
+    // Only a variable refers to the object, it's reachable from the roots
+    // of the snapshot, and so is its name, which is a constant.
+    ExecStack execStack;
+    Script * script = CompileForTest("held = \"held \" + \"value\"\n");
+    bool isOk = script->Execute(execStack);
+    assert(isOk);
+    auto [name, value] = *execStack.GetLastContext()->variables.begin();
+    assert(value->numOfOwners == 0);
+
+    std::vector<MemDomain*> domains { Heap::constantDomain, Heap::babyDomain, script->GetConstantPool().domain };
+    domains.insert(domains.end(), Heap::domains.begin(), Heap::domains.end());
+    std::stringstream snapshot;
+    HeapSnapshot::Write(snapshot, domains);
+
+    auto read = [&](auto & val) { snapshot.read((char*)&val, sizeof(val)); };
+    char magic[4];
+    snapshot.read(magic, sizeof(magic));
+    assert(std::equal(magic, magic + 4, HeapSnapshot::MAGIC));
+    std::uint32_t numOfTypes;
+    read(numOfTypes);
+    for (std::uint32_t i = 0; i < numOfTypes; i++) {
+        std::uint32_t nameSize;
+        read(nameSize);
+        snapshot.ignore(nameSize);
+    }
+    std::uint64_t numOfObjects;
+    read(numOfObjects);
+    std::unordered_map<std::uint64_t, std::vector<std::uint64_t>> refs;
+    std::vector<std::uint64_t> reachable;
+    for (std::uint64_t i = 0; i < numOfObjects; i++) {
+        std::uint64_t id;
+        std::uint32_t typeIndex, size, numOfRefs;
+        std::uint8_t  isRoot;
+        read(id);
+        read(typeIndex);
+        read(size);
+        read(isRoot);
+        read(numOfRefs);
+        refs[id].resize(numOfRefs);
+        for (auto & ref : refs[id])
+            read(ref);
+        if (isRoot)
+            reachable.push_back(id);
+    }
+    assert(snapshot.good());
+
+    std::unordered_set<std::uint64_t> isReached(reachable.begin(), reachable.end());
+    for (std::size_t i = 0; i < reachable.size(); i++) {
+        for (auto ref : refs[reachable[i]]) {
+            if (ref != 0 && isReached.insert(ref).second)
+                reachable.push_back(ref);
+        }
+    }
+    assert(isReached.count((std::uint64_t)value) != 0);
+    assert(isReached.count((std::uint64_t)name) != 0);
+
+    execStack.CloseContext();
+    delete script;
+}
+
+void Test_StreamConstants() {
+    // Each statement has constants of its own, but the pool only keeps
+    // the ones of the variables, which are moved when the others are freed.
+    const uint numOfLines = 100'000;
+    std::string src = "kept = \"kept value\"\n";
+    for (uint i = 0; i < numOfLines; i++)
+        src += "x = " + std::to_string(i) + " * 2.5\n";
+    src += "assert(kept = \"kept value\")\n";
+    src += "assert(x = " + std::to_string(numOfLines - 1) + " * 2.5)\n";
+
+    Script script;
+    bool isOk = script.Stream(Source::FromString(src), true);
+    assert(isOk);
+    assert(script.GetConstantPool().Size() < numOfLines / 2);
+}
+
+void Test_Script() {
+    Test_CompactWhileRunning();
+    Test_OutOfMemory();
+    Test_ThreadExit();
+    Test_AllocStat();
+    Test_CompileAll();
+    Test_ConstantsLifetime();
+    Test_ConstantImage();
+    Test_HeapSnapshot();
+    Test_StreamConstants();
+}
+
+void Bench_CompileAll() {
+    // Compiles the same generated modules with different number of threads.
+    // Needs the VM for constants.
+    using Clock = std::chrono::steady_clock;
+    const uint numOfModules = 64;
+    const uint numOfLines   = 5'000;
+
+    std::vector<std::string> modules(numOfModules);
+    for (uint m = 0; m < numOfModules; m++) {
+        for (uint i = 0; i < numOfLines; i++) {
+            std::string n = std::to_string(m * numOfLines + i);
+            modules[m] += "value_" + n + " = (value_" + std::to_string(i) + " + " + n + ") * 2.5\n"
+                          "if value_" + n + " > 100\n"
+                          "  total = total + \"module " + std::to_string(m) + "\"\n";
+        }
+    }
+
+    std::cout << "\nParallel compilation benchmark (" << numOfModules << " modules, "
+              << Utils::NumSep(numOfModules * numOfLines * 3) << " lines):\n";
+    uint maxNumOfThreads = std::max(1u, std::thread::hardware_concurrency());
+    for (uint n = 1; n <= maxNumOfThreads; n *= 2) {
+        std::vector<std::unique_ptr<Source>> sources;
+        for (auto & module : modules)
+            sources.push_back(Source::FromString(module));
+
+        auto t0 = Clock::now();
+        auto scripts = Script::CompileAll(std::move(sources), n);
+        auto t1 = Clock::now();
+        for (auto * script : scripts)
+            delete script;
+
+        auto time = std::chrono::duration_cast<std::chrono::microseconds>(t1 - t0).count();
+        std::cout << "threads : " << std::setw(4) << n
+                  << ", compile : " << Utils::NumSep(time) << " us\n";
+    }
 }
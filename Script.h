@@ -1,20 +1,60 @@
 #ifndef VIRGO_SCRIPT_H
 #define VIRGO_SCRIPT_H
 
+#include <memory>
+#include <string>
 #include <vector>
 #include "Expr.h"
+#include "Source.h"
+#include "ConstantPool.h"
+
+struct ExecStack;
 
 class Script {
-    ExprScript * exprScript;
+    ExprScript * exprScript{};
+    ExprArena *  exprArena{}; // Expression tree is freed after compilation.
     ByteCode bc{};
+    std::unique_ptr<ConstantPool> constantPool; // Constants of the code, see ~Script.
 
 public:
     explicit Script();
+
+    // Constants live as long as the script, or as long as the frames
+    // that run its code if they are still open, see ConstantPool::Release.
     ~Script();
-    void SetExprScript(ExprScript * exprScript_);
-    void Compile();
-    void Execute();
+    void SetExprScript(ExprScript * exprScript_, ExprArena * exprArena_);
+    void SetConstantPool(std::unique_ptr<ConstantPool> constantPool_);
+    void Compile(); // Throws SyntaxError.
+    const ConstantPool & GetConstantPool() const { return *bc.constantPool; }
+    bool Execute();
+
+    // Runs the code on the given stack, the context it creates stays
+    // on the stack with its variables, after the script too.
+    bool Execute(ExecStack & execStack);
+
+    // Tokenizes, parses and compiles the source by top-level statements,
+    // so tokens and expressions take as much memory as the biggest
+    // statement, whatever the size of the source. If 'isExecuting',
+    // statements are executed as soon as they can be, and constants
+    // (literals and names) of the code that has been run are freed,
+    // except the ones that variables keep, see Tokenizer::CompactConstants.
+    // Otherwise the code and its constants are kept for Execute.
+    // Returns false on error, which is printed.
+    bool Stream(std::unique_ptr<Source> source, bool isExecuting);
+
+    // Compiles independent scripts (modules) on numOfThreads threads,
+    // 0 means a thread per core. Each script is compiled by one thread
+    // into a constant pool of its own, the pool of the current VM is only
+    // read as their parent. Scripts with errors are nullptr, their errors
+    // are printed.
+    static std::vector<Script*> CompileAll(std::vector<std::unique_ptr<Source>> sources, uint numOfThreads);
     void PrintByteCode();
 };
 
+///////////////////////////////////////////////////////////////////////////////
+
+void Test_Script();
+
+void Bench_CompileAll();
+
 #endif //VIRGO_SCRIPT_H
@@ -0,0 +1,81 @@
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include "Source.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define VIRGO_USE_MMAP
+#endif
+
+Source::~Source() {
+#ifdef VIRGO_USE_MMAP
+    if (mapping != nullptr)
+        munmap(mapping, mappingSize);
+#endif
+}
+
+std::unique_ptr<Source> Source::FromString(std::string text) {
+    std::unique_ptr<Source> source(new Source());
+    source->text = std::move(text);
+    source->data = source->text.data();
+    source->size = source->text.size();
+    return source;
+}
+
+std::unique_ptr<Source> Source::FromFile(const std::string & path) {
+#ifdef VIRGO_USE_MMAP
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+
+    struct stat st{};
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return nullptr;
+    }
+
+    // Empty file can't be mapped.
+    if (st.st_size == 0) {
+        close(fd);
+        return FromString("");
+    }
+
+    void * mem = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+        return nullptr;
+    // Source is read once from start to end.
+    madvise(mem, st.st_size, MADV_SEQUENTIAL);
+
+    std::unique_ptr<Source> source(new Source());
+    source->mapping     = mem;
+    source->mappingSize = st.st_size;
+    source->data        = (const char*)mem;
+    source->size        = st.st_size;
+    return source;
+#else
+    std::ifstream f(path, std::ios::binary);
+    if (!f.is_open())
+        return nullptr;
+    std::stringstream s;
+    s << f.rdbuf();
+    return FromString(s.str());
+#endif
+}
+
+void Source::Release(std::size_t end) {
+#ifdef VIRGO_USE_MMAP
+    if (mapping == nullptr)
+        return;
+    static const std::size_t pageSize = sysconf(_SC_PAGESIZE);
+    std::size_t releasedEnd = std::min(end, mappingSize) / pageSize * pageSize;
+    if (releasedEnd <= releasedSize)
+        return;
+    madvise((char*)mapping + releasedSize, releasedEnd - releasedSize, MADV_DONTNEED);
+    releasedSize = releasedEnd;
+#endif
+}
@@ -0,0 +1,37 @@
+#ifndef VIRGO_SOURCE_H
+#define VIRGO_SOURCE_H
+
+#include <memory>
+#include <string>
+#include <string_view>
+
+// Source code of a script. Files are mapped read-only, so tokens
+// view the mapping and the text is never copied.
+class Source {
+    std::string  text;        // Source that is not mapped.
+    const char * data{};
+    std::size_t  size{};
+    void *       mapping{};
+    std::size_t  mappingSize{};
+    std::size_t  releasedSize{};
+
+    Source() = default;
+
+public:
+    Source(const Source &) = delete;
+    Source & operator=(const Source &) = delete;
+    ~Source();
+
+    static std::unique_ptr<Source> FromString(std::string text);
+
+    // Returns nullptr if the file can't be read.
+    static std::unique_ptr<Source> FromFile(const std::string & path);
+
+    std::string_view View() const { return {data, size}; }
+
+    // Text before 'end' won't be read anymore, so pages of a mapped file
+    // may leave memory while the rest of it is streamed.
+    void Release(std::size_t end);
+};
+
+#endif //VIRGO_SOURCE_H
@@ -9,39 +9,26 @@
 #include "Error.h"
 #include "ErrorMessages.h"
 
-const char * str_concat(const char * a, const char * b) {
-    uint aLen = strlen(a);
-    uint bLen = strlen(b);
-    uint cTotalLen = aLen + bLen + 1;
-    char * c = (char*)calloc(cTotalLen, sizeof(char));
-    memcpy(c, a, aLen);
-    memcpy(c + aLen, b, bLen);
-    return c;
-}
-
 Obj * Str_Equal(Obj * self, Obj * other) {
     assert(self->Is(Str::t));
     if (self == other)
         return (Obj*)Bool::True;
 
-    const char * selfVal = ((Str*)self)->val;
+    auto * selfStr = (Str*)self;
     if (other->Is(Str::t))
     {
-        const char * otherVal = ((Str*)other)->val;
-        return (Obj*)Bool::New(strcmp(selfVal, otherVal));
+        auto * otherStr = (Str*)other;
+        bool isEqual = selfStr->len == otherStr->len &&
+                       memcmp(selfStr->val, otherStr->val, selfStr->len) == 0;
+        return (Obj*)Bool::New(isEqual);
     }
     return (Obj*)Error::New(ERROR_INCOMPATIBLE_TYPES);
 }
 
 Obj * Str_Add(Obj * self, Obj * other) {
     assert(self->Is(Str::t));
-    const char * selfVal = ((Str*)self)->val;
     if (other->Is(Str::t))
-    {
-        const char * otherVal = ((Str*)other)->val;
-        const char * concatenated = str_concat(selfVal, otherVal);
-        return (Obj*)Str::New(concatenated);
-    }
+        return (Obj*)Str::Concat((Str*)self, (Str*)other);
     return (Obj*)Error::New(ERROR_INCOMPATIBLE_TYPES);
 }
 
@@ -51,6 +38,12 @@ std::string Str_DebugStr(Obj * self) {
     return std::string(str->val);
 }
 
+void Str_Moved(Obj * self) {
+    // Characters are stored right after the object.
+    auto * str = (Str*)self;
+    str->val = (char*)(str + 1);
+}
+
 /*
 Obj * Str_Get(Obj * self, Obj * other) {
     assert(self->Is(Str::t));
@@ -83,21 +76,43 @@ void Str::InitType() {
     mt->Equal    = &Str_Equal;
     mt->Add      = &Str_Add;
     mt->DebugStr = &Str_DebugStr;
+    mt->Moved    = &Str_Moved;
     //mt->Get     = &Str_Get;
 }
 
-void Str::New(void * inPlace, const char * value) {
+uint Str::ChunkSize(uint len) {
+    return sizeof(Str) + len + 1;
+}
+
+void Str::New(void * inPlace, const char * value, uint len) {
     Str * s = (Str*)inPlace;
     Obj::Init(s, Str::t);
-    uint len = strlen(value);
-    char * s_val = (char*)calloc(len + 1, sizeof(char));
+    char * s_val = (char*)(s + 1);
     memcpy(s_val, value, len);
+    s_val[len] = 0;
     s->val = s_val;
     s->len = len;
 }
 
 Str * Str::New(const char * value) {
-    Str * s = (Str*)Heap::GetChunk_Baby(sizeof(Str));
-    New(s, value);
+    return New(value, strlen(value));
+}
+
+Str * Str::New(const char * value, uint len) {
+    Str * s = (Str*)Heap::GetChunk_Baby(ChunkSize(len));
+    New(s, value, len);
+    return s;
+}
+
+Str * Str::Concat(const Str * a, const Str * b) {
+    uint len = a->len + b->len;
+    Str * s = (Str*)Heap::GetChunk_Baby(ChunkSize(len));
+    Obj::Init(s, Str::t);
+    char * s_val = (char*)(s + 1);
+    memcpy(s_val, a->val, a->len);
+    memcpy(s_val + a->len, b->val, b->len);
+    s_val[len] = 0;
+    s->val = s_val;
+    s->len = len;
     return s;
 }
@@ -5,13 +5,16 @@
 
 struct Str {
     Obj obj;
-    const char * val{};
+    const char * val{}; // Characters are placed in the same chunk right after the object.
     uint len{};
 
     static Type * t;
     static void InitType();
-    static void New(void * inPlace, const char * value);
+    static uint ChunkSize(uint len);
+    static void New(void * inPlace, const char * value, uint len);
     static Str * New(const char * value);
+    static Str * New(const char * value, uint len);
+    static Str * Concat(const Str * a, const Str * b);
 };
 
 #endif //PROTON_STR_H
@@ -1,8 +1,21 @@
 #include "Tokenizer.h"
-#include "None.h"
 #include "Str.h"
+#include "Utils.h"
+#include <array>
+#include <charconv>
+#include <cassert>
+#include <chrono>
+#include <random>
 #include <utility>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define VIRGO_USE_AVX2
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define VIRGO_USE_SSE2
+#endif
+
 std::map<TokenType, std::string> TokenTypeNames =
 {
     { TokenType::Undefined,      "Undefined"       },
@@ -75,35 +88,228 @@ void Printw(const std::string & str, int width) {
 }
 
 ///////////////////////////////////////////////////////////////////////////////
+// Fast scanning.
+//
+// Runs of characters (identifiers, numbers, whitespace, comment and string
+// bodies) are scanned by 32 (AVX2) or 16 (SSE2) bytes at a time.
+// Each function returns the position of the first character after the run,
+// or the size of the code. The tail that is shorter than a vector
+// is scanned one character at a time.
+
+#if defined(VIRGO_USE_AVX2)
+using Vec = __m256i;
+const std::size_t VEC_SIZE = 32;
+static inline Vec      VecLoad(const char * p)  { return _mm256_loadu_si256((const __m256i*)p); }
+static inline Vec      VecSet(char c)           { return _mm256_set1_epi8(c); }
+static inline Vec      VecEq(Vec a, Vec b)      { return _mm256_cmpeq_epi8(a, b); }
+static inline Vec      VecGt(Vec a, Vec b)      { return _mm256_cmpgt_epi8(a, b); }
+static inline Vec      VecAnd(Vec a, Vec b)     { return _mm256_and_si256(a, b); }
+static inline Vec      VecOr(Vec a, Vec b)      { return _mm256_or_si256(a, b); }
+static inline uint32_t VecMask(Vec v)           { return (uint32_t)_mm256_movemask_epi8(v); }
+const uint32_t VEC_FULL_MASK = 0xFFFFFFFF;
+#elif defined(VIRGO_USE_SSE2)
+using Vec = __m128i;
+const std::size_t VEC_SIZE = 16;
+static inline Vec      VecLoad(const char * p)  { return _mm_loadu_si128((const __m128i*)p); }
+static inline Vec      VecSet(char c)           { return _mm_set1_epi8(c); }
+static inline Vec      VecEq(Vec a, Vec b)      { return _mm_cmpeq_epi8(a, b); }
+static inline Vec      VecGt(Vec a, Vec b)      { return _mm_cmpgt_epi8(a, b); }
+static inline Vec      VecAnd(Vec a, Vec b)     { return _mm_and_si128(a, b); }
+static inline Vec      VecOr(Vec a, Vec b)      { return _mm_or_si128(a, b); }
+static inline uint32_t VecMask(Vec v)           { return (uint32_t)_mm_movemask_epi8(v); }
+const uint32_t VEC_FULL_MASK = 0xFFFF;
+#endif
+
+#if defined(VIRGO_USE_AVX2) || defined(VIRGO_USE_SSE2)
+#define VIRGO_USE_SIMD
+
+static inline uint CountTrailingZeros(uint32_t mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+// Bytes are compared as signed, so characters above 127 are never in range.
+static inline Vec VecInRange(Vec v, char lo, char hi) {
+    return VecAnd(VecGt(v, VecSet(lo - 1)), VecGt(VecSet(hi + 1), v));
+}
+
+static inline Vec VecIsWordChar(Vec v) {
+    return VecOr(VecOr(VecInRange(v, 'a', 'z'), VecInRange(v, 'A', 'Z')),
+                 VecOr(VecInRange(v, '0', '9'), VecEq(v, VecSet('_'))));
+}
+
+static inline Vec VecIsSpace(Vec v) {
+    return VecOr(VecEq(v, VecSet(' ')), VecOr(VecEq(v, VecSet('\t')), VecEq(v, VecSet('\r'))));
+}
+#endif
+
+static inline bool IsWordChar(char c) { return isalnum((unsigned char)c) || c == '_'; }
+static inline bool IsDigit(char c)    { return c >= '0' && c <= '9'; }
+static inline bool IsSpace(char c)    { return c == ' ' || c == '\t' || c == '\r'; }
+
+// Scalar versions scan the tails, Test_Tokenizer checks
+// that vector versions give the same results.
+
+static std::size_t SkipWordChars_Scalar(std::string_view code, std::size_t pos) {
+    while (pos < code.size() && IsWordChar(code[pos]))
+        pos++;
+    return pos;
+}
+
+static std::size_t SkipDigits_Scalar(std::string_view code, std::size_t pos) {
+    while (pos < code.size() && IsDigit(code[pos]))
+        pos++;
+    return pos;
+}
+
+static std::size_t SkipSpaces_Scalar(std::string_view code, std::size_t pos) {
+    while (pos < code.size() && IsSpace(code[pos]))
+        pos++;
+    return pos;
+}
+
+static std::size_t FindEither_Scalar(std::string_view code, std::size_t pos, char a, char b) {
+    while (pos < code.size() && code[pos] != a && code[pos] != b)
+        pos++;
+    return pos;
+}
+
+static std::size_t SkipWordChars(std::string_view code, std::size_t pos) {
+#ifdef VIRGO_USE_SIMD
+    for (; pos + VEC_SIZE <= code.size(); pos += VEC_SIZE) {
+        uint32_t mask = VecMask(VecIsWordChar(VecLoad(code.data() + pos)));
+        if (mask != VEC_FULL_MASK)
+            return pos + CountTrailingZeros(~mask);
+    }
+#endif
+    return SkipWordChars_Scalar(code, pos);
+}
+
+static std::size_t SkipDigits(std::string_view code, std::size_t pos) {
+#ifdef VIRGO_USE_SIMD
+    for (; pos + VEC_SIZE <= code.size(); pos += VEC_SIZE) {
+        uint32_t mask = VecMask(VecInRange(VecLoad(code.data() + pos), '0', '9'));
+        if (mask != VEC_FULL_MASK)
+            return pos + CountTrailingZeros(~mask);
+    }
+#endif
+    return SkipDigits_Scalar(code, pos);
+}
+
+static std::size_t SkipSpaces(std::string_view code, std::size_t pos) {
+#ifdef VIRGO_USE_SIMD
+    for (; pos + VEC_SIZE <= code.size(); pos += VEC_SIZE) {
+        uint32_t mask = VecMask(VecIsSpace(VecLoad(code.data() + pos)));
+        if (mask != VEC_FULL_MASK)
+            return pos + CountTrailingZeros(~mask);
+    }
+#endif
+    return SkipSpaces_Scalar(code, pos);
+}
+
+// Position of the first 'a' or 'b'.
+static std::size_t FindEither(std::string_view code, std::size_t pos, char a, char b) {
+#ifdef VIRGO_USE_SIMD
+    const Vec va = VecSet(a);
+    const Vec vb = VecSet(b);
+    for (; pos + VEC_SIZE <= code.size(); pos += VEC_SIZE) {
+        Vec v = VecLoad(code.data() + pos);
+        uint32_t mask = VecMask(VecOr(VecEq(v, va), VecEq(v, vb)));
+        if (mask != 0)
+            return pos + CountTrailingZeros(mask);
+    }
+#endif
+    return FindEither_Scalar(code, pos, a, b);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Keywords.
+//
+// Keywords are found by a perfect hash of the first and the last characters
+// and the length of a word. If a keyword is added, the hash may need new
+// coefficients, static_assert below checks that there are no collisions.
+
+struct Keyword {
+    std::string_view word;
+    TokenType        type;
+};
+
+constexpr Keyword KEYWORDS[] =
+{
+    {"none",   TokenType::None},
+    {"true",   TokenType::True},
+    {"false",  TokenType::False},
+    {"and",    TokenType::And},
+    {"or",     TokenType::Or},
+    {"not",    TokenType::Not},
+    {"if",     TokenType::If},
+    {"else",   TokenType::Else},
+    {"for",    TokenType::For},
+    {"in",     TokenType::In},
+    {"jump",   TokenType::Jump},
+    {"break",  TokenType::Break},
+    {"skip",   TokenType::Skip},
+    {"return", TokenType::Return},
+    {"assert", TokenType::Assert},
+};
 
-Token::Token(TokenType   tokenType,
-             std::string lexeme,
-             uint        constantId,
-             uint        line)
+constexpr std::size_t KEYWORD_TABLE_SIZE = 32;
+
+constexpr std::size_t KeywordHash(std::string_view word) {
+    return ((unsigned char)word.front() + (unsigned char)word.back() * 29 + word.size()) & (KEYWORD_TABLE_SIZE - 1);
+}
+
+// Index of a keyword in KEYWORDS by its hash, -1 if there is none.
+constexpr std::array<int, KEYWORD_TABLE_SIZE> KEYWORD_TABLE = [] {
+    std::array<int, KEYWORD_TABLE_SIZE> table{};
+    for (auto & i : table)
+        i = -1;
+    for (int i = 0; i < (int)std::size(KEYWORDS); i++)
+        table[KeywordHash(KEYWORDS[i].word)] = i;
+    return table;
+}();
+
+constexpr bool KeywordHashIsPerfect() {
+    for (int i = 0; i < (int)std::size(KEYWORDS); i++) {
+        if (KEYWORD_TABLE[KeywordHash(KEYWORDS[i].word)] != i)
+            return false;
+    }
+    return true;
+}
+static_assert(KeywordHashIsPerfect(), "Keyword hash has collisions.");
+
+static const Keyword * FindKeyword(std::string_view word) {
+    int i = KEYWORD_TABLE[KeywordHash(word)];
+    if (i < 0 || KEYWORDS[i].word != word)
+        return nullptr;
+    return &KEYWORDS[i];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+Token::Token(TokenType        tokenType,
+             std::string_view lexeme,
+             uint             constantId,
+             uint             line)
              :
              type{tokenType},
-             lexeme{std::move(lexeme)},
+             line{line},
              constantId{constantId},
-             constant{VM::GetConstantById(constantId)},
-             line{line} {}
+             lexeme{lexeme} {}
 
 Token::Token(TokenType tokenType,
              uint      line)
              :
              type{tokenType},
-             lexeme{""},
-             constantId{0},
-             constant{(Obj*)None::none},
              line{line} {}
 
 ///////////////////////////////////////////////////////////////////////////////
 
-Tokenizer::~Tokenizer() {
-    for (auto i : tokens) {
-        delete i;
-    }
-}
-
 void Tokenizer::Clear() {
     startPosition       = 0;
     currentPosition     = 0;
@@ -112,14 +318,103 @@ void Tokenizer::Clear() {
     hasError            = false;
     currentNestingLevel = 0;
     tokens.clear();
+    isStreamOver        = false;
+    hasStatementEnd     = false;
+    statementEnd        = 0;
+    statementStart      = 0;
+    nextTokens.clear();
 }
 
 void Tokenizer::Tokenize(std::string sourceCode) {
+    Tokenize(Source::FromString(std::move(sourceCode)));
+}
+
+void Tokenizer::Tokenize(std::unique_ptr<Source> source) {
     Clear();
-    src = std::move(sourceCode);
+    src  = std::move(source);
+    code = src->View();
+    constantPool = std::make_unique<ConstantPool>(parentPool);
+    constantPool->AddShared();
+    // Usually there is a token per 5-10 characters,
+    // so the array is reallocated at most once or twice.
+    tokens.reserve(code.size() / 8 + 16);
+
+    ConstantPool * savedPool = ConstantPool::current;
+    ConstantPool::current = constantPool.get();
     ScanTokens();
+    ConstantPool::current = savedPool;
+}
+
+void Tokenizer::BeginStream(std::unique_ptr<Source> source) {
+    Clear();
+    src  = std::move(source);
+    code = src->View();
+    constantPool = std::make_unique<ConstantPool>(parentPool);
+    constantPool->AddShared();
+    Process_NewLine();
 }
 
+bool Tokenizer::TokenizeStatement() {
+    ConstantPool * savedPool = ConstantPool::current;
+    ConstantPool::current = constantPool.get();
+    bool hasStatement = ScanStatement();
+    ConstantPool::current = savedPool;
+    return hasStatement;
+}
+
+bool Tokenizer::ScanStatement() {
+    // Tokens that were scanned to find the end of the previous statement.
+    tokens.assign(nextTokens.begin(), nextTokens.end());
+    nextTokens.clear();
+    hasStatementEnd = false;
+    if (hasError || isStreamOver)
+        return false;
+
+    // Text of the previous statements won't be read anymore.
+    src->Release(statementStart);
+
+    while (!IsAtEnd()) {
+        startPosition = currentPosition;
+        ScanToken();
+        if (hasError)
+            return false;
+        if (!hasStatementEnd || tokens.size() == statementEnd)
+            continue;
+
+        // The first token of the line decides whether the statement goes on.
+        hasStatementEnd = false;
+        if (statementEnd == 0 || tokens[statementEnd].type == TokenType::Else)
+            continue;
+        statementStart = startPosition;
+        nextTokens.assign(tokens.begin() + statementEnd, tokens.end());
+        tokens.resize(statementEnd);
+        tokens.emplace_back(TokenType::EndOfFile, tokens.back().line);
+        return true;
+    }
+    Process_EndOfFile();
+    isStreamOver = true;
+    return !hasError;
+}
+
+std::vector<Token> & Tokenizer::GetStatementTokens() { return tokens; }
+
+ConstantPool * Tokenizer::GetConstantPool() { return constantPool.get(); }
+
+void Tokenizer::CompactConstants() {
+    std::vector<uint> liveIds;
+    for (auto * tokenVector : {&tokens, &nextTokens}) {
+        for (auto & token : *tokenVector)
+            liveIds.push_back(token.constantId);
+    }
+    std::vector<uint> newIds = constantPool->Compact(liveIds);
+    for (auto * tokenVector : {&tokens, &nextTokens}) {
+        for (auto & token : *tokenVector)
+            token.constantId = newIds[token.constantId];
+    }
+}
+
+void Tokenizer::SetParentPool(const ConstantPool * pool) { parentPool = pool; }
+
 void Tokenizer::DebugTokenize(std::string sourceCode) {
     Tokenize(std::move(sourceCode));
     PrintTokens();
@@ -129,7 +424,14 @@ bool Tokenizer::HasError() { return hasError; }
 
 std::string Tokenizer::GetErrorMessage() { return errorMessage; }
 
-std::vector<Token*> Tokenizer::GetTokens() { return tokens; }
+const std::vector<Token> & Tokenizer::GetTokens() { return tokens; }
+
+TokenStream Tokenizer::TakeTokens() {
+    TokenStream stream { std::move(src), std::move(tokens), std::move(constantPool) };
+    code = {};
+    Clear();
+    return stream;
+}
 
 void Tokenizer::PrintTokens() {
     int width = 20;
@@ -140,15 +442,15 @@ void Tokenizer::PrintTokens() {
     std::cout << '\n' << std::string(width * 3 + 10, '-') << "\n";
 
     uint currLine = 1;
-    for (auto i : tokens) {
-        if (i->line != currLine) {
+    for (auto & i : tokens) {
+        if (i.line != currLine) {
             std::cout << std::endl;
-            currLine = i->line;
+            currLine = i.line;
         }
-        Printw(TokenTypeToString(i->type), width);
-        Printw(i->lexeme, width);
-        Printw(i->constantId == 0 ? "" : std::to_string(i->constantId), width);
-        Printw(std::to_string(i->line), width);
+        Printw(TokenTypeToString(i.type), width);
+        Printw(std::string(i.lexeme), width);
+        Printw(i.constantId == 0 ? "" : std::to_string(i.constantId), width);
+        Printw(std::to_string(i.line), width);
         std::cout << std::endl;
     }
 }
@@ -165,11 +467,11 @@ void Tokenizer::ScanTokens() {
 }
 
 bool Tokenizer::IsAtEnd() {
-    return currentPosition >= src.size();
+    return (std::size_t)currentPosition >= code.size();
 }
 
 char Tokenizer::Advance() {
-    char c = src.at(currentPosition);
+    char c = code[currentPosition];
     currentPosition++;
     return c;
 }
@@ -177,22 +479,26 @@ char Tokenizer::Advance() {
 char Tokenizer::Peek() {
     if (IsAtEnd())
         return '\0';
-    return src.at(currentPosition);
+    return code[currentPosition];
 }
 
 char Tokenizer::PeekNext() {
-    if (currentPosition + 1 >= src.size())
+    if ((std::size_t)currentPosition + 1 >= code.size())
         return '\0';
-    return src.at(currentPosition + 1);
+    return code[currentPosition + 1];
 }
 
 bool Tokenizer::Match(char expected) {
-    if (IsAtEnd() || src.at(currentPosition) != expected)
+    if (IsAtEnd() || code[currentPosition] != expected)
         return false;
     currentPosition++;
     return true;
 }
 
+std::string_view Tokenizer::Lexeme(int start, int endExcluded) {
+    return code.substr(start, endExcluded - start);
+}
+
 void Tokenizer::Process_NewLine() {
     currentLine++;
 
@@ -223,15 +529,18 @@ void Tokenizer::Process_NewLine() {
             return;
         }
         if (nestingLevel > currentNestingLevel) {
-            AddToken(new Token(TokenType::EnterScope, currentLine));
+            tokens.emplace_back(TokenType::EnterScope, currentLine);
             currentNestingLevel = nestingLevel;
         } else if (nestingLevel < currentNestingLevel) {
             for (int i = 0; i < (currentNestingLevel - nestingLevel); i++)
-                AddToken(new Token(TokenType::ExitScope, currentLine));
+                tokens.emplace_back(TokenType::ExitScope, currentLine);
             currentNestingLevel = nestingLevel;
         }
     }
     else ReportError("Nesting error.");
+
+    if (currentNestingLevel == 0)
+        MarkStatementEnd();
 }
 
 void Tokenizer::Process_Comment() {
@@ -254,6 +563,7 @@ void Tokenizer::Process_Comment() {
         // Notice that we have already processed one '#" character in global switch loop.
         Advance();
         for (;;) {
+            currentPosition = FindEither(code, currentPosition, '#', '\n');
             if (IsAtEnd())
                 break;
             if (Peek() == '#' && PeekNext() == '#') {
@@ -266,20 +576,21 @@ void Tokenizer::Process_Comment() {
         }
     } else {
         // One line comment
-        while (Peek() != '\n' && !IsAtEnd())
-            Advance();
+        currentPosition = FindEither(code, currentPosition, '\n', '\n');
     }
 }
 
 void Tokenizer::Process_WhiteSpace() {
     // Whitespace between keywords, identifiers, etc.
-    while (Match(' ') || Match('\t') || Match('\r'));
+    currentPosition = SkipSpaces(code, currentPosition);
 }
 
 void Tokenizer::Process_String() {
-    while (Peek() != '"' && !IsAtEnd()) {
-        if (Peek() == '\n')
-            currentLine++;
+    for (;;) {
+        currentPosition = FindEither(code, currentPosition, '"', '\n');
+        if (IsAtEnd() || Peek() == '"')
+            break;
+        currentLine++;
         Advance();
     }
 
@@ -289,65 +600,68 @@ void Tokenizer::Process_String() {
     }
 
     Advance();
-    std::string lexeme = SubStr(src, startPosition + 1, currentPosition - 1);
-    uint constantId = VM::GetConstantId_Str(lexeme);
-    AddToken(new Token(TokenType::String, lexeme, constantId, currentLine));
+    std::string_view lexeme = Lexeme(startPosition + 1, currentPosition - 1);
+    uint constantId = VM::GetConstantId_Str(lexeme, VM::HashStr(lexeme));
+    tokens.emplace_back(TokenType::String, lexeme, constantId, currentLine);
 }
 
 void Tokenizer::Process_Number() {
     bool isInt = true;
-    while (isdigit(Peek()))
-        Advance();
+    currentPosition = SkipDigits(code, currentPosition);
 
-    if (Peek() == '.' && isdigit(PeekNext())) {
+    if (Peek() == '.' && IsDigit(PeekNext())) {
         isInt = false;
         Advance();
-        while (isdigit(Peek()))
-            Advance();
+        currentPosition = SkipDigits(code, currentPosition);
     }
 
     if (Peek() == 'e' || Peek() == 'E') {
         isInt = false;
         Advance();
-        if (isdigit(Peek())) {
-            while(isdigit(Peek()))
-                Advance();
-        } else if ((Peek() == '+' || Peek() == '-') && isdigit(PeekNext())) {
+        if (IsDigit(Peek())) {
+            currentPosition = SkipDigits(code, currentPosition);
+        } else if ((Peek() == '+' || Peek() == '-') && IsDigit(PeekNext())) {
             Advance();
-            while(isdigit(Peek()))
-                Advance();
+            currentPosition = SkipDigits(code, currentPosition);
         } else {
             ReportError("Wrong exponential notation of a number.");
             return;
         }
     }
 
-    std::string lexeme = SubStr(src, startPosition, currentPosition);
+    std::string_view lexeme = Lexeme(startPosition, currentPosition);
+    const char * first = lexeme.data();
+    const char * last  = lexeme.data() + lexeme.size();
     if (isInt) {
-        uint constantId = VM::GetConstantId_Int(std::stoll(lexeme));
-        AddToken(new Token(TokenType::Int, lexeme, constantId, currentLine));
+        v_int val{};
+        auto [end, errc] = std::from_chars(first, last, val);
+        if (errc != std::errc() || end != last) {
+            ReportError("Integer number is too big.");
+            return;
+        }
+        tokens.emplace_back(TokenType::Int, lexeme, VM::GetConstantId_Int(val), currentLine);
     } else {
-        uint constantId = VM::GetConstantId_Real(std::stold(lexeme));
-        AddToken(new Token(TokenType::Real, lexeme, constantId, currentLine));
+        v_real val{};
+        auto [end, errc] = std::from_chars(first, last, val);
+        if (errc != std::errc() || end != last) {
+            ReportError("Real number is out of range.");
+            return;
+        }
+        tokens.emplace_back(TokenType::Real, lexeme, VM::GetConstantId_Real(val), currentLine);
     }
 }
 
-bool Tokenizer::IsKeyword(const std::string & word) {
-    return keywords.count(word) > 0;
-}
-
 void Tokenizer::Process_Word() {
-    while (isalnum(Peek()) || Peek() == '_')
-        Advance();
+    currentPosition = SkipWordChars(code, currentPosition);
 
-    std::string word = SubStr(src, startPosition, currentPosition);
-    if (IsKeyword(word)) {
-        AddToken(new Token(keywords[word], word, 0, currentLine));
+    std::string_view word = Lexeme(startPosition, currentPosition);
+    if (auto * keyword = FindKeyword(word); keyword != nullptr) {
+        tokens.emplace_back(keyword->type, word, 0, currentLine);
         return;
     }
 
-    uint constantId = VM::GetConstantId_Str(word);
-    AddToken(new Token(TokenType::Identifier, word, constantId, currentLine));
+    uint constantId = VM::GetConstantId_Str(word, VM::HashStr(word));
+    tokens.emplace_back(TokenType::Identifier, word, constantId, currentLine);
 }
 
 void Tokenizer::Process_EndOfFile() {
@@ -359,8 +673,13 @@ void Tokenizer::Process_EndOfFile() {
     according to the current nesting level.
     */
     for (int i = 0; i < currentNestingLevel; i++)
-        tokens.push_back(new Token(TokenType::ExitScope, currentLine));
-    tokens.push_back(new Token(TokenType::EndOfFile, currentLine));
+        tokens.emplace_back(TokenType::ExitScope, currentLine);
+    tokens.emplace_back(TokenType::EndOfFile, currentLine);
+}
+
+void Tokenizer::MarkStatementEnd() {
+    hasStatementEnd = true;
+    statementEnd    = tokens.size();
 }
 
 void Tokenizer::ScanToken() {
@@ -470,15 +789,77 @@ void Tokenizer::ScanToken() {
 void Tokenizer::AddToken(TokenType type) { AddToken(type, 0); }
 
 void Tokenizer::AddToken(TokenType tokenType, uint literalId) {
-    std::string lexeme = SubStr(src, startPosition, currentPosition);
-    tokens.push_back(new Token(tokenType, lexeme, literalId, currentLine));
+    tokens.emplace_back(tokenType, Lexeme(startPosition, currentPosition), literalId, currentLine);
 }
 
-void Tokenizer::AddToken(Token * token) { tokens.push_back(token); }
-
 void Tokenizer::ReportError(const std::string & message) {
     hasError = true;
     std::stringstream s;
     s << "Line " << currentLine << ". " << message << std::endl;
     errorMessage = s.str();
 }
+
+///////////////////////////////////////////////////////////////////////////////
+
+void Test_Tokenizer() {
+    // Vector scanning must stop where the scalar scanning does. Sources
+    // are runs of random characters, so runs end at any position of a
+    // vector and in the tail, bytes above 127 included.
+    const char chars[] = "azAZ09_ \t\r\n\"#+.\x7f\x80\xff";
+    const std::string_view alphabet(chars, sizeof(chars) - 1);
+    std::mt19937 random(1);
+    for (uint n = 0; n < 1'000; n++) {
+        std::string code;
+        while (code.size() < n % 200) {
+            char c = alphabet[random() % alphabet.size()];
+            code.append(random() % 40 + 1, c);
+        }
+        for (std::size_t pos = 0; pos <= code.size(); pos++) {
+            assert(SkipWordChars(code, pos) == SkipWordChars_Scalar(code, pos));
+            assert(SkipDigits(code, pos)    == SkipDigits_Scalar(code, pos));
+            assert(SkipSpaces(code, pos)    == SkipSpaces_Scalar(code, pos));
+            assert(FindEither(code, pos, '#', '\n') == FindEither_Scalar(code, pos, '#', '\n'));
+            assert(FindEither(code, pos, '"', '\n') == FindEither_Scalar(code, pos, '"', '\n'));
+        }
+    }
+}
+
+void Bench_Tokenizer() {
+    // Tokenizes a few megabytes of generated code with long identifiers,
+    // numbers, strings and comments. Needs the VM for constants.
+    using Clock = std::chrono::steady_clock;
+    const uint numOfLines = 200'000;
+
+    std::string src;
+    for (uint i = 0; i < numOfLines; i++) {
+        std::string n = std::to_string(i % 1000);
+        src += "some_long_variable_name_" + n + " = another_variable_" + n +
+               " + 1234567.891e+2 * (counter - \"some string literal " + n + "\")\n";
+        if (i % 10 == 0)
+            src += "# one line comment that explains something very important\n";
+        if (i % 100 == 0)
+            src += "##\nmultiline comment\nwith several lines of text\n##\n";
+    }
+
+    // Tokenize takes the source by value, the copy is not timed.
+    std::size_t srcSize = src.size();
+    Tokenizer tokenizer;
+    auto source = Source::FromString(std::move(src));
+    auto t0 = Clock::now();
+    tokenizer.Tokenize(std::move(source));
+    auto t1 = Clock::now();
+
+    auto time = std::chrono::duration_cast<std::chrono::microseconds>(t1 - t0).count();
+    std::cout << "\nTokenizer benchmark:\n"
+#if defined(VIRGO_USE_AVX2)
+              << "scanning : avx2\n"
+#elif defined(VIRGO_USE_SSE2)
+              << "scanning : sse2\n"
+#else
+              << "scanning : scalar\n"
+#endif
+              << "source   : " << Utils::NumSep(srcSize) << " bytes\n"
+              << "tokens   : " << Utils::NumSep(tokenizer.GetTokens().size()) << '\n'
+              << "time     : " << Utils::NumSep(time) << " us\n"
+              << "speed    : " << (time > 0 ? srcSize / (double)time : 0) << " MB/s\n";
+}
@@ -2,6 +2,8 @@
 #define PROTON_TOKENIZER_H
 
 #include <string>
+#include <string_view>
+#include <memory>
 #include <utility>
 #include <vector>
 #include <iostream>
@@ -13,6 +15,7 @@
 #include <streambuf>
 #include "Obj.h"
 #include "VM.h"
+#include "Source.h"
 
 enum class TokenType {
     Undefined,
@@ -88,7 +91,15 @@ std::string SubStr(const std::string & str, int start, int endExcluded);
 ///////////////////////////////////////////////////////////////////////////////
 
 struct Token {
-    const TokenType type;
+    TokenType type{};
+
+    // Line of code that contains this token.
+    uint line{};
+
+    // If 'lexeme' represents some constant value like integer, real, string,
+    // then 'constantId' is the id of an actual object (Int, Real, Str, etc.),
+    // otherwise it is 0.
+    uint constantId{};
 
     /*
     'lexeme' is a piece of text, that represents some entity.
@@ -96,31 +107,37 @@ struct Token {
         some constant values: '123', '3.57e+12', "It's Britney, bitch!", 'variableName'.
         keywords: 'if', 'else', 'for', etc.
         some symbols like braces, brackets, slashes, etc.
+    It points into the source code, which is owned by TokenStream.
     */
-    const std::string lexeme;
+    std::string_view lexeme;
 
-    // If 'lexeme' represents some constant value like integer, real, string,
-    // then 'constant' contains an actual object (Int, Real, Str, etc.),
-    // otherwise it is 'none'.
-    const uint  constantId;
-    const Obj * constant;
+    Token() = default;
 
-    // Line of code that contains this token.
-    const uint line {};
+    Token(TokenType        tokenType,
+          std::string_view lexeme,
+          uint             constantId,
+          uint             line);
 
-    explicit Token(TokenType   tokenType,
-                   std::string lexeme,
-                   uint        constantId,
-                   uint        line);
+    Token(TokenType tokenType,
+          uint      line);
+};
 
-    explicit Token(TokenType tokenType,
-                   uint      line);
+// Tokens are stored by value in one array, their lexemes point
+// into the source, so the source is kept together with them.
+// The source is on the heap, so moving the stream doesn't
+// invalidate lexemes. Constant ids of the tokens are ids
+// in the constant pool of the stream.
+struct TokenStream {
+    std::unique_ptr<Source>       src;
+    std::vector<Token>            tokens;
+    std::unique_ptr<ConstantPool> constantPool;
 };
 
 ///////////////////////////////////////////////////////////////////////////////
 
 class Tokenizer {
-    std::string src;
+    std::unique_ptr<Source> src;
+    std::string_view code;
     int         startPosition       {};
     int         currentPosition     {};
     int         currentLine         {};
@@ -129,56 +146,82 @@ class Tokenizer {
     std::string errorMessage        {};
     int         currentNestingLevel {};
 
-    std::vector<Token*> tokens;
-
-    std::map<std::string, TokenType> keywords =
-    {
-        {"none",   TokenType::None},
-        {"true",   TokenType::True},
-        {"false",  TokenType::False},
-        {"and",    TokenType::And},
-        {"or",     TokenType::Or},
-        {"not",    TokenType::Not},
-        {"if",     TokenType::If},
-        {"else",   TokenType::Else},
-        {"for",    TokenType::For},
-        {"in",     TokenType::In},
-        {"jump",   TokenType::Jump},
-        {"break",  TokenType::Break},
-        {"skip",   TokenType::Skip},
-        {"return", TokenType::Return},
-        {"assert", TokenType::Assert},
-    };
+    std::vector<Token> tokens;
+
+    // Constants of the tokens, a new pool for each source.
+    std::unique_ptr<ConstantPool> constantPool;
+    const ConstantPool *          parentPool = VM::current == nullptr ? nullptr : &VM::current->constantPool;
+
+    // Streaming, see TokenizeStatement.
+    bool               isStreamOver        {};
+    bool               hasStatementEnd     {};
+    std::size_t        statementEnd        {}; // Number of tokens before the line that may start a new statement.
+    std::size_t        statementStart      {}; // Source position of the next statement.
+    std::vector<Token> nextTokens;             // Beginning of the next statement.
 
     void ScanTokens();
+    bool ScanStatement();
     bool IsAtEnd();
     char Advance();
     char Peek();
     char PeekNext();
     bool Match(char expected);
+    std::string_view Lexeme(int start, int endExcluded);
     void Process_NewLine();
     void Process_Comment();
     void Process_WhiteSpace();
     void Process_String();
     void Process_Number();
-    bool IsKeyword(const std::string & word);
     void Process_Word();
     void Process_EndOfFile();
+    void MarkStatementEnd();
     void ScanToken();
     void AddToken(TokenType type);
     void AddToken(TokenType tokenType, uint literalId);
-    void AddToken(Token * token);
     void ReportError(const std::string & message);
 
 public:
     void Clear();
     void Tokenize(std::string sourceCode);
+    void Tokenize(std::unique_ptr<Source> source);
+
+    // Streaming mode for sources that are too big to be tokenized at once.
+    // Each call of TokenizeStatement replaces the tokens with the tokens of
+    // the next top-level statement (or a few of them, if they share a line),
+    // followed by EndOfFile. A statement ends at a line without indentation
+    // outside of brackets, unless the line starts with 'else'.
+    // Returns false when the source is over or on error.
+    void BeginStream(std::unique_ptr<Source> source);
+    bool TokenizeStatement();
+
+    // Tokens of the last statement, the parser borrows them.
+    std::vector<Token> & GetStatementTokens();
+
+    // Pool of the source that is being tokenized.
+    ConstantPool * GetConstantPool();
+
+    // Frees constants of the statements that have been run, keeping
+    // the ones of the tokens and the ones that objects refer to,
+    // see ConstantPool::Compact.
+    void CompactConstants();
+
+    // Parent of the pools of new sources, by default it's the pool
+    // of the current VM. Threads without a VM set it explicitly.
+    void SetParentPool(const ConstantPool * pool);
     void DebugTokenize(std::string sourceCode);
     bool HasError();
     std::string GetErrorMessage();
-    std::vector<Token*> GetTokens();
+    const std::vector<Token> & GetTokens();
+
+    // Moves the tokens, the source and the constants out of the tokenizer.
+    TokenStream TakeTokens();
     void PrintTokens();
-    ~Tokenizer();
 };
 
+///////////////////////////////////////////////////////////////////////////////
+
+void Test_Tokenizer();
+
+void Bench_Tokenizer();
+
 #endif //PROTON_TOKENIZER_H
@@ -0,0 +1,275 @@
+// Offline analysis of heap snapshots written by HeapSnapshot.
+// Builds the dominator tree of the object graph and prints
+// retained sizes by type and the biggest retainers.
+//
+// Usage: HeapAnalyzer <snapshot.vhs> [number of top objects]
+//
+// Standalone, depends only on the standard library.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct Node {
+    std::uint64_t id;
+    std::uint32_t type;
+    std::uint32_t size;
+    bool          isRoot;
+    std::vector<std::uint32_t> refs;
+};
+
+struct Snapshot {
+    std::vector<std::string> types;
+    std::vector<Node>        nodes;
+};
+
+template<class T>
+static bool Read(std::istream & in, T & val) {
+    return (bool)in.read((char*)&val, sizeof(T));
+}
+
+static bool Load(const std::string & path, Snapshot & snapshot) {
+    std::ifstream in(path, std::ios::binary);
+    char magic[4];
+    if (!in.read(magic, 4) || std::memcmp(magic, "VHS1", 4) != 0)
+        return false;
+
+    std::uint32_t numOfTypes;
+    if (!Read(in, numOfTypes))
+        return false;
+    snapshot.types.resize(numOfTypes);
+    for (auto & name : snapshot.types) {
+        std::uint32_t len;
+        if (!Read(in, len))
+            return false;
+        name.resize(len);
+        in.read(name.data(), len);
+    }
+
+    std::uint64_t numOfNodes;
+    if (!Read(in, numOfNodes))
+        return false;
+
+    // References are stored as ids (addresses), here they become indices.
+    // Node 0 is a virtual root which refers to all roots.
+    std::vector<std::vector<std::uint64_t>> refIds(numOfNodes + 1);
+    std::unordered_map<std::uint64_t, std::uint32_t> index;
+    snapshot.nodes.resize(numOfNodes + 1);
+    snapshot.nodes[0] = {0, UINT32_MAX, 0, false, {}};
+    for (std::uint64_t i = 1; i <= numOfNodes; i++) {
+        auto & node = snapshot.nodes[i];
+        std::uint8_t isRoot;
+        std::uint32_t numOfRefs;
+        if (!Read(in, node.id) || !Read(in, node.type) || !Read(in, node.size) ||
+            !Read(in, isRoot) || !Read(in, numOfRefs))
+            return false;
+        node.isRoot = isRoot != 0;
+        refIds[i].resize(numOfRefs);
+        for (auto & ref : refIds[i])
+            Read(in, ref);
+        index[node.id] = i;
+        if (node.isRoot)
+            snapshot.nodes[0].refs.push_back(i);
+    }
+
+    for (std::uint64_t i = 1; i <= numOfNodes; i++) {
+        for (auto ref : refIds[i]) {
+            auto it = index.find(ref);
+            if (it != index.end())
+                snapshot.nodes[i].refs.push_back(it->second);
+        }
+    }
+    return (bool)in;
+}
+
+// Cooper, Harvey, Kennedy. "A Simple, Fast Dominance Algorithm".
+// Returns immediate dominators, UINT32_MAX for unreachable nodes.
+static std::vector<std::uint32_t> Dominators(const std::vector<Node> & nodes,
+                                             std::vector<std::uint32_t> & postOrder)
+{
+    const std::uint32_t NONE = UINT32_MAX;
+    std::size_t n = nodes.size();
+
+    // Iterative dfs from the virtual root.
+    std::vector<std::uint32_t> order(n, NONE);
+    std::vector<std::pair<std::uint32_t, std::size_t>> stack { {0, 0} };
+    std::vector<bool> isVisited(n, false);
+    isVisited[0] = true;
+    while (!stack.empty()) {
+        auto & [node, next] = stack.back();
+        if (next < nodes[node].refs.size()) {
+            std::uint32_t ref = nodes[node].refs[next++];
+            if (!isVisited[ref]) {
+                isVisited[ref] = true;
+                stack.push_back({ref, 0});
+            }
+        } else {
+            order[node] = postOrder.size();
+            postOrder.push_back(node);
+            stack.pop_back();
+        }
+    }
+
+    std::vector<std::vector<std::uint32_t>> preds(n);
+    for (std::uint32_t i = 0; i < n; i++) {
+        if (order[i] == NONE)
+            continue;
+        for (auto ref : nodes[i].refs)
+            preds[ref].push_back(i);
+    }
+
+    std::vector<std::uint32_t> idom(n, NONE);
+    idom[0] = 0;
+    auto intersect = [&](std::uint32_t a, std::uint32_t b) {
+        while (a != b) {
+            while (order[a] < order[b]) a = idom[a];
+            while (order[b] < order[a]) b = idom[b];
+        }
+        return a;
+    };
+
+    for (bool isChanged = true; isChanged; ) {
+        isChanged = false;
+        for (auto it = postOrder.rbegin(); it != postOrder.rend(); ++it) {
+            std::uint32_t node = *it;
+            if (node == 0)
+                continue;
+            std::uint32_t newIdom = NONE;
+            for (auto pred : preds[node]) {
+                if (idom[pred] == NONE)
+                    continue;
+                newIdom = newIdom == NONE ? pred : intersect(pred, newIdom);
+            }
+            if (idom[node] != newIdom) {
+                idom[node] = newIdom;
+                isChanged = true;
+            }
+        }
+    }
+    return idom;
+}
+
+int main(int argc, char * argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: HeapAnalyzer <snapshot.vhs> [number of top objects]\n";
+        return 1;
+    }
+    std::size_t numOfTop = argc > 2 ? std::stoul(argv[2]) : 20;
+
+    Snapshot snapshot;
+    if (!Load(argv[1], snapshot)) {
+        std::cerr << "Can't read snapshot: " << argv[1] << '\n';
+        return 1;
+    }
+    auto & nodes = snapshot.nodes;
+    auto & types = snapshot.types;
+    const std::uint32_t NONE = UINT32_MAX;
+
+    std::vector<std::uint32_t> postOrder;
+    auto idom = Dominators(nodes, postOrder);
+
+    // Post order visits children of the dominator tree before parents.
+    std::vector<std::uint64_t> retained(nodes.size(), 0);
+    for (auto node : postOrder) {
+        retained[node] += nodes[node].size;
+        if (node != 0)
+            retained[idom[node]] += retained[node];
+    }
+
+    // Retained size of a type counts only the objects that are not
+    // dominated by an object of the same type, otherwise nested
+    // objects (list of lists) would be counted twice.
+    std::vector<std::vector<std::uint32_t>> children(nodes.size());
+    for (std::uint32_t i = 1; i < nodes.size(); i++) {
+        if (idom[i] != NONE)
+            children[idom[i]].push_back(i);
+    }
+
+    struct TypeStat {
+        std::uint64_t numOfObj{};
+        std::uint64_t shallow{};
+        std::uint64_t retained{};
+    };
+    std::vector<TypeStat> typeStats(types.size());
+    std::uint64_t numOfUnreachable = 0;
+    std::uint64_t unreachableSize = 0;
+    for (std::uint32_t i = 1; i < nodes.size(); i++) {
+        typeStats[nodes[i].type].numOfObj++;
+        typeStats[nodes[i].type].shallow += nodes[i].size;
+        if (idom[i] == NONE) {
+            numOfUnreachable++;
+            unreachableSize += nodes[i].size;
+        }
+    }
+
+    std::vector<std::uint32_t> typeDepth(types.size(), 0);
+    std::vector<std::pair<std::uint32_t, bool>> stack { {0, false} };
+    while (!stack.empty()) {
+        auto [node, isExit] = stack.back();
+        stack.pop_back();
+        std::uint32_t type = nodes[node].type;
+        if (isExit) {
+            if (node != 0)
+                typeDepth[type]--;
+            continue;
+        }
+        if (node != 0) {
+            if (typeDepth[type] == 0)
+                typeStats[type].retained += retained[node];
+            typeDepth[type]++;
+        }
+        stack.push_back({node, true});
+        for (auto child : children[node])
+            stack.push_back({child, false});
+    }
+
+    std::vector<std::uint32_t> typeOrder(types.size());
+    for (std::uint32_t i = 0; i < types.size(); i++)
+        typeOrder[i] = i;
+    std::sort(typeOrder.begin(), typeOrder.end(), [&](auto a, auto b) {
+        return typeStats[a].retained > typeStats[b].retained;
+    });
+
+    std::cout << "objects    : " << nodes.size() - 1 << '\n'
+              << "reachable  : " << retained[0] << " bytes\n"
+              << "unreachable: " << numOfUnreachable << " objects, "
+              << unreachableSize << " bytes (garbage not collected yet)\n";
+
+    std::cout << "\nRetained size by type:\n"
+              << std::setw(16) << std::left  << "type"
+              << std::setw(14) << std::right << "objects"
+              << std::setw(16) << "shallow"
+              << std::setw(16) << "retained" << '\n';
+    for (auto t : typeOrder) {
+        std::cout << std::setw(16) << std::left  << types[t]
+                  << std::setw(14) << std::right << typeStats[t].numOfObj
+                  << std::setw(16) << typeStats[t].shallow
+                  << std::setw(16) << typeStats[t].retained << '\n';
+    }
+
+    std::vector<std::uint32_t> top;
+    for (std::uint32_t i = 1; i < nodes.size(); i++) {
+        if (idom[i] != NONE)
+            top.push_back(i);
+    }
+    numOfTop = std::min(numOfTop, top.size());
+    std::partial_sort(top.begin(), top.begin() + numOfTop, top.end(), [&](auto a, auto b) {
+        return retained[a] > retained[b];
+    });
+
+    std::cout << "\nBiggest retainers:\n";
+    for (std::size_t i = 0; i < numOfTop; i++) {
+        auto & node = nodes[top[i]];
+        std::cout << "0x" << std::hex << node.id << std::dec
+                  << std::setw(16) << types[node.type]
+                  << std::setw(16) << retained[top[i]] << " bytes"
+                  << (node.isRoot ? "  (root)" : "") << '\n';
+    }
+    return 0;
+}
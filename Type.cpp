@@ -5,8 +5,22 @@
 Type::Type(std::string name) :
 Obj{nullptr}, name{std::move(name)} {
     methodTable = new MethodTable();
+    Registry()[this->name] = this;
 }
 
 Type::~Type() {
+    auto it = Registry().find(name);
+    if (it != Registry().end() && it->second == this)
+        Registry().erase(it);
     delete methodTable;
 }
+
+std::map<std::string, Type*> & Type::Registry() {
+    static std::map<std::string, Type*> registry;
+    return registry;
+}
+
+Type * Type::Find(const std::string & name) {
+    auto it = Registry().find(name);
+    return it == Registry().end() ? nullptr : it->second;
+}
@@ -2,6 +2,8 @@
 #define VIRGO_TYPE_H
 
 #include <string>
+#include <vector>
+#include <map>
 #include "Obj.h"
 
 struct MethodTable {
@@ -10,20 +12,29 @@ struct MethodTable {
     Obj * (*Equal)  (Obj * self, Obj * other) {};
     Obj * (*ToStr)  (Obj * self, std::byte * inPlace) {};
 
-    Obj * (*Neg)  (Obj * self, std::byte * inPlace) {};
-    Obj * (*Add)  (Obj * self, Obj * other, std::byte * inPlace) {};
-    Obj * (*Sub)  (Obj * self, Obj * other, std::byte * inPlace) {};
-    Obj * (*Mul)  (Obj * self, Obj * other, std::byte * inPlace) {};
-    Obj * (*Div)  (Obj * self, Obj * other, std::byte * inPlace) {};
-    Obj * (*Pow)  (Obj * self, Obj * other, std::byte * inPlace) {};
+    Obj * (*Negate)         (Obj * self) {};
+    Obj * (*Add)            (Obj * self, Obj * other) {};
+    Obj * (*Subtract)       (Obj * self, Obj * other) {};
+    Obj * (*Multiply)       (Obj * self, Obj * other) {};
+    Obj * (*Divide)         (Obj * self, Obj * other) {};
+    Obj * (*Power)          (Obj * self, Obj * other) {};
 
-    Obj * (*Gr)   (Obj * self, Obj * other) {};
-    Obj * (*GrEq) (Obj * self, Obj * other) {};
-    Obj * (*Ls)   (Obj * self, Obj * other) {};
-    Obj * (*LsEq) (Obj * self, Obj * other) {};
+    Obj * (*Greater)        (Obj * self, Obj * other) {};
+    Obj * (*GreaterOrEqual) (Obj * self, Obj * other) {};
+    Obj * (*Less)           (Obj * self, Obj * other) {};
+    Obj * (*LessOrEqual)    (Obj * self, Obj * other) {};
 
     // Used for debugging.
     std::string (*DebugStr) (Obj * self) {};
+
+    // Pointer map. Appends addresses of the fields that refer to other
+    // objects, used by heap snapshots and compaction. Types without it
+    // are considered to hold no references.
+    void (*GetRefSlots) (Obj * self, std::vector<Obj**> & slots) {};
+
+    // Called after compaction moved the object,
+    // to fix pointers into the object itself.
+    void (*Moved) (Obj * self) {};
 };
 
 struct Type : Obj {
@@ -32,6 +43,10 @@ struct Type : Obj {
 
     explicit Type(std::string name);
     ~Type();
+
+    // Types by name, used to link heap images to types of the process.
+    static std::map<std::string, Type*> & Registry();
+    static Type * Find(const std::string & name);
 };
 
 #endif //VIRGO_TYPE_H
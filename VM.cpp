@@ -1,4 +1,7 @@
 #include <sstream>
+#include <cstdlib>
+#include <algorithm>
+#include <functional>
 #include "VM.h"
 #include "Type.h"
 #include "None.h"
@@ -8,6 +11,8 @@
 #include "Real.h"
 #include "Str.h"
 #include "Context.h"
+#include "AllocProfiler.h"
+#include "HeapSnapshot.h"
 
 const uint ExecStack::OBJ_STACK_MAX_SIZE = 8 * 1024 * 1024; // 8 Mb
 
@@ -15,9 +20,18 @@ const uint ExecStack::STACK_UNIT = 8;
 
 ExecStack::ExecStack() {
     objStack = (std::byte*)calloc(OBJ_STACK_MAX_SIZE, 1);
+    vm = VM::current;
+    if (vm != nullptr)
+        vm->execStacks.push_back(this);
 }
 
+// Frames that are still open are closed, see ExprScript::EndCompile.
 ExecStack::~ExecStack() {
+    Unwind(0, 0);
+    if (vm != nullptr) {
+        auto & stacks = vm->execStacks;
+        stacks.erase(std::find(stacks.begin(), stacks.end(), this));
+    }
     free(objStack);
 }
 
@@ -28,28 +42,50 @@ void ExecStack::CheckStackOverflow() {
     }
 }
 
-void ExecStack::NewContext() {
+// Frame starts with its context and the constant pool of its code.
+void ExecStack::NewContext(ConstantPool * constantPool) {
     CheckStackOverflow();
     auto * context = new Context();
     *((Context**)(objStack + objStackTop)) = context;
-    frameStack.push(objStackTop);
-    objStackTop += STACK_UNIT;
+    *((ConstantPool**)(objStack + objStackTop + STACK_UNIT)) = constantPool;
+    if (constantPool != nullptr)
+        constantPool->AddFrame();
+    frameStack.push_back(objStackTop);
+    objStackTop += 2 * STACK_UNIT;
     lastContext = context;
+    lastConstantPool = constantPool;
 }
 
 void ExecStack::CloseContext() {
-    uint lastFramePos = frameStack.top();
-    frameStack.pop();
-    auto * context = *((Context**)(objStack + lastFramePos));
+    uint lastFramePos = frameStack.back();
+    frameStack.pop_back();
+    auto * context      = *((Context**)(objStack + lastFramePos));
+    auto * constantPool = *((ConstantPool**)(objStack + lastFramePos + STACK_UNIT));
     delete context;
+    if (constantPool != nullptr)
+        constantPool->RemoveFrame();
     objStackTop = lastFramePos;
 
     if (frameStack.size() > 0) {
-        lastFramePos = frameStack.top();
+        lastFramePos = frameStack.back();
         lastContext = *((Context**)(objStack + lastFramePos));
+        lastConstantPool = *((ConstantPool**)(objStack + lastFramePos + STACK_UNIT));
+    } else {
+        lastContext = nullptr;
+        lastConstantPool = nullptr;
     }
 }
 
+void ExecStack::Unwind(std::size_t numOfFrames, uint top) {
+    while (frameStack.size() > numOfFrames)
+        CloseContext();
+    objStackTop = top;
+}
+
+Obj * const * ExecStack::GetConstants() {
+    return lastConstantPool == nullptr ? nullptr : lastConstantPool->objects.data();
+}
+
 void ExecStack::PushObj(Obj * obj) {
     CheckStackOverflow();
     *((Obj**)(objStack + objStackTop)) = obj;
@@ -62,35 +98,100 @@ Obj * ExecStack::PopObj() {
     return *((Obj**)(objStack + objStackTop));
 }
 
-Context * GetLastContext() {
+Context * ExecStack::GetLastContext() {
     return lastContext;
 }
 
+void ExecStack::GetRootSlots(std::vector<Obj**> & slots, std::vector<Obj*> & keys) {
+    std::size_t frameIndex = 0;
+    for (uint pos = 0; pos < objStackTop; pos += STACK_UNIT) {
+        // Frame starts with its context and constant pool.
+        if (frameIndex < frameStack.size() && frameStack[frameIndex] == pos) {
+            auto * context = *((Context**)(objStack + pos));
+            for (auto & [name, value] : context->variables) {
+                keys.push_back(name);
+                slots.push_back(&keys.back());
+                slots.push_back(&value);
+            }
+            pos += STACK_UNIT;
+            frameIndex++;
+            continue;
+        }
+        slots.push_back((Obj**)(objStack + pos));
+    }
+}
+
+void ExecStack::ReplaceKeys(const std::unordered_map<Obj*, Obj*> & forwarding) {
+    std::vector<Obj*> movedNames;
+    for (uint framePos : frameStack) {
+        auto * context = *((Context**)(objStack + framePos));
+        auto & variables = context->variables;
+        movedNames.clear();
+        for (auto & [name, value] : variables) {
+            if (forwarding.count(name) != 0)
+                movedNames.push_back(name);
+        }
+        for (auto * name : movedNames) {
+            auto node = variables.extract(name);
+            node.key() = forwarding.at(name);
+            variables.insert(std::move(node));
+        }
+    }
+}
+
 void ExecStack::PrintFrames() {
     if (frameStack.empty())
         return;
 
-    uint lastFramePos = frameStack.top();
+    uint lastFramePos = frameStack.back();
     auto * context = *((Context**)(objStack + lastFramePos));
     context->Print();
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 
-void VM::Init() {
+// Prints the allocation profile collected so far.
+static Obj * Builtin_AllocStat() {
+    if (!AllocProfiler::enabled)
+        std::cout << "\nAllocation profiler is disabled, set VIRGO_ALLOC_PROFILE=1.";
+    else
+        AllocProfiler::Print();
+    return (Obj*)None::none;
+}
+
+// Process wide initialization. Creates types, shared constants,
+// and the VM of the main thread.
+void VM::Init(GcPolicy * gcPolicy) {
+    if (gcPolicy != nullptr)
+        Heap::gcPolicy = gcPolicy;
+
+    // VIRGO_ALLOC_PROFILE=1 enables allocation profiling,
+    // the report is printed at exit.
+    if (const char * profile = std::getenv("VIRGO_ALLOC_PROFILE"); profile != nullptr && *profile != '0')
+        AllocProfiler::Enable(true);
+
+    // VIRGO_GC_LOG=<path> enables gc telemetry and writes its events
+    // to the file as JSON lines.
+    if (const char * gcLog = std::getenv("VIRGO_GC_LOG"); gcLog != nullptr && *gcLog != '\0') {
+        GcTelemetry::Enable();
+        if (!GcTelemetry::OpenLog(gcLog))
+            std::cerr << "\nCan't open gc log: " << gcLog;
+    }
+
+    // VIRGO_HEAP_SNAPSHOT=<path prefix> makes SIGUSR2 write a heap snapshot.
+    if (const char * snapshot = std::getenv("VIRGO_HEAP_SNAPSHOT"); snapshot != nullptr && *snapshot != '\0')
+        HeapSnapshot::InstallSignalHandler(snapshot);
+
     Heap::Init();
     //Heap::PreDomainGc = ?;
     //Heap::PreGlobalGc = ?;
+    Heap::GetRootSlots = &GetRootSlots;
+    Heap::RootsMoved   = &RootsMoved;
 
     None::InitType();
-    VM::NoneId = GetConstantId_Obj((Obj*)None::none);
-
     Error::InitType();
-
     Bool::InitType();
-    VM::TrueId  = GetConstantId_Obj((Obj*)Bool::True);
-    VM::FalseId = GetConstantId_Obj((Obj*)Bool::False);
-
+    Bool::InitConstants();
     Int::InitType();
     Real::InitType();
     Str::InitType();
@@ -111,68 +212,86 @@ void VM::Init() {
 
     Builtins::ZeroNamespace::Init();
     */
+
+    AddBuiltin("AllocStat", &Builtin_AllocStat);
+
+    New();
 }
 
-uint                        VM::nextId;
-std::vector<Obj*>           VM::constants;
-std::map<v_int, uint>       VM::constantsId_Int{};
-std::map<v_real, uint>      VM::constantsId_Real{};
-std::map<std::string, uint> VM::constantsId_Str{};
-uint                        VM::NoneId;
-uint                        VM::TrueId;
-uint                        VM::FalseId;
-std::array<void*, 1024>     VM::objStack;
-int                         VM::objStackTop = -1;
-std::stack<uint>            VM::frameStack;
+// Creates a VM for the current thread and makes it current.
+// Shared constants are registered first in the same order,
+// so their ids are the same in all VMs and scripts.
+// Deletes the VM of a thread when it exits. It's created after the heap
+// of the thread, so it's destroyed before the heap is freed.
+struct ThreadVMOwner {
+    ~ThreadVMOwner() {
+        delete VM::current;
+    }
+};
+
+VM * VM::New() {
+    if (Heap::babyDomain == nullptr)
+        Heap::InitThread();
+    static thread_local ThreadVMOwner owner;
+
+    auto * vm = new VM();
+    current = vm;
+    vm->constantPool.AddShared();
+    NoneId  = 0;
+    TrueId  = 1;
+    FalseId = 2;
+    return vm;
+}
 
-uint VM::GetConstantId_Int(v_int val) {
-    if (constantsId_Int.count(val) > 0)
-        return constantsId_Int[val];
+VM::VM() = default;
 
-    void * inPlace = Heap::GetChunk_Constant(sizeof(Int));
-    Int::New(inPlace, val);
-    constants.push_back((Obj*)inPlace);
-    uint id = nextId;
-    nextId++;
-    constantsId_Int[val] = id;
-    return id;
+VM::~VM() {
+    if (current == this)
+        current = nullptr;
+    for (auto * execStack : execStacks)
+        execStack->vm = nullptr;
+    for (auto * domain : frozenDomains)
+        delete domain;
+}
+
+thread_local VM * VM::current;
+std::vector<VM::Builtin> VM::builtins;
+uint              VM::NoneId;
+uint              VM::TrueId;
+uint              VM::FalseId;
+
+// Pool of the current compile unit or of the VM.
+static inline ConstantPool & CurrentPool() {
+    ConstantPool * pool = ConstantPool::current;
+    return pool != nullptr ? *pool : VM::current->constantPool;
+}
+
+uint VM::GetConstantId_Int(v_int val) {
+    return CurrentPool().GetId_Int(val);
 }
 
 uint VM::GetConstantId_Real(v_real val) {
-    if (constantsId_Real.count(val) > 0)
-        return constantsId_Real[val];
+    return CurrentPool().GetId_Real(val);
+}
 
-    void * inPlace = Heap::GetChunk_Constant(sizeof(Real));
-    Real::New(inPlace, val);
-    constants.push_back((Obj*)inPlace);
-    uint id = nextId;
-    nextId++;
-    constantsId_Real[val] = id;
-    return id;
+std::size_t VM::HashStr(std::string_view val) {
+    return ConstantPool::HashStr(val);
 }
 
-uint VM::GetConstantId_Str(const std::string & val) {
-    if (constantsId_Str.count(val) > 0)
-        return constantsId_Str[val];
+uint VM::GetConstantId_Str(std::string_view val) {
+    return GetConstantId_Str(val, HashStr(val));
+}
 
-    void * inPlace = Heap::GetChunk_Constant(sizeof(Real));
-    Str::New(inPlace, val.c_str());
-    constants.push_back((Obj*)inPlace);
-    uint id = nextId;
-    nextId++;
-    constantsId_Str[val] = id;
-    return id;
+uint VM::GetConstantId_Str(std::string_view val, std::size_t hash) {
+    return CurrentPool().GetId_Str(val, hash);
 }
 
 uint VM::GetConstantId_Obj(Obj * obj) {
-    constants.push_back(obj);
-    uint id = nextId;
-    nextId++;
-    return id;
+    return CurrentPool().Add(obj);
 }
 
 Obj * VM::GetConstantById(uint id) {
-    return constants.at(id);
+    return CurrentPool().Get(id);
 }
 
 std::string VM::ConstantToStr(uint id) {
@@ -187,11 +306,132 @@ std::string VM::ConstantToStr(uint id) {
     return objStr;
 }
 
-void VM::Execute(const ByteCode & byteCode) {
-    ByteCodeReader bcr(byteCode);
+void VM::InternConstants(const ConstantPool & pool) {
+    ConstantPool & vmPool = current->constantPool;
+    for (uint id = ConstantPool::NUM_OF_SHARED; id < pool.Size(); id++) {
+        Obj * obj = pool.Get(id);
+        if (obj->type == Int::t) {
+            vmPool.GetId_Int(((Int*)obj)->val);
+        } else if (obj->type == Real::t) {
+            vmPool.GetId_Real(((Real*)obj)->val);
+        } else if (obj->type == Str::t) {
+            std::string_view val(((Str*)obj)->val, ((Str*)obj)->len);
+            vmPool.GetId_Str(val, ConstantPool::HashStr(val));
+        }
+    }
+}
+
+void VM::FreezeConstants() {
+    VM & vm = *current;
+    ConstantPool & pool = vm.constantPool;
+    pool.domain->Freeze();
+    vm.frozenDomains.push_back(pool.domain);
+    pool.domain = ConstantPool::NewDomain();
+}
+
+bool VM::SaveConstantImage(const std::string & path) {
+    VM & vm = *current;
+    if (!vm.frozenDomains.empty())
+        return false; // Constants are spread over several domains.
+    return vm.constantPool.domain->WriteImage(path, vm.constantPool.objects);
+}
+
+bool VM::LoadConstantImage(const std::string & path) {
+    VM & vm = *current;
+    // Ids of the image are valid only if the VM has nothing but
+    // the shared constants.
+    ConstantPool & pool = vm.constantPool;
+    if (pool.Size() != ConstantPool::NUM_OF_SHARED)
+        return false;
+
+    std::vector<Obj*> roots;
+    MemDomain * domain = MemDomain::LoadImage(path, roots);
+    if (domain == nullptr)
+        return false;
+
+    // Shared constants are not in the image.
+    for (uint id = ConstantPool::NUM_OF_SHARED; id < roots.size(); id++) {
+        Obj * obj = roots[id];
+        if (obj == nullptr) {
+            delete domain;
+            pool.objects.resize(ConstantPool::NUM_OF_SHARED);
+            pool.ids_Int.Clear();
+            pool.ids_Real.Clear();
+            pool.ids_Str.Clear();
+            return false;
+        }
+        pool.Add(obj);
+        pool.Index(id);
+    }
+    vm.frozenDomains.push_back(domain);
+    return true;
+}
+
+void VM::AddBuiltin(const std::string & name, BuiltinFunction function) {
+    assert(FindBuiltin(name) == -1);
+    builtins.push_back({name, function});
+}
+
+int VM::FindBuiltin(std::string_view name) {
+    for (std::size_t i = 0; i < builtins.size(); i++)
+        if (builtins[i].name == name)
+            return (int)i;
+    return -1;
+}
+
+void VM::SetMemoryLimit(std::size_t bytes) {
+    Heap::budget.limitBytes = bytes;
+}
+
+bool VM::Execute(const ByteCode & byteCode) {
     ExecStack execStack;
+    return Execute(byteCode, execStack, 0);
+}
+
+bool VM::Execute(const ByteCode & byteCode, ExecStack & execStack, uint startPos) {
+    VM & vm = *current;
+    vm.error.clear();
+    std::size_t numOfFrames = execStack.frameStack.size();
+    uint        top         = execStack.objStackTop;
+    try {
+        Run(byteCode, execStack, startPos);
+        return true;
+    } catch (const OutOfMemoryError & e) {
+        // The script is stopped, but the host keeps running. Objects
+        // of the script became garbage, the heap gives their memory back.
+        // Frames the host had before are kept, with their variables.
+        execStack.Unwind(numOfFrames, top);
+        vm.error = e.what();
+        AllocProfiler::SetSite(nullptr, 0);
+        Heap::GlobalGc();
+        return false;
+    }
+}
+
+void VM::Run(const ByteCode & byteCode, ExecStack & execStack, uint startPos) {
+    VM & vm = *current;
+    ByteCodeReader bcr(byteCode, startPos);
+    if (bcr.IsAtEnd())
+        return;
+
+    // Constants of the frame by ids, the pool doesn't grow while code runs.
+    ConstantPool * constantPool = byteCode.constantPool != nullptr ? byteCode.constantPool : &vm.constantPool;
+    Obj * const *  constants    = execStack.GetConstants();
     for (;;)
     {
+        Heap::SafePoint();
+
+        if (AllocProfiler::enabled)
+            AllocProfiler::SetSite(&byteCode, bcr.pos);
+
+        if (HeapSnapshot::isRequested) {
+            std::vector<MemDomain*> domains { vm.constantPool.domain };
+            if (constantPool != &vm.constantPool)
+                domains.push_back(constantPool->domain);
+            domains.insert(domains.end(), vm.frozenDomains.begin(), vm.frozenDomains.end());
+            HeapSnapshot::WriteRequested(domains);
+        }
+
         OpCode opCode = bcr.Read_OpCode();
         switch (opCode)
         {
@@ -200,28 +440,29 @@ void VM::Execute(const ByteCode & byteCode) {
 
             case OpCode::NewContext:
             {
-                execStack.NewContext();
+                execStack.NewContext(constantPool);
+                constants = execStack.GetConstants();
                 break;
             }
 
             case OpCode::CloseContext:
             {
                 execStack.CloseContext();
+                constants = execStack.GetConstants();
                 break;
             }
 
             case OpCode::PushConstant:
             {
                 OpArg id = bcr.Read_OpArg();
-                auto * constantObj = GetConstantById(id);
-                execStack.PushObj(constantObj);
+                execStack.PushObj(constants[id]);
                 break;
             }
 
             case OpCode::GetLocalVariable:
             {
                 OpArg  id      = bcr.Read_OpArg();
-                Obj  * name    = GetConstantById(id);
+                Obj  * name    = constants[id];
                 auto * context = execStack.GetLastContext();
                 Obj  * result  = context->GetVariable(name);
                 HandlePossibleError(result);
@@ -232,221 +473,221 @@ void VM::Execute(const ByteCode & byteCode) {
             case OpCode::SetLocalVariable:
             {
                 OpArg  id      = bcr.Read_OpArg();
-                Obj  * name    = GetConstantById(id);
-                auto * obj     = (Obj*)objStack[objStackTop];
-                auto * context = (Context*)objStack[frameStack.top()];
+                Obj  * name    = constants[id];
+                auto * obj     = execStack.PopObj();
+                auto * context = execStack.GetLastContext();
+                Heap::WriteBarrier(obj);
                 auto * result  = context->SetVariable(name, obj);
                 HandlePossibleError(result);
-                objStackTop--;
                 break;
             }
 
             case OpCode::Equal:
             {
-                auto * obj_2  = (Obj*)objStack[objStackTop];
-                auto * obj_1  = (Obj*)objStack[objStackTop - 1];
+                auto * obj_2  = execStack.Peek(0);
+                auto * obj_1  = execStack.Peek(1);
                 auto * method = obj_1->type->methodTable->Equal;
                 if (method == nullptr) {
                     ThrowError_NoSuchOperation(obj_1->type, "'='");
                 }
                 auto * result = method(obj_1, obj_2);
                 HandlePossibleError(result);
-                objStackTop--;
-                objStack[objStackTop] = result;
+                execStack.PopObj();
+                execStack.SetTop(result);
                 break;
             }
 
             case OpCode::NotEqual:
             {
-                auto * obj_2  = (Obj*)objStack[objStackTop];
-                auto * obj_1  = (Obj*)objStack[objStackTop - 1];
+                auto * obj_2  = execStack.Peek(0);
+                auto * obj_1  = execStack.Peek(1);
                 auto * method = obj_1->type->methodTable->Equal;
                 if (method == nullptr) {
                     ThrowError_NoSuchOperation(obj_1->type, "'!='");
                 }
                 auto * result = method(obj_1, obj_2);
                 HandlePossibleError(result);
-                objStackTop--;
-                objStack[objStackTop] = ((Bool*)result)->Invert();
+                execStack.PopObj();
+                execStack.SetTop(((Bool*)result)->Invert());
                 break;
             }
 
             case OpCode::Negate:
             {
-                auto * obj    = (Obj*)objStack[objStackTop];
+                auto * obj    = execStack.Peek(0);
                 auto * method = obj->type->methodTable->Negate;
                 if (method == nullptr) {
                     ThrowError_NoSuchOperation(obj->type, "'-' (negation)");
                 }
                 auto * result = method(obj);
                 HandlePossibleError(result);
-                objStack[objStackTop] = result;
+                execStack.SetTop(result);
                 break;
             }
 
             case OpCode::Add:
             {
-                auto * obj_2  = (Obj*)objStack[objStackTop];
-                auto * obj_1  = (Obj*)objStack[objStackTop - 1];
+                auto * obj_2  = execStack.Peek(0);
+                auto * obj_1  = execStack.Peek(1);
                 auto * method = obj_1->type->methodTable->Add;
                 if (method == nullptr) {
                     ThrowError_NoSuchOperation(obj_1->type, "'+'");
                 }
                 auto * result = method(obj_1, obj_2);
                 HandlePossibleError(result);
-                objStackTop--;
-                objStack[objStackTop] = result;
+                execStack.PopObj();
+                execStack.SetTop(result);
                 break;
             }
 
             case OpCode::Subtract:
             {
-                auto * obj_2  = (Obj*)objStack[objStackTop];
-                auto * obj_1  = (Obj*)objStack[objStackTop - 1];
+                auto * obj_2  = execStack.Peek(0);
+                auto * obj_1  = execStack.Peek(1);
                 auto * method = obj_1->type->methodTable->Subtract;
                 if (method == nullptr) {
                     ThrowError_NoSuchOperation(obj_1->type, "'-'");
                 }
                 auto * result = method(obj_1, obj_2);
                 HandlePossibleError(result);
-                objStackTop--;
-                objStack[objStackTop] = result;
+                execStack.PopObj();
+                execStack.SetTop(result);
                 break;
             }
 
             case OpCode::Multiply:
             {
-                auto * obj_2  = (Obj*)objStack[objStackTop];
-                auto * obj_1  = (Obj*)objStack[objStackTop - 1];
+                auto * obj_2  = execStack.Peek(0);
+                auto * obj_1  = execStack.Peek(1);
                 auto * method = obj_1->type->methodTable->Multiply;
                 if (method == nullptr) {
                     ThrowError_NoSuchOperation(obj_1->type, "'*'");
                 }
                 auto * result = method(obj_1, obj_2);
                 HandlePossibleError(result);
-                objStackTop--;
-                objStack[objStackTop] = result;
+                execStack.PopObj();
+                execStack.SetTop(result);
                 break;
             }
 
             case OpCode::Divide:
             {
-                auto * obj_2  = (Obj*)objStack[objStackTop];
-                auto * obj_1  = (Obj*)objStack[objStackTop - 1];
+                auto * obj_2  = execStack.Peek(0);
+                auto * obj_1  = execStack.Peek(1);
                 auto * method = obj_1->type->methodTable->Divide;
                 if (method == nullptr) {
                     ThrowError_NoSuchOperation(obj_1->type, "'/'");
                 }
                 auto * result = method(obj_1, obj_2);
                 HandlePossibleError(result);
-                objStackTop--;
-                objStack[objStackTop] = result;
+                execStack.PopObj();
+                execStack.SetTop(result);
                 break;
             }
 
             case OpCode::Power:
             {
-                auto * obj_2  = (Obj*)objStack[objStackTop];
-                auto * obj_1  = (Obj*)objStack[objStackTop - 1];
+                auto * obj_2  = execStack.Peek(0);
+                auto * obj_1  = execStack.Peek(1);
                 auto * method = obj_1->type->methodTable->Power;
                 if (method == nullptr) {
                     ThrowError_NoSuchOperation(obj_1->type, "'^'");
                 }
                 auto * result = method(obj_1, obj_2);
                 HandlePossibleError(result);
-                objStackTop--;
-                objStack[objStackTop] = result;
+                execStack.PopObj();
+                execStack.SetTop(result);
                 break;
             }
 
             case OpCode::Greater:
             {
-                auto * obj_2  = (Obj*)objStack[objStackTop];
-                auto * obj_1  = (Obj*)objStack[objStackTop - 1];
+                auto * obj_2  = execStack.Peek(0);
+                auto * obj_1  = execStack.Peek(1);
                 auto * method = obj_1->type->methodTable->Greater;
                 if (method == nullptr) {
                     ThrowError_NoSuchOperation(obj_1->type, "'>'");
                 }
                 auto * result = method(obj_1, obj_2);
                 HandlePossibleError(result);
-                objStackTop--;
-                objStack[objStackTop] = result;
+                execStack.PopObj();
+                execStack.SetTop(result);
                 break;
             }
 
             case OpCode::GreaterOrEqual:
             {
-                auto * obj_2  = (Obj*)objStack[objStackTop];
-                auto * obj_1  = (Obj*)objStack[objStackTop - 1];
+                auto * obj_2  = execStack.Peek(0);
+                auto * obj_1  = execStack.Peek(1);
                 auto * method = obj_1->type->methodTable->GreaterOrEqual;
                 if (method == nullptr) {
                     ThrowError_NoSuchOperation(obj_1->type, "'>='");
                 }
                 auto * result = method(obj_1, obj_2);
                 HandlePossibleError(result);
-                objStackTop--;
-                objStack[objStackTop] = result;
+                execStack.PopObj();
+                execStack.SetTop(result);
                 break;
             }
 
             case OpCode::Less:
             {
-                auto * obj_2  = (Obj*)objStack[objStackTop];
-                auto * obj_1  = (Obj*)objStack[objStackTop - 1];
+                auto * obj_2  = execStack.Peek(0);
+                auto * obj_1  = execStack.Peek(1);
                 auto * method = obj_1->type->methodTable->Less;
                 if (method == nullptr) {
                     ThrowError_NoSuchOperation(obj_1->type, "'<'");
                 }
                 auto * result = method(obj_1, obj_2);
                 HandlePossibleError(result);
-                objStackTop--;
-                objStack[objStackTop] = result;
+                execStack.PopObj();
+                execStack.SetTop(result);
                 break;
             }
 
             case OpCode::LessOrEqual:
             {
-                auto * obj_2  = (Obj*)objStack[objStackTop];
-                auto * obj_1  = (Obj*)objStack[objStackTop - 1];
+                auto * obj_2  = execStack.Peek(0);
+                auto * obj_1  = execStack.Peek(1);
                 auto * method = obj_1->type->methodTable->LessOrEqual;
                 if (method == nullptr) {
                     ThrowError_NoSuchOperation(obj_1->type, "'<='");
                 }
                 auto * result = method(obj_1, obj_2);
                 HandlePossibleError(result);
-                objStackTop--;
-                objStack[objStackTop] = result;
+                execStack.PopObj();
+                execStack.SetTop(result);
                 break;
             }
 
             case OpCode::Not:
             {
-                auto * obj    = (Obj*)objStack[objStackTop];
+                auto * obj    = execStack.Peek(0);
                 auto * result = Bool::Not(obj);
                 HandlePossibleError(result);
-                objStack[objStackTop] = result;
+                execStack.SetTop(result);
                 break;
             }
 
             case OpCode::And:
             {
-                auto * obj_2  = (Obj*)objStack[objStackTop];
-                auto * obj_1  = (Obj*)objStack[objStackTop - 1];
+                auto * obj_2  = execStack.Peek(0);
+                auto * obj_1  = execStack.Peek(1);
                 auto * result = Bool::And(obj_1, obj_2);
                 HandlePossibleError(result);
-                objStackTop--;
-                objStack[objStackTop] = result;
+                execStack.PopObj();
+                execStack.SetTop(result);
                 break;
             }
 
             case OpCode::Or:
             {
-                auto * obj_2  = (Obj*)objStack[objStackTop];
-                auto * obj_1  = (Obj*)objStack[objStackTop - 1];
+                auto * obj_2  = execStack.Peek(0);
+                auto * obj_1  = execStack.Peek(1);
                 auto * result = Bool::Or(obj_1, obj_2);
                 HandlePossibleError(result);
-                objStackTop--;
-                objStack[objStackTop] = result;
+                execStack.PopObj();
+                execStack.SetTop(result);
                 break;
             }
 
@@ -458,11 +699,10 @@ void VM::Execute(const ByteCode & byteCode) {
 
             case OpCode::JumpIfFalse:
             {
-                auto * obj = (Obj*)objStack[objStackTop];
+                auto * obj = execStack.PopObj();
                 if (obj->type != Bool::t) {
                     ThrowError("Condition result must be of a boolean type.");
                 }
-                objStackTop--;
                 if ((Bool*)obj == Bool::True) {
                     bcr.Skip_OpArg();
                     break;
@@ -473,9 +713,9 @@ void VM::Execute(const ByteCode & byteCode) {
 
             case OpCode::Assert:
             {
-                auto * obj_3 = (Obj*)objStack[objStackTop];     // message
-                auto * obj_2 = (Obj*)objStack[objStackTop - 1]; // line
-                auto * obj_1 = (Obj*)objStack[objStackTop - 2]; // bool
+                auto * obj_3 = execStack.Peek(0); // message
+                auto * obj_2 = execStack.Peek(1); // line
+                auto * obj_1 = execStack.Peek(2); // bool
 
                 if (obj_1->type != Bool::t)
                     ThrowError("Asserting expression must be of a boolean type.");
@@ -491,13 +731,27 @@ void VM::Execute(const ByteCode & byteCode) {
                     }
                     ThrowError(s.str());
                 }
-                objStackTop -= 3;
+                execStack.PopObj();
+                execStack.PopObj();
+                execStack.PopObj();
+                break;
+            }
+
+            case OpCode::CallBuiltin:
+            {
+                OpArg  id           = bcr.Read_OpArg();
+                OpArg  numOfResults = bcr.Read_OpArg();
+                Obj  * result       = builtins[id].function();
+                HandlePossibleError(result);
+                if (numOfResults != 0)
+                    execStack.PushObj(result);
                 break;
             }
 
             case OpCode::PushInt32:
             {
-                int32_t i = bcr.Read_int32();
+                // Not emitted by the compiler yet, the value is skipped.
+                bcr.Read_int32();
                 break;
             }
 
@@ -506,11 +760,11 @@ void VM::Execute(const ByteCode & byteCode) {
                 /*
                 OpArg  id      = bcr.Read_OpArg();
                 Obj  * name    = GetConstantById(id);
-                auto * context = (Context*)objStack[frameStack.top()];
+                auto * context = (Context*)vm.objStack[vm.frameStack.top()];
                 Obj  * result  = context->GetVariable(name);
                 HandlePossibleError(result);
-                objStackTop++;
-                objStack[objStackTop] = result;
+                vm.objStackTop++;
+                vm.objStack[vm.objStackTop] = result;
                 break;
                 */
                 break;
@@ -523,6 +777,7 @@ void VM::Execute(const ByteCode & byteCode) {
         if (bcr.IsAtEnd())
             break;
     }
+    AllocProfiler::SetSite(nullptr, 0);
 }
 
 void VM::HandlePossibleError(Obj * obj) {
@@ -551,18 +806,46 @@ void VM::ThrowError_NoSuchOperation(const Type * t, const std::string & opSymbol
     ThrowError(s.str());
 }
 
+// Objects on the stacks of the current VM and variables of their contexts,
+// compaction updates them if moved.
+void VM::GetRootSlots(std::vector<Obj**> & slots) {
+    VM * vm = current;
+    if (vm == nullptr)
+        return;
+
+    // Slots point into rootKeys, so it must not grow while they are filled.
+    std::size_t numOfKeys = 0;
+    for (auto * execStack : vm->execStacks) {
+        for (uint framePos : execStack->frameStack)
+            numOfKeys += (*((Context**)(execStack->objStack + framePos)))->variables.size();
+    }
+    vm->rootKeys.clear();
+    vm->rootKeys.reserve(numOfKeys);
+    for (auto * execStack : vm->execStacks)
+        execStack->GetRootSlots(slots, vm->rootKeys);
+}
+
+void VM::RootsMoved(const std::unordered_map<Obj*, Obj*> & forwarding) {
+    VM * vm = current;
+    if (vm == nullptr)
+        return;
+    for (auto * execStack : vm->execStacks)
+        execStack->ReplaceKeys(forwarding);
+}
+
 void VM::PrintFrames() {
-    if (objStackTop == -1)
+    VM & vm = *current;
+    if (vm.execStacks.empty())
         return;
-    auto * context = (Context*)objStack[frameStack.top()];
-    context->Print();
+    vm.execStacks.back()->PrintFrames();
 }
 
 void VM::PrintConstants() {
-    std::cout << "\n\nConstants (" << nextId << ")";
-    for (uint i = 0; i < nextId; i++) {
+    VM & vm = *current;
+    std::cout << "\n\nConstants (" << vm.constantPool.Size() << ")";
+    for (uint i = 0; i < vm.constantPool.Size(); i++) {
         std::string valStr;
-        auto * val = constants[i];
+        auto * val = vm.constantPool.Get(i);
         auto * method = val->type->methodTable->DebugStr;
         if (method == nullptr) {
             valStr = val->type->name;
@@ -2,6 +2,8 @@
 #define PROTON_VM_H
 
 #include <map>
+#include <memory>
+#include <string_view>
 #include <cstdlib>
 #include <iostream>
 #include <cassert>
@@ -9,58 +11,142 @@
 #include "Obj.h"
 #include "Error.h"
 #include "ByteCode.h"
+#include "ConstantPool.h"
 
+struct Context;
+struct VM;
+
+// Objects on the stack and variables of its contexts are roots of gc,
+// the stack is registered in the VM of the thread that created it.
 struct ExecStack
 {
     std::byte *       objStack{};
     uint              objStackTop{};
     static const uint OBJ_STACK_MAX_SIZE;
     static const uint STACK_UNIT;
-    std::stack<uint>  frameStack;
+    std::vector<uint> frameStack;
     Context *         lastContext{};
+    ConstantPool *    lastConstantPool{};
+    VM *              vm{};
 
     ExecStack();
     ~ExecStack();
 
     void CheckStackOverflow();
-    void NewContext();
+    void NewContext(ConstantPool * constantPool);
     void CloseContext();
+
+    // Drops frames and objects above the given ones, after an error
+    // nothing of the stopped code stays rooted.
+    void Unwind(std::size_t numOfFrames, uint top);
     void PushObj(Obj * obj);
     Obj * PopObj();
+
+    // Object at the given depth, 0 is the top of the stack.
+    inline Obj * Peek(uint depth) {
+        return *((Obj**)(objStack + objStackTop - (depth + 1) * STACK_UNIT));
+    }
+
+    inline void SetTop(Obj * obj) {
+        *((Obj**)(objStack + objStackTop - STACK_UNIT)) = obj;
+    }
+
     Context * GetLastContext();
+    Obj * const * GetConstants();
+
+    // Names of variables are map keys, they are reported
+    // through 'keys' and re-keyed by ReplaceKeys.
+    void GetRootSlots(std::vector<Obj**> & slots, std::vector<Obj*> & keys);
+    void ReplaceKeys(const std::unordered_map<Obj*, Obj*> & forwarding);
     void PrintFrames();
 };
 
 ///////////////////////////////////////////////////////////////////////////////
 
+// VM is an instance of the interpreter (isolate). It owns its constants
+// and stacks, and it runs on the thread that created it, using the heap of
+// this thread. Many VMs may run in parallel on different threads, they share
+// only types and immutable constants (none, true, false).
+// Static functions work with the VM of the current thread.
 struct VM {
-    static uint                        nextId;
-    static std::vector<Obj*>           constants;
-    static std::map<v_int, uint>       constantsId_Int;
-    static std::map<v_real, uint>      constantsId_Real;
-    static std::map<std::string, uint> constantsId_Str;
-    static uint                        NoneId;
-    static uint                        TrueId;
-    static uint                        FalseId;
+    ConstantPool                constantPool;
+    std::vector<MemDomain*>     frozenDomains; // Read-only constants, see FreezeConstants.
+    std::string                 error; // Of the last Execute.
+    std::vector<ExecStack*>     execStacks;
+    std::vector<Obj*>           rootKeys; // See ExecStack::GetRootSlots.
+
+    // Builtins are called from scripts by name without arguments,
+    // e.g. 'AllocStat()', the id of a builtin is its index.
+    using BuiltinFunction = Obj * (*)();
+    struct Builtin {
+        std::string     name;
+        BuiltinFunction function;
+    };
+
+    static thread_local VM *    current;
+    static std::vector<Builtin> builtins;
+    static uint                 NoneId;
+    static uint                 TrueId;
+    static uint                 FalseId;
 
-    static std::array<void*, 1024> objStack;
-    static int                     objStackTop;
-    static std::stack<uint>        frameStack;
+    VM();
+    ~VM();
 
-    static void Init();
+    // Gc policy is optional, by default AdaptiveGcPolicy is used.
+    static void Init(GcPolicy * gcPolicy = nullptr);
 
+    // The VM is deleted when its thread exits, then the heap of the thread.
+    static VM * New();
+
+    // Hard memory limit of the heap of the current VM, 0 means no limit.
+    static void SetMemoryLimit(std::size_t bytes);
+
+    // Builtins are added by Init, before any script is parsed.
+    static void AddBuiltin(const std::string & name, BuiltinFunction function);
+    // Returns -1 if there is no builtin with this name.
+    static int  FindBuiltin(std::string_view name);
+
+    // Constants are interned into ConstantPool::current if it's set.
     static uint  GetConstantId_Int(v_int val);
     static uint  GetConstantId_Real(v_real val);
-    static uint  GetConstantId_Str(const std::string & val);
+    static uint  GetConstantId_Str(std::string_view val);
+    // Hash is HashStr(val), the tokenizer computes it once per lexeme.
+    static uint  GetConstantId_Str(std::string_view val, std::size_t hash);
+    static std::size_t HashStr(std::string_view val);
     static uint  GetConstantId_Obj(Obj * obj);
     static Obj * GetConstantById(uint id);
     static std::string ConstantToStr(uint id);
 
-    static void Execute(const ByteCode & bc);
+    // Copies the values of the constants of a script pool into the VM,
+    // so FreezeConstants and SaveConstantImage cover them, and scripts
+    // compiled later find them there instead of creating their own.
+    static void InternConstants(const ConstantPool & pool);
+
+    // Makes constants created so far read-only, new ones go to a new domain.
+    // Processes forked after that share the pages of the frozen constants.
+    static void FreezeConstants();
+
+    // Constant image lets a worker skip creating the constants of scripts,
+    // it's loaded by a fresh VM before it creates any constants of its own.
+    // Constants of scripts get into the image by InternConstants.
+    static bool SaveConstantImage(const std::string & path);
+    static bool LoadConstantImage(const std::string & path);
+
+    // Returns false if the script was stopped by an error
+    // that the host may survive (out of memory), see VM::error.
+    static bool Execute(const ByteCode & bc);
+
+    // Runs the code from 'startPos' to the end on the given stack, so code
+    // that is added to 'bc' later can continue with the same context.
+    static bool Execute(const ByteCode & bc, ExecStack & execStack, uint startPos);
+    static void Run(const ByteCode & bc, ExecStack & execStack, uint startPos);
     static void HandlePossibleError(Obj * obj);
     static void ThrowError(const std::string & message);
     static void ThrowError_NoSuchOperation(const Type * t, const std::string & opSymbol);
 
+    static void GetRootSlots(std::vector<Obj**> & slots);
+    static void RootsMoved(const std::unordered_map<Obj*, Obj*> & forwarding);
+
     static void PrintConstants();
     static void PrintFrames();
 };
@@ -1,8 +1,150 @@
-#include "Mem.h"
-#include "Testing.h"
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include "VM.h"
+#include "Source.h"
+#include "Tokenizer.h"
+#include "Parser.h"
+#include "Script.h"
 
-int main()
-{
-    RunScript();
+static void PrintUsage() {
+    std::cerr << "Usage: virgo [--timings] [--stream] <file> [args]\n"
+                 "       virgo --test\n"
+                 "       virgo --bench [name]\n"
+                 "    --timings  print time of each phase to stderr\n"
+                 "    --stream   compile and execute the file statement by statement,\n"
+                 "               for very big generated scripts\n"
+                 "    --test     run the tests of the interpreter\n"
+                 "    --bench    run the benchmarks, or the one with the given name\n";
+}
+
+static int RunTests() {
+    VM::Init();
+    Test_Tokenizer();
+    Test_Mem();
+    Test_Script();
+    std::cout << "Tests passed.\n";
+    return 0;
+}
+
+static int RunBenchmarks(const char * name) {
+    struct Benchmark {
+        const char * name;
+        void (*run)();
+    };
+    const Benchmark benchmarks[] = {
+        {"Tokenizer",  &Bench_Tokenizer},
+        {"CompileAll", &Bench_CompileAll},
+        {"GcPause",    &Bench_GcPause},
+        {"ParallelGc", &Bench_ParallelGc},
+    };
+
+    VM::Init();
+    bool isFound = false;
+    for (auto & benchmark : benchmarks) {
+        if (name != nullptr && std::strcmp(name, benchmark.name) != 0)
+            continue;
+        benchmark.run();
+        isFound = true;
+    }
+    if (!isFound) {
+        std::cerr << "Unknown benchmark: " << name << '\n';
+        return 2;
+    }
+    return 0;
+}
+
+// Measures phases of running a script.
+struct PhaseTimer {
+    using Clock = std::chrono::steady_clock;
+
+    bool              isEnabled{};
+    Clock::time_point phaseStart = Clock::now();
+
+    void EndPhase(const char * name) {
+        if (!isEnabled)
+            return;
+        auto now = Clock::now();
+        double ms = std::chrono::duration<double, std::milli>(now - phaseStart).count();
+        std::cerr << std::left << std::setw(10) << name
+                  << std::right << std::fixed << std::setprecision(3) << std::setw(12) << ms << " ms\n";
+        phaseStart = now;
+    }
+};
+
+int main(int argc, char * argv[]) {
+    PhaseTimer timer;
+    bool isStreaming = false;
+    const char * path = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--timings") == 0) {
+            timer.isEnabled = true;
+        } else if (std::strcmp(argv[i], "--stream") == 0) {
+            isStreaming = true;
+        } else if (std::strcmp(argv[i], "--test") == 0) {
+            return RunTests();
+        } else if (std::strcmp(argv[i], "--bench") == 0) {
+            return RunBenchmarks(i + 1 < argc ? argv[i + 1] : nullptr);
+        } else if (argv[i][0] == '-') {
+            std::cerr << "Unknown option: " << argv[i] << '\n';
+            PrintUsage();
+            return 2;
+        } else {
+            // The rest of arguments belong to the script.
+            path = argv[i];
+            break;
+        }
+    }
+    if (path == nullptr) {
+        PrintUsage();
+        return 2;
+    }
+
+    timer.phaseStart = PhaseTimer::Clock::now();
+    VM::Init();
+    timer.EndPhase("init");
+
+    auto source = Source::FromFile(path);
+    if (source == nullptr) {
+        std::cerr << "Can't read file: " << path << '\n';
+        return 1;
+    }
+    timer.EndPhase("load");
+
+    if (isStreaming) {
+        Script script;
+        bool isOk = script.Stream(std::move(source), true);
+        timer.EndPhase("stream");
+        return isOk ? 0 : 1;
+    }
+
+    Tokenizer tokenizer;
+    tokenizer.Tokenize(std::move(source));
+    if (tokenizer.HasError()) {
+        std::cerr << tokenizer.GetErrorMessage();
+        return 1;
+    }
+    timer.EndPhase("tokenize");
+
+    Parser parser;
+    Script * script = nullptr;
+    try {
+        script = parser.Parse(tokenizer.TakeTokens());
+        timer.EndPhase("parse");
+
+        script->Compile();
+        timer.EndPhase("compile");
+    } catch (const SyntaxError & error) {
+        std::cerr << error.what() << '\n';
+        return 1;
+    }
+
+    bool isOk = script->Execute();
+    timer.EndPhase("execute");
+    if (!isOk) {
+        std::cerr << VM::current->error << '\n';
+        return 1;
+    }
     return 0;
 }